@@ -0,0 +1,419 @@
+/*
+ * Description: 按线程和NUMA节点划分的内存区域。内存直接通过mmap向内核申请，先尝试
+ *              hugetlb的2MB大页，没有预留大页时退回到普通页并建议内核使用透明大页，
+ *              再用mbind把映射优先放在arena所在的NUMA节点上（不依赖libnuma）。
+ *              不超过ARENA_SMALL_MAX字节的小对象从2MB的块中切出，释放后按16字节
+ *              的大小类放入空闲链表复用，不带任何头部；更大的内存单独映射，
+ *              前面有一个记录映射大小的头部，扩大时普通页用mremap，不需要复制。
+ *              每个节点映射、使用的字节数用原子变量统计，可以在任意线程读取
+ * Author:      Denny
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "arena.h"
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB    (21 << 26)
+#endif
+
+#define ARENA_ALIGN     16                              /* 小对象的对齐和大小类的间隔 */
+#define ARENA_CLASSES   (ARENA_SMALL_MAX / ARENA_ALIGN)
+#define ARENA_HEADER    64                              /* 块和大块内存头部占用的字节数 */
+
+/* 小对象块的头部，块之间连成链表，arena释放时一起归还 */
+struct arena_chunk{
+    struct arena_chunk *next;
+    bool huge;
+};
+
+/* 单独映射的大块内存的头部 */
+struct arena_big{
+    size_t mapped;                      /* 映射的字节数，包括头部 */
+    bool huge;
+};
+
+struct arena{
+    int node;                           /* 所在的NUMA节点 */
+    char *cur;                          /* 当前块中尚未分配的部分 */
+    char *end;
+    struct arena_chunk *chunks;
+    void *free_list[ARENA_CLASSES];     /* 每个大小类的空闲对象，对象的头8字节存下一个 */
+};
+
+/* 每个节点的统计，多个线程的arena同时更新 */
+static struct{
+    atomic_size_t mapped;
+    atomic_size_t huge;
+    atomic_size_t in_use;
+    atomic_uint arenas;
+} usage[ARENA_MAX_NODES];
+static atomic_int max_node = 0;
+
+static __thread struct arena *thread_arena = NULL;
+
+static int stat_node(int node)
+{
+    return node >= 0 && node < ARENA_MAX_NODES ? node : 0;
+}
+
+/* 调用线程当前所在的NUMA节点，取不到时为0 */
+static int current_node(void)
+{
+    unsigned cpu = 0, node = 0;
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+    {
+        return 0;
+    }
+    return (int)node;
+}
+
+/* 让映射的物理页优先从node分配，节点内存不足时仍可以使用其他节点，失败时忽略 */
+static void bind_node(void *p, size_t size, int node)
+{
+    unsigned long mask[ARENA_MAX_NODES / (8 * sizeof(unsigned long))];
+    if(node < 0 || node >= ARENA_MAX_NODES)
+    {
+        return;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, ARENA_MAX_NODES + 1, 0);
+}
+
+/*
+ * 映射size字节。size是大页整数倍时先试hugetlb大页，失败时映射普通页：多映射一个
+ * 大页的长度再裁掉首尾，使起始地址按2MB对齐，透明大页才能整页使用
+ */
+static void *map_pages(size_t size, int node, bool *huge)
+{
+    void *p = MAP_FAILED;
+    *huge = false;
+    if(size % ARENA_HUGE_PAGE == 0)
+    {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        *huge = (p != MAP_FAILED);
+    }
+    if(p == MAP_FAILED && size >= ARENA_HUGE_PAGE)
+    {
+        char *raw = (char *)mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(raw == MAP_FAILED)
+        {
+            return NULL;
+        }
+        char *start = (char *)(((unsigned long)raw + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1));
+        if(start > raw)
+        {
+            munmap(raw, start - raw);
+        }
+        munmap(start + size, raw + ARENA_HUGE_PAGE - start);
+        madvise(start, size, MADV_HUGEPAGE);
+        p = start;
+    }
+    else if(p == MAP_FAILED)
+    {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED)
+        {
+            return NULL;
+        }
+    }
+    /* hugetlb的页在第一次访问时才分配，mbind在这之前设置即可 */
+    bind_node(p, size, node);
+
+    int s = stat_node(node);
+    atomic_fetch_add(&usage[s].mapped, size);
+    if(*huge)
+    {
+        atomic_fetch_add(&usage[s].huge, size);
+    }
+    return p;
+}
+
+static void unmap_pages(void *p, size_t size, bool huge, int node)
+{
+    int s = stat_node(node);
+    munmap(p, size);
+    atomic_fetch_sub(&usage[s].mapped, size);
+    if(huge)
+    {
+        atomic_fetch_sub(&usage[s].huge, size);
+    }
+}
+
+/* 映射一个新块，块的剩余部分丢弃，之后从新块中切 */
+static struct arena_chunk *new_chunk(int node)
+{
+    bool huge;
+    struct arena_chunk *c = (struct arena_chunk *)map_pages(ARENA_HUGE_PAGE, node, &huge);
+    if(!c)
+    {
+        return NULL;
+    }
+    c->next = NULL;
+    c->huge = huge;
+    return c;
+}
+
+/* 在node上创建arena，node为负数时使用调用线程所在的节点。arena本身放在第一个块中 */
+struct arena *arena_new(int node)
+{
+    if(node < 0)
+    {
+        node = current_node();
+    }
+    struct arena_chunk *c = new_chunk(node);
+    if(!c)
+    {
+        return NULL;
+    }
+    struct arena *a = (struct arena *)((char *)c + ARENA_HEADER);
+    memset(a, 0, sizeof(*a));
+    a->node = node;
+    a->chunks = c;
+    a->cur = (char *)c + ARENA_HEADER + ((sizeof(*a) + ARENA_HEADER - 1) & ~(size_t)(ARENA_HEADER - 1));
+    a->end = (char *)c + ARENA_HUGE_PAGE;
+
+    atomic_fetch_add(&usage[stat_node(node)].arenas, 1);
+    int max = atomic_load(&max_node);
+    while(node + 1 > max && !atomic_compare_exchange_weak(&max_node, &max, node + 1))
+    {
+    }
+    return a;
+}
+
+/* 释放arena的所有块，单独映射的大块内存要在这之前用arena_dealloc释放 */
+void arena_free(struct arena *a)
+{
+    if(!a)
+    {
+        return;
+    }
+    int node = a->node;
+    struct arena_chunk *c = a->chunks;
+    if(a == thread_arena)
+    {
+        thread_arena = NULL;
+    }
+    atomic_fetch_sub(&usage[stat_node(node)].arenas, 1);
+    /* arena本身在最后一个块（第一个映射的块）中，先取出链表再逐个释放 */
+    while(c)
+    {
+        struct arena_chunk *next = c->next;
+        unmap_pages(c, ARENA_HUGE_PAGE, c->huge, node);
+        c = next;
+    }
+}
+
+/* 调用线程的arena，第一次调用时在线程当前所在的节点上创建，之后一直使用到进程退出 */
+struct arena *arena_thread(void)
+{
+    if(!thread_arena)
+    {
+        thread_arena = arena_new(-1);
+    }
+    return thread_arena;
+}
+
+int arena_node(const struct arena *a)
+{
+    return a ? a->node : -1;
+}
+
+static size_t big_size(size_t size)
+{
+    size_t total = size + ARENA_HEADER;
+    size_t page = total >= ARENA_HUGE_PAGE ? ARENA_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+    return (total + page - 1) & ~(page - 1);
+}
+
+static void *big_alloc(struct arena *a, size_t size)
+{
+    bool huge;
+    size_t mapped = big_size(size);
+    struct arena_big *b = (struct arena_big *)map_pages(mapped, a->node, &huge);
+    if(!b)
+    {
+        return NULL;
+    }
+    b->mapped = mapped;
+    b->huge = huge;
+    return (char *)b + ARENA_HEADER;
+}
+
+static struct arena_big *big_header(void *p)
+{
+    return (struct arena_big *)((char *)p - ARENA_HEADER);
+}
+
+/* 分配size字节，小对象按16字节对齐，大块内存按64字节对齐 */
+void *arena_alloc(struct arena *a, size_t size)
+{
+    if(!a)
+    {
+        return malloc(size);
+    }
+    if(size > ARENA_SMALL_MAX)
+    {
+        void *p = big_alloc(a, size);
+        if(p)
+        {
+            atomic_fetch_add(&usage[stat_node(a->node)].in_use, size);
+        }
+        return p;
+    }
+
+    size_t cls = size ? (size - 1) / ARENA_ALIGN : 0;
+    size_t bytes = (cls + 1) * ARENA_ALIGN;
+    void *p = a->free_list[cls];
+    if(p)
+    {
+        a->free_list[cls] = *(void **)p;
+    }
+    else
+    {
+        if(a->cur + bytes > a->end)
+        {
+            struct arena_chunk *c = new_chunk(a->node);
+            if(!c)
+            {
+                return NULL;
+            }
+            c->next = a->chunks;
+            a->chunks = c;
+            a->cur = (char *)c + ARENA_HEADER;
+            a->end = (char *)c + ARENA_HUGE_PAGE;
+        }
+        p = a->cur;
+        a->cur += bytes;
+    }
+    atomic_fetch_add(&usage[stat_node(a->node)].in_use, bytes);
+    return p;
+}
+
+/* 分配并清零。新映射的页本来就是0，只有复用的小对象需要清零 */
+void *arena_calloc(struct arena *a, size_t size)
+{
+    if(!a)
+    {
+        return calloc(1, size);
+    }
+    void *p = arena_alloc(a, size);
+    if(p && size <= ARENA_SMALL_MAX)
+    {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+/* 释放arena_alloc分配的size字节 */
+void arena_dealloc(struct arena *a, void *p, size_t size)
+{
+    if(!a)
+    {
+        free(p);
+        return;
+    }
+    if(!p)
+    {
+        return;
+    }
+    if(size > ARENA_SMALL_MAX)
+    {
+        struct arena_big *b = big_header(p);
+        atomic_fetch_sub(&usage[stat_node(a->node)].in_use, size);
+        unmap_pages(b, b->mapped, b->huge, a->node);
+        return;
+    }
+    size_t cls = size ? (size - 1) / ARENA_ALIGN : 0;
+    *(void **)p = a->free_list[cls];
+    a->free_list[cls] = p;
+    atomic_fetch_sub(&usage[stat_node(a->node)].in_use, (cls + 1) * ARENA_ALIGN);
+}
+
+/*
+ * 把old字节的p调整为size字节。大块内存在映射范围内直接使用，普通页用mremap扩大，
+ * 物理页和NUMA策略保持不变；其余情况分配新内存并复制
+ */
+void *arena_realloc(struct arena *a, void *p, size_t old, size_t size)
+{
+    if(!a)
+    {
+        return realloc(p, size);
+    }
+    if(!p)
+    {
+        return arena_alloc(a, size);
+    }
+    if(old > ARENA_SMALL_MAX && size > ARENA_SMALL_MAX)
+    {
+        struct arena_big *b = big_header(p);
+        int s = stat_node(a->node);
+        if(size + ARENA_HEADER <= b->mapped)
+        {
+            atomic_fetch_add(&usage[s].in_use, size);
+            atomic_fetch_sub(&usage[s].in_use, old);
+            return p;
+        }
+        if(!b->huge)
+        {
+            size_t mapped = big_size(size);
+            void *q = mremap(b, b->mapped, mapped, MREMAP_MAYMOVE);
+            if(q != MAP_FAILED)
+            {
+                atomic_fetch_add(&usage[s].mapped, mapped - ((struct arena_big *)q)->mapped);
+                ((struct arena_big *)q)->mapped = mapped;
+                atomic_fetch_add(&usage[s].in_use, size);
+                atomic_fetch_sub(&usage[s].in_use, old);
+                return (char *)q + ARENA_HEADER;
+            }
+        }
+    }
+    else if(old <= ARENA_SMALL_MAX && size <= ARENA_SMALL_MAX
+            && (old ? (old - 1) / ARENA_ALIGN : 0) == (size ? (size - 1) / ARENA_ALIGN : 0))
+    {
+        return p;
+    }
+
+    void *q = arena_alloc(a, size);
+    if(!q)
+    {
+        return NULL;
+    }
+    memcpy(q, p, old < size ? old : size);
+    arena_dealloc(a, p, old);
+    return q;
+}
+
+/* 创建过arena的最大节点号加1 */
+int arena_nodes(void)
+{
+    return atomic_load(&max_node);
+}
+
+/* 读取node上的内存使用情况 */
+int arena_usage(int node, struct arena_usage *u)
+{
+    if(node < 0 || node >= ARENA_MAX_NODES)
+    {
+        return -1;
+    }
+    u->mapped = atomic_load(&usage[node].mapped);
+    u->huge = atomic_load(&usage[node].huge);
+    u->in_use = atomic_load(&usage[node].in_use);
+    u->arenas = atomic_load(&usage[node].arenas);
+    return 0;
+}
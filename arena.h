@@ -0,0 +1,39 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * 每个线程使用自己的arena，内存从线程所在的NUMA节点分配，尽量使用2MB大页。
+ * arena只能由创建它的线程使用，释放时要给出分配时的大小；arena为NULL时
+ * 所有函数退回到malloc/calloc/realloc/free
+ */
+
+#define ARENA_HUGE_PAGE     (2UL << 20)     /* 大页的大小，也是小对象块的大小 */
+#define ARENA_SMALL_MAX     1024            /* 小对象的最大字节数 */
+#define ARENA_MAX_NODES     64              /* 统计的NUMA节点数上限 */
+
+struct arena;
+
+/* 一个NUMA节点上的内存使用情况 */
+struct arena_usage{
+    size_t mapped;                  /* 向内核申请的字节数 */
+    size_t huge;                    /* 其中hugetlb大页的字节数 */
+    size_t in_use;                  /* 分配出去尚未释放的字节数 */
+    unsigned arenas;                /* 该节点上的arena数 */
+};
+
+struct arena *arena_new(int node);
+void arena_free(struct arena *a);
+struct arena *arena_thread(void);
+int arena_node(const struct arena *a);
+
+void *arena_alloc(struct arena *a, size_t size);
+void *arena_calloc(struct arena *a, size_t size);
+void *arena_realloc(struct arena *a, void *p, size_t old, size_t size);
+void arena_dealloc(struct arena *a, void *p, size_t size);
+
+int arena_nodes(void);
+int arena_usage(int node, struct arena_usage *u);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __ARENA_HPP__
+#define __ARENA_HPP__
+
+/*
+ * Description: 从arena分配内存的标准库分配器，可以用于std::vector和timing_wheel
+ *              的节点数组。默认构造的分配器使用调用线程的arena（arena_thread），
+ *              同一个容器要在创建它的线程中使用
+ * Author:      Denny
+ *
+ * */
+
+#include <cstddef>
+#include <new>
+
+extern "C" {
+#include "arena.h"
+}
+
+template <typename T>
+class arena_allocator
+{
+public:
+    using value_type = T;
+
+    arena_allocator() noexcept : arena_(arena_thread())
+    {
+    }
+
+    explicit arena_allocator(struct arena *a) noexcept : arena_(a)
+    {
+    }
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U> &other) noexcept : arena_(other.get())
+    {
+    }
+
+    T *allocate(std::size_t n)
+    {
+        void *p = arena_alloc(arena_, n * sizeof(T));
+        if(!p)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept
+    {
+        arena_dealloc(arena_, p, n * sizeof(T));
+    }
+
+    struct arena *get() const noexcept
+    {
+        return arena_;
+    }
+
+    template <typename U>
+    bool operator==(const arena_allocator<U> &other) const noexcept
+    {
+        return arena_ == other.get();
+    }
+
+private:
+    struct arena *arena_;
+};
+
+#endif
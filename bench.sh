@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# 压测：分别以epoll和io_uring后端启动服务器，用stress_client持续发送请求，
+# 比较两种后端的吞吐量以及服务器退出时输出的读写路径统计；再以回显模式
+# 比较一写一读的往返次数
+#
+# 用法: ./bench.sh [秒数] [连接数] [端口]
+
+DURATION=${1:-5}
+CONNS=${2:-100}
+PORT=${3:-12345}
+IP=127.0.0.1
+
+run_server()
+{
+    name=$1
+    shift
+    ./list_timer "$@" $IP $PORT > bench_server.log 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf "%-12s " "$name"
+    ./stress_client -d "$DURATION" $CLIENT_OPTS $IP $PORT "$CONNS"
+    kill -TERM $pid
+    wait $pid
+    grep "stats" bench_server.log | sed 's/^/             /'
+    rm -f bench_server.log
+}
+
+CLIENT_OPTS=
+run_server epoll -B epoll
+run_server io_uring -B uring
+
+CLIENT_OPTS=-p
+run_server epoll-echo -B epoll -e
+run_server uring-echo -B uring -e
+
+# 单连接一写一读：比较阻塞等待和忙轮询的往返次数，忙轮询的CPU开销见 busy poll stats。
+# 忙轮询需要服务器和客户端在不同的CPU上，单CPU的机器上空转会抢占客户端
+CONNS=1
+run_server epoll-1conn -B epoll -e
+run_server busy-poll -B epoll -e -y 1000 -C 0
@@ -0,0 +1,212 @@
+/*
+ * Description: 比较协程等待（co_await sleep_for）与直接使用时间轮的开销。n个等待者
+ *              各自以固定的超时值反复等待rounds次，三种实现使用相同的超时值：
+ *              协程版本每次等待在协程帧中的awaiter里挂上定时器节点；intrusive版本
+ *              直接把节点挂到intrusive_timing_wheel上；timing_wheel版本每次到期后
+ *              在回调中重新添加定时器。时间轮由tick()驱动，不依赖真实时间，同时
+ *              统计等待期间的内存分配次数
+ * Author:      Denny
+ *
+ * */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "coro_timer.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+/* 统计operator new的调用次数 */
+static std::atomic<unsigned long> allocs{0};
+
+void *operator new(std::size_t size)
+{
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(size ? size : 1);
+    if(!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+struct result
+{
+    double wait;                        /* 每次等待的开销 */
+    unsigned long waits;
+    unsigned long allocs;               /* 等待期间的内存分配次数 */
+};
+
+static double ns_per_op(bench_clock::time_point start, unsigned long n)
+{
+    std::chrono::duration<double, std::nano> d = bench_clock::now() - start;
+    return n ? d.count() / n : 0.0;
+}
+
+static task sleeper(event_loop &loop, std::chrono::milliseconds d, int rounds, unsigned long &waits)
+{
+    for(int i = 0; i < rounds; i++)
+    {
+        co_await sleep_for(loop, d);
+        waits++;
+    }
+}
+
+static result bench_coro(const std::vector<int> &timeouts, int rounds)
+{
+    result r;
+    unsigned long waits = 0;
+    event_loop loop;
+
+    /* 协程帧在spawn时分配，不计入等待的开销 */
+    for(int t : timeouts)
+    {
+        loop.spawn(sleeper(loop, std::chrono::milliseconds(t), rounds, waits));
+    }
+
+    unsigned long a = allocs.load();
+    auto start = bench_clock::now();
+    while(!loop.timers().empty())
+    {
+        loop.tick();
+    }
+    r.wait = ns_per_op(start, waits);
+    r.allocs = allocs.load() - a;
+    r.waits = waits;
+    return r;
+}
+
+/* 直接使用侵入式时间轮：到期动作中把节点重新挂上去 */
+struct raw_sleeper : wheel_hook
+{
+    std::uint64_t timeout;
+    int left;
+};
+
+struct raw_fire;
+using raw_wheel = intrusive_timing_wheel<4096, 1, raw_sleeper, raw_fire>;
+
+struct raw_fire
+{
+    raw_wheel **wheel;
+    unsigned long *waits;
+
+    void operator()(raw_sleeper &s) const
+    {
+        (*waits)++;
+        if(--s.left > 0)
+        {
+            (*wheel)->add(s, s.timeout);
+        }
+    }
+};
+
+static result bench_intrusive(const std::vector<int> &timeouts, int rounds)
+{
+    result r;
+    unsigned long waits = 0;
+    raw_wheel *self = nullptr;
+    raw_wheel wheel(raw_fire{&self, &waits});
+    std::vector<raw_sleeper> sleepers(timeouts.size());
+    self = &wheel;
+
+    for(std::size_t i = 0; i < timeouts.size(); i++)
+    {
+        sleepers[i].timeout = timeouts[i];
+        sleepers[i].left = rounds;
+        wheel.add(sleepers[i], timeouts[i]);
+    }
+
+    unsigned long a = allocs.load();
+    auto start = bench_clock::now();
+    while(!wheel.empty())
+    {
+        wheel.tick();
+    }
+    r.wait = ns_per_op(start, waits);
+    r.allocs = allocs.load() - a;
+    r.waits = waits;
+    return r;
+}
+
+/* 使用timing_wheel：每次到期在回调中添加新的定时器 */
+struct rearm
+{
+    timing_wheel<4096, 1, rearm> *wheel;
+    unsigned long *waits;
+    std::uint64_t timeout;
+    int left;
+
+    void operator()()
+    {
+        (*waits)++;
+        if(--left > 0)
+        {
+            wheel->add(timeout, *this).release();
+        }
+    }
+};
+
+static result bench_wheel(const std::vector<int> &timeouts, int rounds)
+{
+    result r;
+    unsigned long waits = 0;
+    timing_wheel<4096, 1, rearm> wheel(timeouts.size());
+
+    for(int t : timeouts)
+    {
+        wheel.add(t, rearm{&wheel, &waits, (std::uint64_t)t, rounds}).release();
+    }
+
+    unsigned long a = allocs.load();
+    auto start = bench_clock::now();
+    while(!wheel.empty())
+    {
+        wheel.tick();
+    }
+    r.wait = ns_per_op(start, waits);
+    r.allocs = allocs.load() - a;
+    r.waits = waits;
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    std::size_t n = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 100;
+    int max_timeout = 256;
+
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<int> dist(1, max_timeout);
+    std::vector<int> timeouts(n);
+    for(auto &t : timeouts)
+    {
+        t = dist(rng);
+    }
+
+    result coro = bench_coro(timeouts, rounds);
+    result hook = bench_intrusive(timeouts, rounds);
+    result wheel = bench_wheel(timeouts, rounds);
+
+    std::printf("%zu waiters x %d rounds, timeouts 1..%d ticks\n", n, rounds, max_timeout);
+    std::printf("%-36s %10s %10s %10s\n", "", "wait ns", "waits", "allocs");
+    std::printf("%-36s %10.1f %10lu %10lu\n", "co_await sleep_for", coro.wait, coro.waits, coro.allocs);
+    std::printf("%-36s %10.1f %10lu %10lu\n", "intrusive_timing_wheel re-add", hook.wait, hook.waits, hook.allocs);
+    std::printf("%-36s %10.1f %10lu %10lu\n", "timing_wheel<4096, 1> re-add", wheel.wait, wheel.waits, wheel.allocs);
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Description: 多线程竞争下比较无锁跳表、加互斥锁的定时器链表和加互斥锁的二叉堆：
+ *              1到64个生产者线程各自持有一组定时器，每次操作随机选一个，删除它
+ *              （可能已经到期）后重新添加一个超时时间在1到1000个滴答之间的定时器；
+ *              一个消费者线程按真实时间推进滴答（每滴答100微秒）并处理到期的
+ *              定时器。每种情况运行固定的时间，输出每秒完成的删除加添加次数
+ * Author:      Denny
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "list_timer.h"
+#include "skiplist_timer.h"
+
+#define HANDLES     1024            /* 每个生产者持有的定时器数 */
+#define TICK_NS     100000          /* 每个滴答的纳秒数 */
+
+/* 被测试的队列，加锁的版本在每次操作时持有互斥锁 */
+struct queue{
+    struct skiplist *sl;
+    struct timer_ctx *ctx;
+    pthread_mutex_t lock;
+};
+
+struct worker{
+    pthread_t tid;
+    struct queue *q;
+    unsigned seed;
+    unsigned long ops;
+};
+
+static atomic_int stop;
+static _Atomic time_t vnow;
+static unsigned long fired = 0;
+
+static void on_expire(void *arg)
+{
+    (void)arg;
+    fired++;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static timer_id queue_add(struct queue *q, time_t expire)
+{
+    timer_id id;
+    if(q->sl)
+    {
+        return skiplist_add(q->sl, expire, on_expire, NULL);
+    }
+    pthread_mutex_lock(&q->lock);
+    id = timer_add(q->ctx, expire, on_expire, NULL);
+    pthread_mutex_unlock(&q->lock);
+    return id;
+}
+
+static void queue_del(struct queue *q, timer_id id)
+{
+    if(q->sl)
+    {
+        skiplist_del(q->sl, id);
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    timer_del(q->ctx, id);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_poll(struct queue *q, time_t now)
+{
+    if(q->sl)
+    {
+        skiplist_poll(q->sl, now);
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    timer_tick(q->ctx, now);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *producer(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    timer_id *ids = (timer_id *)calloc(HANDLES, sizeof(timer_id));
+    while(!atomic_load_explicit(&stop, memory_order_relaxed))
+    {
+        int k = rand_r(&w->seed) % HANDLES;
+        if(ids[k] != TIMER_INVALID)
+        {
+            queue_del(w->q, ids[k]);
+        }
+        ids[k] = queue_add(w->q, atomic_load_explicit(&vnow, memory_order_relaxed) + 1 + rand_r(&w->seed) % 1000);
+        w->ops++;
+    }
+    free(ids);
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    struct queue *q = (struct queue *)arg;
+    double start = now_ns();
+    while(!atomic_load_explicit(&stop, memory_order_relaxed))
+    {
+        time_t now = (time_t)((now_ns() - start) / TICK_NS);
+        atomic_store_explicit(&vnow, now, memory_order_relaxed);
+        queue_poll(q, now);
+    }
+    return NULL;
+}
+
+/* 返回每秒的操作数 */
+static double run(struct queue *q, int nthreads, double seconds)
+{
+    struct worker *w = (struct worker *)calloc(nthreads, sizeof(struct worker));
+    struct timespec ts;
+    pthread_t cons;
+    unsigned long ops = 0;
+    int i;
+
+    atomic_store(&stop, 0);
+    atomic_store(&vnow, 0);
+    fired = 0;
+    pthread_create(&cons, NULL, consumer, q);
+    double start = now_ns();
+    for(i = 0; i < nthreads; i++)
+    {
+        w[i].q = q;
+        w[i].seed = 12345 + i;
+        pthread_create(&w[i].tid, NULL, producer, &w[i]);
+    }
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, 1);
+    for(i = 0; i < nthreads; i++)
+    {
+        pthread_join(w[i].tid, NULL);
+        ops += w[i].ops;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    pthread_join(cons, NULL);
+    free(w);
+    return ops / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    double seconds = argc > 2 ? atof(argv[2]) : 0.5;
+    int n;
+
+    printf("%d timers per producer, 1 consumer, %.1fs per case, ops = delete + add\n", HANDLES, seconds);
+    printf("%-8s %14s %14s %14s\n", "threads", "skiplist op/s", "list+mutex", "heap+mutex");
+    for(n = 1; n <= max_threads; n *= 2)
+    {
+        struct queue sl = { skiplist_new(), NULL, PTHREAD_MUTEX_INITIALIZER };
+        struct queue list = { NULL, timer_ctx_new(), PTHREAD_MUTEX_INITIALIZER };
+        struct queue heap = { NULL, timer_ctx_new_flags(TIMER_CTX_HEAP), PTHREAD_MUTEX_INITIALIZER };
+
+        double r1 = run(&sl, n, seconds);
+        double r2 = run(&list, n, seconds);
+        double r3 = run(&heap, n, seconds);
+        printf("%-8d %14.0f %14.0f %14.0f\n", n, r1, r2, r3);
+
+        skiplist_free(sl.sl);
+        timer_ctx_free(list.ctx);
+        timer_ctx_free(heap.ctx);
+    }
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Description: 比较定时器链表、二叉堆和惰性删除的二叉堆在大量删除和推迟的场景下的
+ *              开销：n个连接各有一个空闲超时定时器，每次操作随机选一个连接，
+ *              60%是有数据到达（推迟超时），40%是对端关闭后又来了新连接（删除后
+ *              重新添加），每n/4次操作时间前进一秒并处理到期的定时器，绝大多数
+ *              定时器在到期之前就被删除或推迟。idle场景所有连接的超时时间相同，
+ *              超时值单调递增；mixed场景超时时间在1到60秒之间随机。带arena的场景
+ *              定时器上下文从本线程的arena分配，最后输出各NUMA节点的arena用量
+ * Author:      Denny
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "list_timer.h"
+#include "arena.h"
+
+static unsigned long expired = 0;
+
+static void on_expire(void *arg)
+{
+    (void)arg;
+    expired++;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* 返回每次操作的平均纳秒数，max_dead返回过程中墓碑数的最大值 */
+static double run(unsigned flags, struct arena *a, int n, long ops, int mixed, unsigned *max_dead)
+{
+    struct timer_ctx *ctx = timer_ctx_new_arena(flags, a);
+    timer_id *ids = (timer_id *)malloc(n * sizeof(timer_id));
+    time_t now = 0;
+    long i;
+
+    srand(12345);
+    expired = 0;
+    *max_dead = 0;
+    for(i = 0; i < n; i++)
+    {
+        ids[i] = timer_add(ctx, now + (mixed ? 1 + rand() % 60 : 15), on_expire, NULL);
+    }
+
+    double start = now_ns();
+    for(i = 0; i < ops; i++)
+    {
+        int k = rand() % n;
+        int r = rand() % 100;
+        time_t expire = now + (mixed ? 1 + rand() % 60 : 15);
+        if(r < 60)
+        {
+            if(timer_adjust(ctx, ids[k], expire) < 0)
+            {
+                ids[k] = timer_add(ctx, expire, on_expire, NULL);
+            }
+        }
+        else
+        {
+            timer_del(ctx, ids[k]);
+            ids[k] = timer_add(ctx, expire, on_expire, NULL);
+        }
+        if(i % (n / 4) == 0)
+        {
+            now++;
+            timer_tick(ctx, now);
+        }
+        if(timer_dead(ctx) > *max_dead)
+        {
+            *max_dead = timer_dead(ctx);
+        }
+    }
+    double ns = (now_ns() - start) / ops;
+
+    free(ids);
+    timer_ctx_free(ctx);
+    return ns;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    long ops = argc > 2 ? atol(argv[2]) : 5000000;
+    static const struct{
+        const char *name;
+        unsigned flags;
+        int mixed;
+        int arena;
+    } cases[] = {
+        { "list, idle",             0,                               0, 0 },
+        { "list, idle, arena",      0,                               0, 1 },
+        { "heap, idle",             TIMER_CTX_HEAP,                  0, 0 },
+        { "heap lazy, idle",        TIMER_CTX_HEAP | TIMER_CTX_LAZY, 0, 0 },
+        { "heap, mixed",            TIMER_CTX_HEAP,                  1, 0 },
+        { "heap, mixed, arena",     TIMER_CTX_HEAP,                  1, 1 },
+        { "heap lazy, mixed",       TIMER_CTX_HEAP | TIMER_CTX_LAZY, 1, 0 },
+    };
+    unsigned i;
+    int node;
+
+    if(n < 4)
+    {
+        n = 4;
+    }
+    printf("%d timers, %ld operations (60%% adjust, 40%% delete + add)\n", n, ops);
+    printf("%-20s %10s %10s %10s\n", "", "ns/op", "expired", "max dead");
+    for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        unsigned max_dead;
+        double ns = run(cases[i].flags, cases[i].arena ? arena_thread() : NULL,
+                        n, ops, cases[i].mixed, &max_dead);
+        printf("%-20s %10.1f %10lu %10u\n", cases[i].name, ns, expired, max_dead);
+    }
+    for(node = 0; node < arena_nodes(); node++)
+    {
+        struct arena_usage u;
+        if(arena_usage(node, &u) == 0 && u.arenas > 0)
+        {
+            printf("arena node %d: %u arenas, %zu KB mapped, %zu KB huge pages, %zu KB in use\n",
+                   node, u.arenas, u.mapped / 1024, u.huge / 1024, u.in_use / 1024);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Description: 比较C版本的时间轮（wheel_timer.c）和C++模板时间轮（timing_wheel.hpp）
+ *              添加、取消和到期执行定时器的开销。两者使用相同的随机超时值，
+ *              C版本每个定时器单独malloc并通过函数指针调用回调，C++版本的
+ *              节点预先分配，回调是lambda。之后比较定时器数目增长时每个滴答的开销：
+ *              C版本的槽数随定时器数目自动加倍，C++版本的槽数固定为64
+ * Author:      Denny
+ *
+ * */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <netinet/in.h>
+
+extern "C" {
+#include "wheel_timer.h"
+}
+#include "timing_wheel.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double ns_per_op(bench_clock::time_point start, std::size_t n)
+{
+    std::chrono::duration<double, std::nano> d = bench_clock::now() - start;
+    return n ? d.count() / n : 0.0;
+}
+
+struct result
+{
+    double add;
+    double cancel;
+    double expire;
+    std::size_t fired;
+};
+
+static std::size_t c_fired = 0;
+
+static void c_expire(struct client_data *)
+{
+    c_fired++;
+}
+
+/* C版本：初始槽数N和槽间隔SI由wheel_timer.h中的宏决定，槽数随定时器数目变化 */
+static result bench_c(const std::vector<int> &timeouts, int rounds)
+{
+    result r;
+    std::vector<struct wheel_timer *> timers(timeouts.size());
+    struct client_data data;
+    c_fired = 0;
+    init_wheel();
+
+    auto start = bench_clock::now();
+    for(std::size_t i = 0; i < timeouts.size(); i++)
+    {
+        struct wheel_timer *t = add_timer(timeouts[i]);
+        t->cb_func = c_expire;
+        t->user_data = &data;
+        timers[i] = t;
+    }
+    r.add = ns_per_op(start, timeouts.size());
+
+    /* 取消一半的定时器 */
+    start = bench_clock::now();
+    for(std::size_t i = 0; i < timers.size(); i += 2)
+    {
+        del_timer(timers[i]);
+    }
+    r.cancel = ns_per_op(start, timers.size() / 2);
+
+    start = bench_clock::now();
+    for(int i = 0; i < rounds; i++)
+    {
+        tick();
+    }
+    r.fired = c_fired;
+    r.expire = ns_per_op(start, c_fired);
+    return r;
+}
+
+/* C++版本：与C版本相同的槽间隔和初始槽数 */
+template <std::size_t Slots>
+static result bench_cpp(const std::vector<int> &timeouts, int rounds)
+{
+    result r;
+    std::size_t fired = 0;
+    auto on_expire = [&fired] { fired++; };
+    timing_wheel<Slots, SI, decltype(on_expire)> wheel(timeouts.size());
+    std::vector<typename decltype(wheel)::handle> timers;
+    timers.reserve(timeouts.size());
+
+    auto start = bench_clock::now();
+    for(std::size_t i = 0; i < timeouts.size(); i++)
+    {
+        timers.push_back(wheel.add(timeouts[i], on_expire));
+    }
+    r.add = ns_per_op(start, timeouts.size());
+
+    start = bench_clock::now();
+    for(std::size_t i = 0; i < timers.size(); i += 2)
+    {
+        timers[i].cancel();
+    }
+    r.cancel = ns_per_op(start, timers.size() / 2);
+
+    start = bench_clock::now();
+    for(int i = 0; i < rounds; i++)
+    {
+        wheel.tick();
+    }
+    r.fired = fired;
+    r.expire = ns_per_op(start, fired);
+    return r;
+}
+
+struct scale_result
+{
+    double c_tick;                      /* C版本每个滴答的开销 */
+    double cpp_tick;
+    unsigned slots;                     /* C版本最终的槽数 */
+    unsigned longest;                   /* C版本遍历过的最长链表 */
+};
+
+/*
+ * n个定时器的超时值在1..n之间均匀分布，每个滴答平均只有一个定时器到期，
+ * 每个滴答的开销主要是遍历当前槽上还没到期的定时器。先转动ticks个滴答让C版本
+ * 完成槽数的调整和迁移，再测量之后ticks个滴答，测量期间定时器数目变化不大
+ */
+static scale_result bench_scale(std::size_t n, int ticks)
+{
+    scale_result r;
+    std::mt19937 rng(54321);
+    std::uniform_int_distribution<int> dist(1, (int)n);
+    std::vector<int> timeouts(n);
+    struct client_data data;
+    for(auto &t : timeouts)
+    {
+        t = dist(rng) * SI;
+    }
+
+    init_wheel();
+    for(int t : timeouts)
+    {
+        struct wheel_timer *timer = add_timer(t);
+        timer->cb_func = c_expire;
+        timer->user_data = &data;
+    }
+    for(int i = 0; i < ticks; i++)
+    {
+        tick();
+    }
+    auto start = bench_clock::now();
+    for(int i = 0; i < ticks; i++)
+    {
+        tick();
+    }
+    r.c_tick = ns_per_op(start, ticks);
+    r.slots = wh.nslots;
+    r.longest = wh.longest;
+
+    std::size_t fired = 0;
+    auto on_expire = [&fired] { fired++; };
+    timing_wheel<N, SI, decltype(on_expire)> wheel(n);
+    for(int t : timeouts)
+    {
+        wheel.add(t, on_expire).release();
+    }
+    for(int i = 0; i < ticks; i++)
+    {
+        wheel.tick();
+    }
+    start = bench_clock::now();
+    for(int i = 0; i < ticks; i++)
+    {
+        wheel.tick();
+    }
+    r.cpp_tick = ns_per_op(start, ticks);
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    std::size_t n = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    int max_timeout = 4 * N * SI;
+    /* 转动足够多的滴答，保证所有定时器都到期 */
+    int rounds = max_timeout / SI + 2;
+
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<int> dist(1, max_timeout - 1);
+    std::vector<int> timeouts(n);
+    for(auto &t : timeouts)
+    {
+        t = dist(rng);
+    }
+
+    result c = bench_c(timeouts, rounds);
+    result cpp = bench_cpp<N>(timeouts, rounds);
+
+    std::printf("%zu timers, timeouts 1..%d, half cancelled\n", n, max_timeout - 1);
+    std::printf("%-28s %10s %10s %10s %10s\n", "", "add ns", "cancel ns", "expire ns", "fired");
+    std::printf("%-28s %10.1f %10.1f %10.1f %10zu\n", "C wheel_timer (resizing)", c.add, c.cancel, c.expire, c.fired);
+    std::printf("%-28s %10.1f %10.1f %10.1f %10zu\n", "C++ timing_wheel<64, 1>", cpp.add, cpp.cancel, cpp.expire, cpp.fired);
+
+    std::printf("\ntick cost, timeouts 1..n\n");
+    std::printf("%10s %14s %10s %10s %18s\n", "timers", "C tick ns", "slots", "longest", "C++ <64> tick ns");
+    for(std::size_t m = 1000; m <= n; m *= 10)
+    {
+        scale_result s = bench_scale(m, m / 4 < 2000 ? (int)(m / 4) : 2000);
+        std::printf("%10zu %14.1f %10u %10u %18.1f\n", m, s.c_tick, s.slots, s.longest, s.cpp_tick);
+    }
+    return 0;
+}
@@ -0,0 +1,476 @@
+/*
+ * Description: 连接的读写路径。边缘触发模式下每次事件都要把socket读空（或读到
+ *              公平性上限），数据先读入每个线程共享的大接收区，处理完之后只有
+ *              不完整的尾部数据才会拷贝到连接自己的暂存区中；响应先追加到从缓冲池
+ *              分配的输出块中，再用一次writev合并发出，大块数据可以使用MSG_ZEROCOPY
+ * Author:      Denny
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "conn.h"
+
+__thread struct conn_stats conn_stats;
+
+/* 每个线程的接收区，第一次使用时分配 */
+static __thread char *recv_arena = NULL;
+
+static char *get_arena(void)
+{
+    if(!recv_arena)
+    {
+        recv_arena = (char *)malloc(RECV_ARENA_SIZE);
+    }
+    return recv_arena;
+}
+
+/* 保存未处理完的尾部数据，超过暂存上限返回-1 */
+static int save_pending(struct client_data *c, const char *data, int len)
+{
+    if(len == 0)
+    {
+        c->pending_len = 0;
+        return 0;
+    }
+    if(len > PENDING_MAX)
+    {
+        return -1;
+    }
+    if(len > c->pending_cap)
+    {
+        char *buf = (char *)realloc(c->pending, len);
+        if(!buf)
+        {
+            return -1;
+        }
+        c->pending = buf;
+        c->pending_cap = len;
+    }
+    memmove(c->pending, data, len);
+    c->pending_len = len;
+    return 0;
+}
+
+/*
+ * 读取连接上的数据直到socket被读空或者达到读取上限cap，每读一次就交给on_data处理，
+ * 返回本次读到的字节数，连接的状态通过state返回
+ */
+int conn_read(struct client_data *c, int cap, conn_data_fn on_data, enum conn_state *state)
+{
+    char *arena = get_arena();
+    int total = 0;
+
+    if(!arena)
+    {
+        *state = CONN_CLOSED;
+        return 0;
+    }
+
+    while(1)
+    {
+        /* 上次残留的数据放在接收区的开头，与新数据拼成连续的一段 */
+        int off = c->pending_len;
+        if(off > 0)
+        {
+            memcpy(arena, c->pending, off);
+        }
+
+        int room = RECV_ARENA_SIZE - off;
+        if(room > cap - total)
+        {
+            room = cap - total;
+        }
+
+        int n = recv(c->sockfd, arena + off, room, 0);
+        conn_stats.recv_calls++;
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                conn_stats.eagain++;
+                *state = CONN_DRAINED;
+                return total;
+            }
+            *state = CONN_CLOSED;
+            return total;
+        }
+        if(n == 0)
+        {
+            *state = CONN_CLOSED;
+            return total;
+        }
+
+        total += n;
+        conn_stats.bytes_in += n;
+
+        int used = on_data(c, arena, off + n);
+        if(used < 0 || save_pending(c, arena + used, off + n - used) < 0)
+        {
+            *state = CONN_CLOSED;
+            return total;
+        }
+
+        /*
+         * 没有读满说明内核缓冲区已经空了，之后再到达的数据会产生新的边缘事件，
+         * 因此不需要再调用一次recv去确认EAGAIN
+         */
+        if(n < room)
+        {
+            conn_stats.short_reads++;
+            *state = CONN_DRAINED;
+            return total;
+        }
+        if(total >= cap)
+        {
+            conn_stats.cap_hits++;
+            *state = CONN_MORE;
+            return total;
+        }
+    }
+}
+
+/*
+ * 处理由其他途径（如io_uring的缓冲区环）收到的数据，有残留数据时先与之拼接到
+ * 接收区中，state为CONN_CLOSED时表示需要关闭连接
+ */
+void conn_feed(struct client_data *c, const char *data, int len, conn_data_fn on_data,
+               enum conn_state *state)
+{
+    conn_stats.bytes_in += len;
+    *state = CONN_DRAINED;
+
+    if(c->pending_len > 0)
+    {
+        char *arena = get_arena();
+        int off = c->pending_len;
+        if(!arena || off + len > RECV_ARENA_SIZE)
+        {
+            *state = CONN_CLOSED;
+            return;
+        }
+        memcpy(arena, c->pending, off);
+        memcpy(arena + off, data, len);
+        data = arena;
+        len += off;
+    }
+
+    int used = on_data(c, data, len);
+    if(used < 0 || save_pending(c, data + used, len - used) < 0)
+    {
+        *state = CONN_CLOSED;
+    }
+}
+
+/* 每个线程的输出块缓冲池 */
+static __thread struct out_buf *out_pool = NULL;
+static __thread int out_pool_count = 0;
+
+static struct out_buf *out_buf_get(void)
+{
+    struct out_buf *b = out_pool;
+    if(b)
+    {
+        out_pool = b->next;
+        out_pool_count--;
+    }
+    else
+    {
+        b = (struct out_buf *)malloc(sizeof(struct out_buf));
+        if(!b)
+        {
+            return NULL;
+        }
+    }
+    b->next = NULL;
+    b->start = 0;
+    b->end = 0;
+    b->zc_pending = false;
+    return b;
+}
+
+static void out_buf_put(struct out_buf *b)
+{
+    if(out_pool_count >= OUT_POOL_MAX)
+    {
+        free(b);
+        return;
+    }
+    b->next = out_pool;
+    out_pool = b;
+    out_pool_count++;
+}
+
+/* 将响应追加到连接的输出队列，内存不足时返回-1 */
+int conn_queue(struct client_data *c, const char *data, int len)
+{
+    while(len > 0)
+    {
+        struct out_buf *tail = c->out_tail;
+        /* 只会追加到尾部块的空闲部分，已经（零拷贝）发出的数据不会被改动 */
+        if(!tail || tail->end == OUT_BUF_SIZE)
+        {
+            tail = out_buf_get();
+            if(!tail)
+            {
+                return -1;
+            }
+            if(c->out_tail)
+            {
+                c->out_tail->next = tail;
+            }
+            else
+            {
+                c->out_head = tail;
+            }
+            c->out_tail = tail;
+        }
+        int n = OUT_BUF_SIZE - tail->end;
+        if(n > len)
+        {
+            n = len;
+        }
+        memcpy(tail->data + tail->end, data, n);
+        tail->end += n;
+        c->out_bytes += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* 发送完毕的块：零拷贝发出过的挂到等待完成通知的队列上，否则直接回收 */
+static void out_buf_done(struct client_data *c, struct out_buf *b)
+{
+    if(!b->zc_pending)
+    {
+        out_buf_put(b);
+        return;
+    }
+    b->next = NULL;
+    if(c->zc_tail)
+    {
+        c->zc_tail->next = b;
+    }
+    else
+    {
+        c->zc_head = b;
+    }
+    c->zc_tail = b;
+}
+
+/*
+ * 用writev（大块数据用MSG_ZEROCOPY）把输出队列尽量写出，written返回本次写出的
+ * 字节数。发送缓冲区满时返回CONN_MORE，需要等待可写事件后再继续
+ */
+enum conn_state conn_flush(struct client_data *c, int *written)
+{
+    struct iovec iov[OUT_IOV_MAX];
+    *written = 0;
+
+    while(c->out_head)
+    {
+        int cnt = 0;
+        int total = 0;
+        struct out_buf *b;
+        for(b = c->out_head; b && cnt < OUT_IOV_MAX; b = b->next)
+        {
+            iov[cnt].iov_base = b->data + b->start;
+            iov[cnt].iov_len = b->end - b->start;
+            total += b->end - b->start;
+            cnt++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        bool zc = c->zerocopy && total >= ZEROCOPY_MIN;
+        int n = sendmsg(c->sockfd, &msg, MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+        conn_stats.send_calls++;
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                conn_stats.send_blocked++;
+                return CONN_MORE;
+            }
+            /* 零拷贝占用的内存超过了optmem限制，这次改为普通发送 */
+            if(zc && errno == ENOBUFS)
+            {
+                c->zerocopy = false;
+                continue;
+            }
+            return CONN_CLOSED;
+        }
+
+        *written += n;
+        conn_stats.bytes_out += n;
+        c->out_bytes -= n;
+        if(zc)
+        {
+            conn_stats.zc_sends++;
+        }
+
+        /* 按写出的字节数推进输出队列 */
+        int left = n;
+        while(c->out_head)
+        {
+            b = c->out_head;
+            int sent = b->end - b->start;
+            if(sent > left)
+            {
+                sent = left;
+            }
+            if(sent > 0 && zc)
+            {
+                b->zc_pending = true;
+                b->zc_id = c->zc_next;
+            }
+            b->start += sent;
+            left -= sent;
+            if(b->start < b->end)
+            {
+                break;
+            }
+            c->out_head = b->next;
+            if(!c->out_head)
+            {
+                c->out_tail = NULL;
+            }
+            out_buf_done(c, b);
+        }
+        if(zc)
+        {
+            c->zc_next++;
+        }
+
+        /* 没有全部写出说明发送缓冲区已满，省去一次以EAGAIN结束的调用 */
+        if(n < total)
+        {
+            conn_stats.send_blocked++;
+            return CONN_MORE;
+        }
+    }
+    return CONN_DRAINED;
+}
+
+/*
+ * 读取错误队列中的零拷贝完成通知，回收内核已经不再引用的块。TCP的完成通知
+ * 按序号递增到达，所以只需要按通知中的最大序号从队头回收。如果内核报告
+ * 实际做了拷贝（例如回环网卡），零拷贝没有收益，之后对该连接关闭零拷贝
+ */
+void conn_reap_zerocopy(struct client_data *c)
+{
+    char control[128];
+
+    while(c->zc_head)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(c->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            return;
+        }
+
+        struct cmsghdr *cm;
+        for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+            unsigned hi = serr->ee_data;
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                conn_stats.zc_copied += hi - serr->ee_info + 1;
+                c->zerocopy = false;
+            }
+            while(c->zc_head && (int)(c->zc_head->zc_id - hi) <= 0)
+            {
+                struct out_buf *b = c->zc_head;
+                c->zc_head = b->next;
+                out_buf_put(b);
+            }
+            if(!c->zc_head)
+            {
+                c->zc_tail = NULL;
+            }
+        }
+    }
+}
+
+/* 热升级时恢复从旧进程接过来的不完整输入和未发送的输出，失败返回-1 */
+int conn_restore(struct client_data *c, const char *in, int in_len, const char *out, int out_len)
+{
+    if(save_pending(c, in, in_len) < 0 || conn_queue(c, out, out_len) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void out_list_free(struct out_buf *b)
+{
+    while(b)
+    {
+        struct out_buf *next = b->next;
+        out_buf_put(b);
+        b = next;
+    }
+}
+
+/*
+ * 释放连接占用的暂存区和输出队列，需要在close之前调用：还有零拷贝数据未完成时
+ * 以RST方式关闭，丢弃发送队列，内核随之释放对这些块的引用
+ */
+void conn_release(struct client_data *c)
+{
+    free(c->pending);
+    c->pending = NULL;
+    c->pending_len = 0;
+    c->pending_cap = 0;
+    c->in_ready = false;
+    c->read_blocked = false;
+    c->want_out = false;
+    c->recv_armed = false;
+    c->recv_cancelled = false;
+
+    if(c->zc_head)
+    {
+        struct linger lg = { 1, 0 };
+        setsockopt(c->sockfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    out_list_free(c->out_head);
+    out_list_free(c->zc_head);
+    c->out_head = c->out_tail = NULL;
+    c->zc_head = c->zc_tail = NULL;
+    c->out_bytes = 0;
+    c->zc_next = 0;
+    c->zerocopy = false;
+}
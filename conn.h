@@ -0,0 +1,91 @@
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "list_timer.h"
+
+#define RECV_ARENA_SIZE     (256 * 1024)   /* 每个线程共享的接收区大小 */
+#define READ_CAP_DEFAULT    (64 * 1024)    /* 每个连接每次事件最多读取的字节数（公平性上限） */
+#define PENDING_MAX         (64 * 1024)    /* 每个连接最多暂存的不完整数据 */
+#define OUT_BUF_SIZE        (16 * 1024)    /* 输出缓冲区块的大小 */
+#define OUT_POOL_MAX        1024           /* 每个线程缓冲池中最多保留的空闲块数 */
+#define OUT_IOV_MAX         64             /* 一次writev最多合并的块数 */
+#define OUT_HIGH_WATER      (1024 * 1024)  /* 积压的输出超过该值时暂停读取 */
+#define OUT_LOW_WATER       (256 * 1024)   /* 积压的输出降到该值以下时恢复读取 */
+#define ZEROCOPY_MIN        (32 * 1024)    /* 一次发送达到该字节数才使用MSG_ZEROCOPY */
+
+/* 输出缓冲区块，从每个线程的缓冲池中分配，按顺序挂在连接的输出队列上 */
+struct out_buf{
+    struct out_buf *next;
+    int start;                  /* 尚未发送的数据的起始位置 */
+    int end;                    /* 数据的结束位置 */
+    bool zc_pending;            /* 有数据以零拷贝方式发出，需要等内核的完成通知才能复用 */
+    unsigned zc_id;             /* 最后一次引用该块的零拷贝发送的序号 */
+    char data[OUT_BUF_SIZE];
+};
+
+/* 用户数据结构：客户端socket地址、socket文件描述符、不完整数据的暂存区、输出队列、定时器 */
+struct client_data{
+    struct sockaddr_in address;
+    int sockfd;
+    unsigned gen;               /* 连接的代数，fd每被一个新连接使用一次加1 */
+    char *pending;              /* 上次未处理完的数据，只有存在残留数据时才分配 */
+    int pending_len;
+    int pending_cap;
+    bool in_ready;              /* 因达到读取上限而未读完，正在就绪队列中等待继续读取 */
+    bool read_blocked;          /* 输出积压超过高水位，暂停读取 */
+    bool want_out;              /* 输出队列没有写完，正在等待可写事件 */
+    bool recv_armed;            /* io_uring后端：连接上有尚未结束的recv请求 */
+    bool recv_cancelled;        /* io_uring后端：为了暂停读取或者重置超时而取消了recv请求 */
+    bool zerocopy;              /* 大块数据使用MSG_ZEROCOPY发送 */
+    struct out_buf *out_head;   /* 待发送的输出队列 */
+    struct out_buf *out_tail;
+    int out_bytes;              /* 输出队列中待发送的字节数 */
+    struct out_buf *zc_head;    /* 已零拷贝发出、等待完成通知的块，按序号排列 */
+    struct out_buf *zc_tail;
+    unsigned zc_next;           /* 下一次零拷贝发送的序号 */
+    timer_id timer;             /* 连接的定时器，没有定时器时为TIMER_INVALID */
+    time_t recv_armed_at;       /* io_uring后端的-T模式：recv和关联的超时提交时的时间（秒） */
+};
+
+/* 读写路径的统计信息 */
+struct conn_stats{
+    unsigned long bytes_in;     /* 读取的总字节数 */
+    unsigned long recv_calls;   /* recv系统调用次数 */
+    unsigned long eagain;       /* 以EAGAIN结束的读取次数 */
+    unsigned long short_reads;  /* 未读满接收区即结束的读取次数（省去一次EAGAIN调用） */
+    unsigned long cap_hits;     /* 因达到公平性上限而中断的次数 */
+    unsigned long bytes_out;    /* 发送的总字节数 */
+    unsigned long send_calls;   /* 发送系统调用次数 */
+    unsigned long send_blocked; /* 因socket发送缓冲区满而需要等待可写事件的次数 */
+    unsigned long zc_sends;     /* 以MSG_ZEROCOPY发送的次数 */
+    unsigned long zc_copied;    /* 内核通知实际上做了拷贝的零拷贝发送次数 */
+};
+
+/* conn_read()/conn_flush() 结束时连接的状态 */
+enum conn_state{
+    CONN_DRAINED,               /* socket中的数据已读完，或者输出队列已写完 */
+    CONN_MORE,                  /* 达到读取上限，socket中可能还有数据；或者发送缓冲区已满 */
+    CONN_CLOSED                 /* 对端关闭或出错，需要关闭连接 */
+};
+
+/*
+ * 数据处理函数，data为接收区中的数据（包含上次残留的部分），返回已处理的字节数，
+ * 未处理的尾部会被保存到连接的暂存区中，返回负数表示需要关闭连接
+ */
+typedef int (*conn_data_fn)(struct client_data *c, const char *data, int len);
+
+extern __thread struct conn_stats conn_stats;
+
+int conn_read(struct client_data *c, int cap, conn_data_fn on_data, enum conn_state *state);
+void conn_feed(struct client_data *c, const char *data, int len, conn_data_fn on_data,
+               enum conn_state *state);
+int conn_queue(struct client_data *c, const char *data, int len);
+enum conn_state conn_flush(struct client_data *c, int *written);
+void conn_reap_zerocopy(struct client_data *c);
+int conn_restore(struct client_data *c, const char *in, int in_len, const char *out, int out_len);
+void conn_release(struct client_data *c);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Description: 用协程写的回显服务器：每个连接一个协程，读数据时用with_timeout
+ *              等待，超过3倍TIMESLOT没有数据就关闭连接，和noactive_conn的
+ *              非活动连接超时行为一致。SIGINT/SIGTERM通过signalfd通知主循环退出，
+ *              退出时尚未结束的连接协程被销毁，等待随之取消
+ * Author:      Denny
+ *
+ * */
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+
+extern "C" {
+#include "log.h"
+}
+#include "coro_timer.hpp"
+
+#define TIMESLOT 5
+#define ECHO_BUF_SIZE 4096
+
+using namespace std::chrono_literals;
+
+static constexpr std::chrono::milliseconds idle_timeout = std::chrono::seconds(3 * TIMESLOT);
+
+static unsigned long nconns = 0;
+
+/* 协程结束或者被销毁时关闭连接 */
+class fd_guard
+{
+public:
+    explicit fd_guard(int fd) noexcept : fd_(fd)
+    {
+        nconns++;
+    }
+    fd_guard(const fd_guard &) = delete;
+    fd_guard &operator=(const fd_guard &) = delete;
+    ~fd_guard()
+    {
+        close(fd_);
+        nconns--;
+    }
+
+private:
+    int fd_;
+};
+
+static task serve(event_loop &loop, int fd)
+{
+    fd_guard guard(fd);
+    char buf[ECHO_BUF_SIZE];
+
+    for(;;)
+    {
+        auto n = co_await with_timeout(recv(loop, fd, buf, sizeof(buf)), idle_timeout);
+        if(!n)
+        {
+            LOG_INFO("close fd %d: idle timeout", fd);
+            break;
+        }
+        if(*n <= 0)
+        {
+            if(*n < 0)
+            {
+                LOG_WARN("close fd %d: recv: %s", fd, strerror((int)-*n));
+            }
+            break;
+        }
+
+        /* 对端迟迟不读时发送同样按空闲超时处理 */
+        ssize_t off = 0;
+        while(off < *n)
+        {
+            auto w = co_await with_timeout(send(loop, fd, buf + off, *n - off), idle_timeout);
+            if(!w || *w < 0)
+            {
+                LOG_INFO("close fd %d: send %s", fd, w ? strerror((int)-*w) : "timeout");
+                co_return;
+            }
+            off += *w;
+        }
+    }
+}
+
+static task acceptor(event_loop &loop, int listenfd)
+{
+    for(;;)
+    {
+        ssize_t fd = co_await accept(loop, listenfd);
+        if(fd >= 0)
+        {
+            loop.spawn(serve(loop, (int)fd));
+            continue;
+        }
+        if(fd == -EINTR || fd == -ECONNABORTED)
+        {
+            continue;
+        }
+        /* 描述符耗尽等错误，稍后再试，避免空转 */
+        LOG_WARN("accept: %s", strerror((int)-fd));
+        co_await sleep_for(loop, 100ms);
+    }
+}
+
+static task wait_signal(event_loop &loop, int sfd)
+{
+    struct signalfd_siginfo si;
+    ssize_t n = co_await io_op(loop, sfd, EPOLLIN, [sfd, &si]() -> ssize_t
+    {
+        ssize_t r = read(sfd, &si, sizeof(si));
+        return r < 0 ? -errno : r;
+    });
+    if(n == (ssize_t)sizeof(si))
+    {
+        LOG_INFO("signal %u, %lu connections left", si.ssi_signo, nconns);
+    }
+    loop.stop();
+}
+
+static int socket_new(const char *ip, int port)
+{
+    struct sockaddr_in servaddr;
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sockfd < 0)
+    {
+        LOG_ERROR("socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &servaddr.sin_addr);
+    servaddr.sin_port = htons(port);
+
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0 || listen(sockfd, SOMAXCONN) < 0)
+    {
+        LOG_ERROR("bind/listen: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+int main(int argc, char *argv[])
+{
+    /* 在日志线程创建之前屏蔽信号，信号只能通过signalfd收到 */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    log_init(STDOUT_FILENO);
+    if(argc < 3)
+    {
+        LOG_ERROR("usage: %s ip_address port_number", basename(argv[0]));
+        log_exit();
+        return 1;
+    }
+
+    int listenfd = socket_new(argv[1], atoi(argv[2]));
+    if(listenfd < 0)
+    {
+        log_exit();
+        return 1;
+    }
+
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    {
+        event_loop loop;
+        if(!loop.valid() || sfd < 0)
+        {
+            LOG_ERROR("epoll/signalfd: %s", strerror(errno));
+            log_exit();
+            return 1;
+        }
+        loop.spawn(acceptor(loop, listenfd));
+        loop.spawn(wait_signal(loop, sfd));
+        loop.run();
+        LOG_INFO("exit, cancel %zu tasks", loop.tasks());
+    }
+
+    close(sfd);
+    close(listenfd);
+    log_exit();
+    return 0;
+}
@@ -0,0 +1,661 @@
+#ifndef __CORO_TIMER_HPP__
+#define __CORO_TIMER_HPP__
+
+/*
+ * Description: 基于C++20协程的定时器和I/O等待。连接的处理逻辑可以直接写成
+ *              co_await sleep_for(loop, d) 和 co_await with_timeout(recv(...), d)，
+ *              不再需要回调函数和手动调整定时器。等待用的定时器节点和epoll节点都
+ *              在awaiter中，也就是在协程帧中，每次等待不需要额外分配内存；协程
+ *              被销毁时，awaiter的析构函数把节点从时间轮和epoll中摘下，等待随之取消
+ * Author:      Denny
+ *
+ * */
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "timing_wheel.hpp"
+
+class event_loop;
+
+/* 等待定时器的协程，到期时恢复执行 */
+struct coro_timer_hook : wheel_hook
+{
+    std::coroutine_handle<> h;
+    bool fired = false;                 /* 定时器已经到期 */
+};
+
+struct coro_timer_fire
+{
+    void operator()(coro_timer_hook &hook) const
+    {
+        hook.fired = true;
+        hook.h.resume();
+    }
+};
+
+/*
+ * 等待fd就绪的节点，epoll事件的data.ptr指向它。就绪的节点先放入就绪队列，
+ * 处理完本轮所有事件之后再逐个执行，等待被取消时从队列中摘下，
+ * 避免执行已经销毁的协程中的节点
+ */
+struct io_hook
+{
+    io_hook *prev = nullptr;
+    io_hook *next = nullptr;
+    void (*on_ready)(io_hook *) = nullptr;
+    int fd = -1;
+    unsigned events = 0;
+    bool armed = false;                 /* 正在等待fd就绪 */
+    bool pending = false;               /* epoll中这个fd的单次事件指向本节点，尚未触发 */
+    bool queued = false;                /* 在就绪队列中 */
+};
+
+/*
+ * 协程任务，创建后处于暂停状态。task对象拥有协程帧，task析构时协程被销毁；
+ * 交给event_loop::spawn()的任务由事件循环负责，执行完毕后自行销毁
+ */
+class task
+{
+public:
+    struct promise_type;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    /* 执行完毕：由事件循环负责的任务在这里销毁自己 */
+    struct final_awaiter
+    {
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        void await_suspend(handle_type h) noexcept;
+        void await_resume() const noexcept {}
+    };
+
+    struct promise_type
+    {
+        event_loop *loop = nullptr;     /* 由事件循环负责时不为空 */
+        promise_type *prev = nullptr;
+        promise_type *next = nullptr;
+
+        task get_return_object() noexcept
+        {
+            return task(handle_type::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() const noexcept
+        {
+            return {};
+        }
+        final_awaiter final_suspend() const noexcept
+        {
+            return {};
+        }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept
+        {
+            std::terminate();
+        }
+    };
+
+    task() noexcept = default;
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    task &operator=(task &&other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task()
+    {
+        reset();
+    }
+
+    /* 开始或继续执行 */
+    void resume()
+    {
+        if(h_ && !h_.done())
+        {
+            h_.resume();
+        }
+    }
+
+    bool done() const noexcept
+    {
+        return !h_ || h_.done();
+    }
+
+    /* 销毁协程，协程中等待的定时器和I/O随之取消 */
+    void reset() noexcept
+    {
+        if(h_)
+        {
+            h_.destroy();
+            h_ = {};
+        }
+    }
+
+private:
+    friend class event_loop;
+    explicit task(handle_type h) noexcept : h_(h) {}
+
+    handle_type h_;
+};
+
+/*
+ * 单线程的事件循环：epoll等待I/O，时间轮管理超时，时间轮的一个滴答为1毫秒，
+ * epoll_wait只睡到下一个有定时器的槽。fd第一次等待时加入epoll，之后一直留在
+ * epoll中（关闭fd时内核自动移除），每次等待用EPOLL_CTL_MOD重新设置单次事件。
+ * 同一个fd同一时刻只能有一个等待中的I/O操作
+ */
+class event_loop
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using wheel_type = intrusive_timing_wheel<4096, 1, coro_timer_hook, coro_timer_fire>;
+
+    event_loop() : epfd_(epoll_create1(EPOLL_CLOEXEC)) {}
+
+    /* 销毁所有尚未执行完的任务，它们的等待都被取消 */
+    ~event_loop()
+    {
+        while(tasks_)
+        {
+            task::promise_type *p = tasks_;
+            forget(p);
+            task::handle_type::from_promise(*p).destroy();
+        }
+        if(epfd_ >= 0)
+        {
+            close(epfd_);
+        }
+    }
+
+    event_loop(const event_loop &) = delete;
+    event_loop &operator=(const event_loop &) = delete;
+
+    /* epoll实例是否创建成功 */
+    bool valid() const noexcept
+    {
+        return epfd_ >= 0;
+    }
+
+    /* 开始执行任务，之后由事件循环负责 */
+    void spawn(task t)
+    {
+        task::handle_type h = std::exchange(t.h_, {});
+        if(!h)
+        {
+            return;
+        }
+        task::promise_type &p = h.promise();
+        p.loop = this;
+        p.prev = nullptr;
+        p.next = tasks_;
+        if(tasks_)
+        {
+            tasks_->prev = &p;
+        }
+        tasks_ = &p;
+        ntasks_++;
+        h.resume();
+    }
+
+    /* 运行事件循环，直到没有等待中的定时器和I/O，或者调用了stop() */
+    void run()
+    {
+        epoll_event events[128];
+        clock::time_point last = clock::now();
+        stopped_ = false;
+
+        while(!stopped_ && (!wheel_.empty() || io_waits_ > 0))
+        {
+            int n = epoll_wait(epfd_, events, 128, wait_ms(last));
+            for(int i = 0; i < n; i++)
+            {
+                io_hook *h = static_cast<io_hook *>(events[i].data.ptr);
+                /* 单次事件触发之后，内核中这个fd已经停用 */
+                h->pending = false;
+                enqueue(h);
+            }
+            while(ready_)
+            {
+                io_hook *h = ready_;
+                dequeue(h);
+                h->on_ready(h);
+            }
+
+            clock::time_point now = clock::now();
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last);
+            last += elapsed;
+            for(auto k = elapsed.count(); k > 0; k--)
+            {
+                wheel_.tick();
+            }
+        }
+    }
+
+    void stop() noexcept
+    {
+        stopped_ = true;
+    }
+
+    /* 时间轮转动一个滴答，用于不依赖真实时间驱动定时器 */
+    std::size_t tick()
+    {
+        return wheel_.tick();
+    }
+
+    wheel_type &timers() noexcept
+    {
+        return wheel_;
+    }
+
+    /* 由事件循环负责、尚未执行完的任务数 */
+    std::size_t tasks() const noexcept
+    {
+        return ntasks_;
+    }
+
+    /* 开始等待，失败时返回false，errno为错误原因 */
+    bool io_arm(io_hook &h)
+    {
+        if(!io_rearm(h))
+        {
+            return false;
+        }
+        h.armed = true;
+        io_waits_++;
+        return true;
+    }
+
+    /* 设置fd的单次事件指向h，就绪之后操作仍然返回EAGAIN时也用它重新等待 */
+    bool io_rearm(io_hook &h)
+    {
+        epoll_event ev;
+        ev.events = h.events | EPOLLONESHOT;
+        ev.data.ptr = &h;
+        if(h.fd < 0)
+        {
+            errno = EBADF;
+            return false;
+        }
+        if(static_cast<std::size_t>(h.fd) >= registered_.size())
+        {
+            registered_.resize(h.fd + 1, false);
+        }
+        /* fd关闭后号码可能被新的fd复用，这时MOD返回ENOENT，重新加入 */
+        if(!registered_[h.fd] || epoll_ctl(epfd_, EPOLL_CTL_MOD, h.fd, &ev) < 0)
+        {
+            if(registered_[h.fd] && errno != ENOENT)
+            {
+                return false;
+            }
+            if(epoll_ctl(epfd_, EPOLL_CTL_ADD, h.fd, &ev) < 0 &&
+               (errno != EEXIST || epoll_ctl(epfd_, EPOLL_CTL_MOD, h.fd, &ev) < 0))
+            {
+                return false;
+            }
+            registered_[h.fd] = true;
+        }
+        h.pending = true;
+        return true;
+    }
+
+    /*
+     * 结束等待。fd留在epoll中，只有单次事件还没有触发（等待被超时或销毁取消）时
+     * 把它停用，避免之后的事件指向已经不存在的节点
+     */
+    void io_disarm(io_hook &h) noexcept
+    {
+        if(h.queued)
+        {
+            dequeue(&h);
+        }
+        if(h.pending)
+        {
+            epoll_event ev;
+            ev.events = 0;
+            ev.data.ptr = nullptr;
+            epoll_ctl(epfd_, EPOLL_CTL_MOD, h.fd, &ev);
+            h.pending = false;
+        }
+        if(h.armed)
+        {
+            h.armed = false;
+            io_waits_--;
+        }
+    }
+
+private:
+    friend struct task::final_awaiter;
+
+    /* epoll_wait的超时：睡到下一个有定时器的槽该滴答的时候，没有定时器时一直等 */
+    int wait_ms(clock::time_point last) const
+    {
+        std::optional<std::uint64_t> busy = wheel_.next_busy();
+        if(!busy)
+        {
+            return -1;
+        }
+        auto since = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - last).count();
+        long long ms = static_cast<long long>(*busy) + 1 - since;
+        if(ms < 0)
+        {
+            return 0;
+        }
+        return ms > INT_MAX ? INT_MAX : static_cast<int>(ms);
+    }
+
+    void forget(task::promise_type *p) noexcept
+    {
+        if(p->prev)
+        {
+            p->prev->next = p->next;
+        }
+        else
+        {
+            tasks_ = p->next;
+        }
+        if(p->next)
+        {
+            p->next->prev = p->prev;
+        }
+        p->loop = nullptr;
+        ntasks_--;
+    }
+
+    void enqueue(io_hook *h) noexcept
+    {
+        h->queued = true;
+        h->prev = nullptr;
+        h->next = nullptr;
+        if(ready_tail_)
+        {
+            ready_tail_->next = h;
+            h->prev = ready_tail_;
+        }
+        else
+        {
+            ready_ = h;
+        }
+        ready_tail_ = h;
+    }
+
+    void dequeue(io_hook *h) noexcept
+    {
+        if(h->prev)
+        {
+            h->prev->next = h->next;
+        }
+        else
+        {
+            ready_ = h->next;
+        }
+        if(h->next)
+        {
+            h->next->prev = h->prev;
+        }
+        else
+        {
+            ready_tail_ = h->prev;
+        }
+        h->prev = h->next = nullptr;
+        h->queued = false;
+    }
+
+    int epfd_;
+    std::vector<bool> registered_;      /* 以fd为下标，fd是否已经加入epoll */
+    wheel_type wheel_;
+    io_hook *ready_ = nullptr;          /* 本轮就绪、等待执行的I/O */
+    io_hook *ready_tail_ = nullptr;
+    std::size_t io_waits_ = 0;
+    task::promise_type *tasks_ = nullptr;
+    std::size_t ntasks_ = 0;
+    bool stopped_ = false;
+};
+
+inline void task::final_awaiter::await_suspend(handle_type h) noexcept
+{
+    promise_type &p = h.promise();
+    if(p.loop)
+    {
+        p.loop->forget(&p);
+        h.destroy();
+    }
+}
+
+/* co_await sleep_for(loop, d)：暂停当前协程d时间 */
+class sleep_awaiter
+{
+public:
+    sleep_awaiter(event_loop &loop, std::chrono::milliseconds d) noexcept
+        : loop_(&loop), ms_(d.count() > 0 ? d.count() : 0) {}
+    sleep_awaiter(const sleep_awaiter &) = delete;
+    sleep_awaiter &operator=(const sleep_awaiter &) = delete;
+    ~sleep_awaiter()
+    {
+        loop_->timers().cancel(hook_);
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        hook_.h = h;
+        loop_->timers().add(hook_, ms_);
+    }
+    void await_resume() const noexcept {}
+
+private:
+    event_loop *loop_;
+    std::uint64_t ms_;
+    coro_timer_hook hook_;
+};
+
+inline sleep_awaiter sleep_for(event_loop &loop, std::chrono::milliseconds d) noexcept
+{
+    return sleep_awaiter(loop, d);
+}
+
+/*
+ * 非阻塞fd上的一次I/O操作：先直接尝试，返回EAGAIN时等待fd就绪再试。Syscall
+ * 执行实际的系统调用，返回结果或者-errno。co_await的结果就是Syscall的返回值
+ */
+template <typename Syscall>
+class io_op : private io_hook
+{
+public:
+    io_op(event_loop &loop, int fd, unsigned events, Syscall call)
+        : loop_(&loop), call_(std::move(call))
+    {
+        this->fd = fd;
+        this->events = events;
+        this->on_ready = &io_op::ready;
+    }
+    /* 只有尚未开始等待的操作可以移动 */
+    io_op(io_op &&other) noexcept
+        : io_hook(other), loop_(other.loop_), call_(std::move(other.call_)), result_(other.result_) {}
+    io_op &operator=(io_op &&) = delete;
+    ~io_op()
+    {
+        disarm();
+    }
+
+    event_loop &loop() const noexcept
+    {
+        return *loop_;
+    }
+
+    /* 立即尝试一次，返回true表示已经有结果 */
+    bool try_now()
+    {
+        ssize_t r = call_();
+        if(r == -EAGAIN || r == -EWOULDBLOCK)
+        {
+            return false;
+        }
+        result_ = r;
+        return true;
+    }
+
+    /* 开始等待fd就绪，就绪并得到结果后恢复协程h，失败时返回false */
+    bool arm(std::coroutine_handle<> h)
+    {
+        h_ = h;
+        if(!loop_->io_arm(*this))
+        {
+            result_ = -errno;
+            return false;
+        }
+        return true;
+    }
+
+    void disarm() noexcept
+    {
+        loop_->io_disarm(*this);
+    }
+
+    ssize_t result() const noexcept
+    {
+        return result_;
+    }
+
+    bool await_ready()
+    {
+        return try_now();
+    }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        return arm(h);
+    }
+    ssize_t await_resume() const noexcept
+    {
+        return result_;
+    }
+
+private:
+    static void ready(io_hook *hook)
+    {
+        io_op *op = static_cast<io_op *>(hook);
+        if(!op->try_now())
+        {
+            if(op->loop_->io_rearm(*op))
+            {
+                return;
+            }
+            op->result_ = -errno;
+        }
+        op->disarm();
+        op->h_.resume();
+    }
+
+    event_loop *loop_;
+    Syscall call_;
+    std::coroutine_handle<> h_;
+    ssize_t result_ = 0;
+};
+
+inline auto recv(event_loop &loop, int fd, void *buf, std::size_t len)
+{
+    return io_op(loop, fd, EPOLLIN, [fd, buf, len]() -> ssize_t
+    {
+        ssize_t n = ::recv(fd, buf, len, 0);
+        return n < 0 ? -errno : n;
+    });
+}
+
+inline auto send(event_loop &loop, int fd, const void *buf, std::size_t len)
+{
+    return io_op(loop, fd, EPOLLOUT, [fd, buf, len]() -> ssize_t
+    {
+        ssize_t n = ::send(fd, buf, len, MSG_NOSIGNAL);
+        return n < 0 ? -errno : n;
+    });
+}
+
+/* 接受一个连接，结果为新连接的fd（非阻塞）或者-errno */
+inline auto accept(event_loop &loop, int listenfd)
+{
+    return io_op(loop, listenfd, EPOLLIN, [listenfd]() -> ssize_t
+    {
+        int fd = ::accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        return fd < 0 ? -errno : fd;
+    });
+}
+
+/*
+ * co_await with_timeout(op, d)：等待op，超过d还没有结果时取消op，结果为
+ * std::nullopt；否则为op的结果。操作和定时器谁先完成就由谁恢复协程，
+ * 另一个在恢复之后立即被取消
+ */
+template <typename Op>
+class timeout_awaiter
+{
+public:
+    timeout_awaiter(Op op, std::chrono::milliseconds d)
+        : op_(std::move(op)), ms_(d.count() > 0 ? d.count() : 0) {}
+    timeout_awaiter(const timeout_awaiter &) = delete;
+    timeout_awaiter &operator=(const timeout_awaiter &) = delete;
+    ~timeout_awaiter()
+    {
+        op_.loop().timers().cancel(timer_);
+    }
+
+    bool await_ready()
+    {
+        return op_.try_now();
+    }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        if(!op_.arm(h))
+        {
+            return false;
+        }
+        timer_.h = h;
+        op_.loop().timers().add(timer_, ms_);
+        return true;
+    }
+    std::optional<decltype(std::declval<Op &>().result())> await_resume()
+    {
+        op_.loop().timers().cancel(timer_);
+        if(timer_.fired)
+        {
+            op_.disarm();
+            return std::nullopt;
+        }
+        return op_.result();
+    }
+
+private:
+    Op op_;
+    std::uint64_t ms_;
+    coro_timer_hook timer_;
+};
+
+template <typename Op>
+timeout_awaiter<Op> with_timeout(Op op, std::chrono::milliseconds d)
+{
+    return timeout_awaiter<Op>(std::move(op), d);
+}
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Description: 热升级时进程之间的交接：通过UNIX域socket的SCM_RIGHTS传递描述符，
+ *              连接的剩余超时时间等状态写入memfd映射出的快照中，随描述符一起交给
+ *              新进程，新进程直接映射读取，不需要逐个连接地序列化和解析
+ * Author:      Denny
+ *
+ * */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "handoff.h"
+
+/* 发送一条携带n个描述符的消息，data至少要有1个字节，成功返回0 */
+int handoff_send(int sock, const int *fds, int n, const void *data, int len)
+{
+    char control[CMSG_SPACE(HANDOFF_FDS_MAX * sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+
+    if(n > HANDOFF_FDS_MAX || len <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(n > 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+    }
+
+    /* 对方进程已经退出时不能因为SIGPIPE而终止 */
+    while(sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+    {
+        if(errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * 接收一条消息，最多取出max个描述符（带有close-on-exec标志），data中的数据必须
+ * 完整收到，返回收到的描述符个数，出错或者对方关闭时返回-1
+ */
+int handoff_recv(int sock, int *fds, int max, void *data, int len)
+{
+    char control[CMSG_SPACE(HANDOFF_FDS_MAX * sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    int n, nfds = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do
+    {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while(n < 0 && errno == EINTR);
+    if(n < 0)
+    {
+        return -1;
+    }
+
+    struct cmsghdr *cm;
+    for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+    {
+        if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        int cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *p = (int *)CMSG_DATA(cm);
+        int i;
+        for(i = 0; i < cnt; i++)
+        {
+            /* 多出来的描述符直接关闭，避免泄漏 */
+            if(nfds < max)
+            {
+                fds[nfds++] = p[i];
+            }
+            else
+            {
+                close(p[i]);
+            }
+        }
+    }
+    /* 数据不完整或者控制信息被截断时，已经收到的描述符也要关闭 */
+    if(n != len || (msg.msg_flags & MSG_CTRUNC))
+    {
+        int i;
+        for(i = 0; i < nfds; i++)
+        {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return nfds;
+}
+
+/* 创建size字节的匿名共享快照并映射为可写，返回其描述符 */
+int snapshot_create(size_t size, void **base)
+{
+    int fd = memfd_create("noactive_conn-snapshot", MFD_CLOEXEC);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(ftruncate(fd, size) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(*base == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* 以只读方式映射收到的快照，size返回快照大小 */
+void *snapshot_open(int fd, size_t *size)
+{
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct snapshot_header))
+    {
+        return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *size = st.st_size;
+    return base;
+}
+
+void snapshot_close(void *base, size_t size)
+{
+    munmap(base, size);
+}
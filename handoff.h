@@ -0,0 +1,48 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define HANDOFF_MAGIC       0x4e414354     /* "NACT" */
+#define HANDOFF_VERSION     1
+#define HANDOFF_FDS_MAX     250            /* 一条消息最多携带的描述符数（内核上限为253） */
+#define HANDOFF_ACK         'A'            /* 新进程接管完成后回复的确认字节 */
+#define HANDOFF_TIMEOUT     10             /* 交接的超时秒数，新进程卡住时旧进程放弃交接 */
+
+/* 交接的第一条消息，同时携带监听socket和快照的描述符 */
+struct handoff_hello{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;                 /* 之后的消息中依次携带的连接数 */
+};
+
+/*
+ * 定时器快照：头部之后是count条按剩余时间升序排列的连接记录，再之后依次是每个
+ * 连接的不完整输入和未发送的输出，新进程按这个顺序一次性建立定时器链表
+ */
+struct snapshot_header{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t size;                  /* 快照的总字节数 */
+};
+
+struct snapshot_conn{
+    struct sockaddr_in address;     /* 客户端地址 */
+    uint32_t remaining;             /* 距离超时剩余的秒数 */
+    uint32_t in_len;                /* 暂存的不完整输入的字节数 */
+    uint32_t out_len;               /* 尚未发送的输出的字节数 */
+    uint32_t reserved;
+};
+
+int handoff_send(int sock, const int *fds, int n, const void *data, int len);
+int handoff_recv(int sock, int *fds, int max, void *data, int len);
+
+int snapshot_create(size_t size, void **base);
+void *snapshot_open(int fd, size_t *size);
+void snapshot_close(void *base, size_t size);
+
+#endif
@@ -1,235 +1,802 @@
-
 /*
  * Description: 使用双向链表存储定时器（升序排列），这里主要实现增加、删除、
- *              定时器到期时链表调整以及处理到期时的任务
+ *              定时器到期时链表调整以及处理到期时的任务。定时器节点存放在
+ *              上下文自己的槽位数组中，链表用槽位下标连接，使用者只持有带代数
+ *              的句柄，对已经到期或删除的定时器的操作会安全地失败。
+ *              TIMER_CTX_HEAP的上下文用二叉最小堆代替链表排序定时器，堆上删除和
+ *              调整都要调整堆，TIMER_CTX_LAZY让删除只把节点标记为墓碑、推迟只记下
+ *              新的超时时间，墓碑在到期处理或压缩时回收
  * Author:      Denny
- * 
+ *
  * */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
-
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <stdbool.h>
 
 #include "list_timer.h"
+#include "timer_slack.h"
+#include "arena.h"
+
+#define TIMER_NIL       0xffffffffu    /* 表示没有节点的下标 */
+#define TIMER_INIT_CAP  64             /* 槽位数组的初始大小 */
+#define TIMER_COMPACT_MIN   64         /* 墓碑至少有这么多、并且超过有效定时器的1/4时压缩堆 */
+
+/* 定时器节点 */
+struct timer_node{
+    time_t expire;                      /* 任务的超时时间（已按slack折合），这里使用绝对时间 */
+    time_t key;                         /* 链表和堆按它排序，惰性推迟之后它早于expire */
+    time_t due;                         /* 折合之前的超时时间，周期定时器从它推算下一次到期 */
+    time_t slack;                       /* 允许推迟到期的时间 */
+    time_t interval;                    /* 周期定时器的间隔，0表示一次性定时器 */
+    enum timer_policy policy;           /* 周期定时器错过到期时间时的处理方式 */
+    timer_cb cb;                        /* 任务的回调函数 */
+    void *arg;                          /* 回调函数处理的客户数据，由定时器的执行者传递给回调函数 */
+    uint32_t prev;                      /* 前一个定时器的下标 */
+    uint32_t next;                      /* 后一个定时器的下标，空闲槽位用它串成空闲链表 */
+    uint32_t gen;                       /* 槽位的代数 */
+    uint32_t pos;                       /* 定时器在堆数组中的位置 */
+    bool used;
+    bool dead;                          /* 已删除但仍在堆中的墓碑 */
+};
 
+/* 堆中的元素，超时时间和槽位下标放在一起，调整堆时比较超时时间不需要访问节点 */
+struct heap_entry{
+    time_t key;
+    uint32_t slot;
+};
+
+/* 双向链表或二叉最小堆 */
+struct timer_ctx{
+    struct timer_node *nodes;
+    uint32_t cap;
+    uint32_t count;                     /* 有效的定时器数，不含墓碑 */
+    uint32_t head;
+    uint32_t tail;
+    uint32_t free_list;
+    struct heap_entry *heap;            /* 堆数组，容量与槽位数组相同 */
+    uint32_t heap_len;
+    uint32_t dead;                      /* 堆中的墓碑数 */
+    bool use_heap;
+    bool lazy;
+    struct arena *arena;                /* 上下文、槽位数组和堆数组从这里分配，NULL时使用malloc */
+};
+
+static timer_id make_id(struct timer_ctx *ctx, uint32_t slot)
+{
+    return ((timer_id)ctx->nodes[slot].gen << 32) | (slot + 1);
+}
 
-/* 将目标定时器timer添加到节点lst_head之后的链表中 */
-void add_timer_nohead(struct util_timer* timer, struct util_timer* lst_head)
+/* 检查句柄，返回对应的槽位下标，句柄已失效时返回TIMER_NIL */
+static uint32_t id_slot(struct timer_ctx *ctx, timer_id id)
 {
-    struct util_timer *prev = lst_head;
-    struct util_timer *tmp = prev->next;
+    uint32_t slot = (uint32_t)id - 1;
+    if(id == TIMER_INVALID || slot >= ctx->cap)
+    {
+        return TIMER_NIL;
+    }
+    struct timer_node *n = &ctx->nodes[slot];
+    if(!n->used || n->gen != (uint32_t)(id >> 32))
+    {
+        return TIMER_NIL;
+    }
+    return slot;
+}
 
-    /* 遍历lst_head节点之后的链表内容，直到找到一个超时时间大于
-        目标定时器的超时时间的节点，并将目标定时器插入该节点之前 */
-    while(tmp)
+/* 从空闲链表中取一个槽位，没有空闲槽位时把槽位数组扩大一倍 */
+static uint32_t alloc_slot(struct timer_ctx *ctx)
+{
+    if(ctx->free_list == TIMER_NIL)
     {
-        if(timer->expire < tmp->expire)
+        uint32_t cap = ctx->cap ? ctx->cap * 2 : TIMER_INIT_CAP;
+        if(cap <= ctx->cap || cap >= TIMER_NIL)
         {
-            prev->next = timer;
-            timer->next = tmp;
-            tmp->prev = timer;
-            timer->prev = prev;
-            break;
+            return TIMER_NIL;
+        }
+        if(ctx->use_heap)
+        {
+            struct heap_entry *heap = (struct heap_entry *)arena_realloc(ctx->arena, ctx->heap,
+                                                                         ctx->cap * sizeof(struct heap_entry),
+                                                                         cap * sizeof(struct heap_entry));
+            if(!heap)
+            {
+                return TIMER_NIL;
+            }
+            ctx->heap = heap;
+        }
+        struct timer_node *nodes = (struct timer_node *)arena_realloc(ctx->arena, ctx->nodes,
+                                                                      ctx->cap * sizeof(struct timer_node),
+                                                                      cap * sizeof(struct timer_node));
+        if(!nodes)
+        {
+            return TIMER_NIL;
+        }
+        memset(nodes + ctx->cap, 0, (cap - ctx->cap) * sizeof(struct timer_node));
+        uint32_t i;
+        for(i = cap; i > ctx->cap; i--)
+        {
+            nodes[i - 1].gen = 1;
+            nodes[i - 1].next = ctx->free_list;
+            ctx->free_list = i - 1;
         }
-        prev = tmp;
-        tmp = tmp->next;
+        ctx->nodes = nodes;
+        ctx->cap = cap;
     }
 
-    /* 如果遍历完lst_head节点之后的链表内容，仍未找到超时时间大于目标定时器的超时时间的节点，
-        则将目标定时器插入链表尾部，并把它设置为链表新的尾节点 */
-    if(!tmp)
+    uint32_t slot = ctx->free_list;
+    ctx->free_list = ctx->nodes[slot].next;
+    ctx->nodes[slot].used = true;
+    ctx->count++;
+    return slot;
+}
+
+/* 定时器失效，代数加1使旧句柄失效 */
+static void kill_slot(struct timer_ctx *ctx, uint32_t slot)
+{
+    struct timer_node *n = &ctx->nodes[slot];
+    n->used = false;
+    n->gen++;
+    n->cb = NULL;
+    n->arg = NULL;
+    n->interval = 0;
+    ctx->count--;
+}
+
+/* 释放已从链表或堆中取出的槽位 */
+static void free_slot(struct timer_ctx *ctx, uint32_t slot)
+{
+    kill_slot(ctx, slot);
+    ctx->nodes[slot].next = ctx->free_list;
+    ctx->free_list = slot;
+}
+
+/* 将定时器slot插入到节点pos之后，pos为TIMER_NIL表示插入到链表头部 */
+static void link_after(struct timer_ctx *ctx, uint32_t slot, uint32_t pos)
+{
+    struct timer_node *n = &ctx->nodes[slot];
+    n->prev = pos;
+    if(pos == TIMER_NIL)
+    {
+        n->next = ctx->head;
+        ctx->head = slot;
+    }
+    else
     {
-        prev->next = timer;
-        timer->prev = prev;
+        n->next = ctx->nodes[pos].next;
+        ctx->nodes[pos].next = slot;
+    }
 
+    if(n->next == TIMER_NIL)
+    {
+        ctx->tail = slot;
+    }
+    else
+    {
+        ctx->nodes[n->next].prev = slot;
     }
 }
 
-/* 将目标定时器timer添加到链表中 */
-void add_timer(struct util_timer *timer)
+/* 将定时器slot从链表中取出 */
+static void unlink_node(struct timer_ctx *ctx, uint32_t slot)
 {
-    assert(timer != NULL);
-    /* 如果head为NULL, 头尾都指向timer */
-    if(m_list.head == NULL)
+    struct timer_node *n = &ctx->nodes[slot];
+    if(n->prev == TIMER_NIL)
     {
-        m_list.head = timer;
-        m_list.tail = timer;
-        return;
+        ctx->head = n->next;
+    }
+    else
+    {
+        ctx->nodes[n->prev].next = n->next;
+    }
+    if(n->next == TIMER_NIL)
+    {
+        ctx->tail = n->prev;
     }
+    else
+    {
+        ctx->nodes[n->next].prev = n->prev;
+    }
+    n->prev = n->next = TIMER_NIL;
+}
 
-    /* 
-     * 如果目标定时器timer的超时时间小于当前
-     * 链表中所有的定时器的超时时间，则把该定时器
-     * 插入链表头部，作为链表新的头结点，否则调用
-     * add_timer_nohead()函数，将它插入到链表合
-     * 适的位置，以保证链表的升序特性 
-     * */
-    if(timer->expire < m_list.head->expire)
+/*
+ * 从节点pos开始向链表头部查找，返回最后一个超时时间不大于expire的节点，
+ * 新定时器插入到它之后。超时时间相同的定时器排在已有定时器之后
+ */
+static uint32_t find_back(struct timer_ctx *ctx, time_t expire, uint32_t pos)
+{
+    while(pos != TIMER_NIL && expire < ctx->nodes[pos].key)
     {
-        timer->next = m_list.head;
-        m_list.head->prev = timer;
-        m_list.head = timer;
-        return;
+        pos = ctx->nodes[pos].prev;
     }
+    return pos;
+}
 
-    /* 遍历头结点之后的链表数据 */
-    add_timer_nohead(timer, m_list.head);
+/* 从节点pos开始向链表尾部查找，返回新定时器应该插入在其后的节点 */
+static uint32_t find_forward(struct timer_ctx *ctx, time_t expire, uint32_t pos)
+{
+    while(pos != TIMER_NIL && ctx->nodes[pos].key <= expire)
+    {
+        pos = ctx->nodes[pos].next;
+    }
+    return pos == TIMER_NIL ? ctx->tail : ctx->nodes[pos].prev;
+}
 
-} 
+static void heap_set(struct timer_ctx *ctx, uint32_t i, struct heap_entry e)
+{
+    ctx->heap[i] = e;
+    ctx->nodes[e.slot].pos = i;
+}
 
-/* 
- * 当某个定时任务发生变化时，调整对应的定时器在链表中的位置，
- * 这个函数只考虑被调整的定时器的超时时间延长的情况,即该定时器
- * 需要往链表的尾部移动 
- * */
-void adjust_timer(struct util_timer *timer)
+static void sift_up(struct timer_ctx *ctx, uint32_t i)
+{
+    struct heap_entry e = ctx->heap[i];
+    while(i > 0)
+    {
+        uint32_t parent = (i - 1) / 2;
+        if(ctx->heap[parent].key <= e.key)
+        {
+            break;
+        }
+        heap_set(ctx, i, ctx->heap[parent]);
+        i = parent;
+    }
+    heap_set(ctx, i, e);
+}
+
+static void sift_down(struct timer_ctx *ctx, uint32_t i)
+{
+    struct heap_entry e = ctx->heap[i];
+    for(;;)
+    {
+        uint32_t child = 2 * i + 1;
+        if(child >= ctx->heap_len)
+        {
+            break;
+        }
+        if(child + 1 < ctx->heap_len && ctx->heap[child + 1].key < ctx->heap[child].key)
+        {
+            child++;
+        }
+        if(e.key <= ctx->heap[child].key)
+        {
+            break;
+        }
+        heap_set(ctx, i, ctx->heap[child]);
+        i = child;
+    }
+    heap_set(ctx, i, e);
+}
+
+/* 把堆中第i个元素去掉，最后一个元素补到位置i上 */
+static void heap_remove(struct timer_ctx *ctx, uint32_t i)
 {
-    if(!timer)
+    struct heap_entry last = ctx->heap[--ctx->heap_len];
+    if(i < ctx->heap_len)
     {
+        heap_set(ctx, i, last);
+        sift_up(ctx, i);
+        sift_down(ctx, ctx->nodes[last.slot].pos);
+    }
+}
+
+/* 节点的key变化之后调整它在堆中的位置 */
+static void heap_rekey(struct timer_ctx *ctx, uint32_t slot)
+{
+    uint32_t i = ctx->nodes[slot].pos;
+    ctx->heap[i].key = ctx->nodes[slot].key;
+    sift_up(ctx, i);
+    sift_down(ctx, ctx->nodes[slot].pos);
+}
+
+/* 按key把定时器放入链表或堆 */
+static void order_insert(struct timer_ctx *ctx, uint32_t slot)
+{
+    if(ctx->use_heap)
+    {
+        struct heap_entry e = { ctx->nodes[slot].key, slot };
+        heap_set(ctx, ctx->heap_len++, e);
+        sift_up(ctx, ctx->heap_len - 1);
         return;
     }
+    link_after(ctx, slot, find_back(ctx, ctx->nodes[slot].key, ctx->tail));
+}
 
-    struct util_timer *tmp = timer->next;
-    /* 
-     * 如果被调整的目标定时器的处在链表的尾部，或者该定时器
-     * 新的超时值仍然小于其下一个定时器的超时值，则不用调整
-     **/    
-    if(!tmp || (timer->expire < tmp->expire ))
+static void order_remove(struct timer_ctx *ctx, uint32_t slot)
+{
+    if(ctx->use_heap)
     {
+        heap_remove(ctx, ctx->nodes[slot].pos);
         return;
     }
+    unlink_node(ctx, slot);
+}
 
-    /* 
-     * 如果被调整的目标定时器是链表的头结点，
-     * 则将该定时器从链表取出并重新插入链表
-     * */
-    if(timer == m_list.head )
+/* 定时器的key变大之后调整它的位置 */
+static void order_later(struct timer_ctx *ctx, uint32_t slot)
+{
+    if(ctx->use_heap)
     {
-        m_list.head = m_list.head->next;
-        m_list.head->prev = NULL;
-        timer->next = NULL;
-        add_timer_nohead(timer, m_list.head);
+        heap_rekey(ctx, slot);
+        return;
     }
-    /*
-     * 如果不是头结点，则将该定时器从链表取出，
-     * 然后插入其原来所在位置之后的链表中
-     */
-    else
+    unlink_node(ctx, slot);
+    link_after(ctx, slot, find_back(ctx, ctx->nodes[slot].key, ctx->tail));
+}
+
+/* key最小的定时器（可能是墓碑），没有定时器时返回TIMER_NIL */
+static uint32_t order_first(struct timer_ctx *ctx)
+{
+    if(ctx->use_heap)
+    {
+        return ctx->heap_len ? ctx->heap[0].slot : TIMER_NIL;
+    }
+    return ctx->head;
+}
+
+/* 遍历用：从slot（堆中从位置pos）开始第一个不是墓碑的定时器 */
+static uint32_t iter_from(struct timer_ctx *ctx, uint32_t slot, uint32_t pos)
+{
+    if(!ctx->use_heap)
     {
-        timer->prev->next = timer->next;
-        timer->next->prev = timer->prev;
-        add_timer_nohead(timer, timer->next);
+        return slot;
     }
+    while(pos < ctx->heap_len && ctx->nodes[ctx->heap[pos].slot].dead)
+    {
+        pos++;
+    }
+    return pos < ctx->heap_len ? ctx->heap[pos].slot : TIMER_NIL;
+}
+
+struct timer_ctx *timer_ctx_new(void)
+{
+    return timer_ctx_new_flags(0);
 }
 
-/* 将目标定时器timer从链表中删除 */
-void del_timer(struct util_timer *timer)
+/*
+ * flags可以是TIMER_CTX_HEAP和TIMER_CTX_LAZY的组合。TIMER_CTX_LAZY只对堆有效：
+ * 链表上删除本来就是常数时间，墓碑只会让链表变长
+ */
+struct timer_ctx *timer_ctx_new_flags(unsigned flags)
 {
-     assert(timer != NULL);
+    return timer_ctx_new_arena(flags, NULL);
+}
 
-     /* 只有一个定时器的情况 */
-    if((timer == m_list.head)  && (timer == m_list.tail))
+/* 上下文和定时器节点从arena分配，定时器多的线程可以让它们都在本地NUMA节点的大页上 */
+struct timer_ctx *timer_ctx_new_arena(unsigned flags, struct arena *a)
+{
+    struct timer_ctx *ctx = (struct timer_ctx *)arena_calloc(a, sizeof(struct timer_ctx));
+    if(!ctx)
     {
-        free(timer);
-        m_list.head = NULL;
-        m_list.tail = NULL;
-        return;
+        return NULL;
     }
+    ctx->arena = a;
+    ctx->head = ctx->tail = TIMER_NIL;
+    ctx->free_list = TIMER_NIL;
+    ctx->use_heap = (flags & TIMER_CTX_HEAP) != 0;
+    ctx->lazy = ctx->use_heap && (flags & TIMER_CTX_LAZY) != 0;
+    return ctx;
+}
 
-    /* 
-     * 目标定时器为链表的头结点，将链表的头结点
-     * 重置为原头结点的下一个节点，然后删除目标定时器
-     */
-    if(timer == m_list.head)
+/* 回收已从堆中取出的墓碑 */
+static void reclaim(struct timer_ctx *ctx, uint32_t slot)
+{
+    ctx->nodes[slot].dead = false;
+    ctx->nodes[slot].next = ctx->free_list;
+    ctx->free_list = slot;
+    ctx->dead--;
+}
+
+/* 释放上下文，尚未到期的定时器直接丢弃，不会调用它们的回调函数 */
+void timer_ctx_free(struct timer_ctx *ctx)
+{
+    if(!ctx)
     {
-        m_list.head = m_list.head->next;
-        m_list.head->prev = NULL;
-        free(timer);
-        timer = NULL;
         return;
     }
+    arena_dealloc(ctx->arena, ctx->nodes, ctx->cap * sizeof(struct timer_node));
+    arena_dealloc(ctx->arena, ctx->heap, ctx->cap * sizeof(struct heap_entry));
+    arena_dealloc(ctx->arena, ctx, sizeof(struct timer_ctx));
+}
 
-    /* 
-     * 目标定时器为链表的尾结点，将链表的尾结点
-     * 重置为原尾结点的前一个节点，然后删除目标定时器
-     */
-    if(timer == m_list.tail)
+/*
+ * 添加定时器，返回其句柄，内存不足时返回TIMER_INVALID。新定时器的超时时间
+ * 通常不早于链表中已有的定时器，所以从尾部向前查找插入位置
+ */
+timer_id timer_add(struct timer_ctx *ctx, time_t expire, timer_cb cb, void *arg)
+{
+    return timer_add_slack(ctx, expire, 0, cb, arg);
+}
+
+/*
+ * 添加允许推迟slack到期的定时器，超时值折合到与其他定时器共享的时间点上，
+ * 这些定时器在链表中相邻，到期时一起处理
+ */
+timer_id timer_add_slack(struct timer_ctx *ctx, time_t expire, time_t slack, timer_cb cb, void *arg)
+{
+    uint32_t slot = alloc_slot(ctx);
+    if(slot == TIMER_NIL)
     {
-        m_list.tail = m_list.tail->prev;   /*  */
-        m_list.tail->next = NULL;
-        free(timer);
-        timer = NULL;
-        return;
+        return TIMER_INVALID;
     }
+    struct timer_node *n = &ctx->nodes[slot];
+    n->due = expire;
+    n->expire = n->key = timer_coalesce(expire, slack);
+    n->slack = slack;
+    n->cb = cb;
+    n->arg = arg;
+    order_insert(ctx, slot);
+    return make_id(ctx, slot);
+}
 
-    /* 
-     * 如果目标定时器位于链表的中间，则把它前后的
-     * 定时器串联起来，然后删除目标定时器 
-     * */
-    timer->prev->next = timer->next;    /* 前一个节点的next指向当前节点的next */
-    timer->next->prev = timer->prev;    /* 当前节点的下一个节点的prev指向当前节点的prev */
-    free(timer);
-    timer = NULL;
+/*
+ * 添加周期定时器，first为第一次到期的时间，之后每隔interval到期一次。周期定时器
+ * 到期后在原来的槽位上重新排入链表，不需要重新分配，句柄一直有效，直到调用
+ * timer_del删除它，回调函数中也可以删除。interval不大于0时返回TIMER_INVALID
+ */
+timer_id timer_add_periodic(struct timer_ctx *ctx, time_t first, time_t interval,
+                            enum timer_policy policy, timer_cb cb, void *arg)
+{
+    return timer_add_periodic_slack(ctx, first, interval, 0, policy, cb, arg);
+}
 
+/*
+ * 添加允许推迟slack到期的周期定时器。每个周期都按未折合的时间推算下一次到期，
+ * 再按slack折合，折合带来的推迟不会累积到之后的周期上
+ */
+timer_id timer_add_periodic_slack(struct timer_ctx *ctx, time_t first, time_t interval, time_t slack,
+                                  enum timer_policy policy, timer_cb cb, void *arg)
+{
+    if(interval <= 0)
+    {
+        return TIMER_INVALID;
+    }
+    timer_id id = timer_add_slack(ctx, first, slack, cb, arg);
+    if(id != TIMER_INVALID)
+    {
+        struct timer_node *n = &ctx->nodes[(uint32_t)id - 1];
+        n->interval = interval;
+        n->policy = policy;
+    }
+    return id;
 }
 
-/* 遍历链表中的定时器并输出 */
-void print_list()
+/*
+ * 将一批按超时时间升序排列的定时器一次性添加到链表中，句柄依次写入ids。
+ * 每个定时器的超时值按各自的slack折合，slack相同时折合后仍然是升序的。
+ * 整批只从尾部向前查找一次插入位置，避免每个定时器都遍历一次链表。
+ * 返回添加成功的个数，内存不足时之后的定时器没有添加，其句柄为TIMER_INVALID
+ * */
+int timer_add_batch(struct timer_ctx *ctx, const struct timer_spec *specs, int n, timer_id *ids)
 {
-    struct util_timer *tmp = m_list.head;
-    while(tmp)
+    int i, added = 0;
+
+    /* 先分配好槽位，扩大槽位数组不会影响下标 */
+    for(i = 0; i < n; i++)
+    {
+        uint32_t slot = alloc_slot(ctx);
+        if(slot == TIMER_NIL)
+        {
+            break;
+        }
+        struct timer_node *node = &ctx->nodes[slot];
+        node->due = specs[i].expire;
+        node->expire = node->key = timer_coalesce(specs[i].expire, specs[i].slack);
+        node->slack = specs[i].slack;
+        node->cb = specs[i].cb;
+        node->arg = specs[i].arg;
+        ids[i] = make_id(ctx, slot);
+        added++;
+    }
+    for(i = added; i < n; i++)
+    {
+        ids[i] = TIMER_INVALID;
+    }
+    if(ctx->use_heap)
+    {
+        for(i = 0; i < added; i++)
+        {
+            order_insert(ctx, (uint32_t)ids[i] - 1);
+        }
+        return added;
+    }
+
+    /* 新定时器插入到pos之后，pos为TIMER_NIL表示插入到链表头部 */
+    uint32_t pos = ctx->tail;
+    for(i = added - 1; i >= 0; i--)
     {
-        printf("the timer is %d\n", tmp->expire);
-        tmp = tmp->next;
+        uint32_t slot = (uint32_t)ids[i] - 1;
+        pos = find_back(ctx, ctx->nodes[slot].key, pos);
+        link_after(ctx, slot, pos);
     }
+    return added;
 }
 
 /*
- * SIGALAM信号每次触发就在其信号处理函数(如果使用同一事件源，则是主函数)
- * 中执行一次tick函数，以处理链表上到期的任务
+ * 当某个定时任务发生变化时，调整对应的定时器在链表中的位置，超时时间延长时
+ * 往链表尾部移动，提前时往链表头部移动。新的超时值按定时器的slack折合后
+ * 与原来相同时什么也不用做。堆的惰性模式下推迟超时只记下新的超时时间，定时器
+ * 留在原来的位置，等到了原来的超时时间再一次移动到正确的位置，连接不断活跃
+ * 时多次推迟只需要调整一次堆。句柄已失效时返回-1
  * */
-void tick()
+int timer_adjust(struct timer_ctx *ctx, timer_id id, time_t expire)
 {
-    assert(m_list.head != NULL);
+    uint32_t slot = id_slot(ctx, id);
+    if(slot == TIMER_NIL)
+    {
+        return -1;
+    }
+
+    struct timer_node *n = &ctx->nodes[slot];
+    n->due = expire;
+    expire = timer_coalesce(expire, n->slack);
+    if(expire == n->expire)
+    {
+        return 0;
+    }
+    n->expire = expire;
+    if(ctx->use_heap)
+    {
+        if(!ctx->lazy || expire < n->key)
+        {
+            n->key = expire;
+            heap_rekey(ctx, slot);
+        }
+        return 0;
+    }
+    uint32_t prev = n->prev;
+    uint32_t next = n->next;
+    n->key = expire;
+
+    /* 新的超时值仍然处在前后两个定时器之间，则不用调整 */
+    if((prev == TIMER_NIL || ctx->nodes[prev].key <= expire) &&
+       (next == TIMER_NIL || expire < ctx->nodes[next].key))
+    {
+        return 0;
+    }
+
+    unlink_node(ctx, slot);
+    if(next != TIMER_NIL && ctx->nodes[next].key <= expire)
+    {
+        /* 延长到所有定时器之后是最常见的情况，直接放到尾部 */
+        if(ctx->nodes[ctx->tail].key <= expire)
+        {
+            link_after(ctx, slot, ctx->tail);
+        }
+        else
+        {
+            link_after(ctx, slot, find_forward(ctx, expire, next));
+        }
+    }
+    else
+    {
+        link_after(ctx, slot, find_back(ctx, expire, prev));
+    }
+    return 0;
+}
 
-    time_t cur = time(NULL);  /* 获取系统当前时间 */
-    struct util_timer *tmp = m_list.head;
+/*
+ * 将目标定时器从链表中删除，句柄已失效（定时器已到期或已被删除）时返回-1。
+ * 堆的惰性模式下只把它标记为墓碑，句柄立即失效，节点留在堆中，到了堆顶时
+ * 跳过并回收；墓碑至少有TIMER_COMPACT_MIN个、并且超过有效定时器的1/4时
+ * 压缩一次堆，均摊到每次删除是常数时间
+ */
+int timer_del(struct timer_ctx *ctx, timer_id id)
+{
+    uint32_t slot = id_slot(ctx, id);
+    if(slot == TIMER_NIL)
+    {
+        return -1;
+    }
+    if(ctx->lazy)
+    {
+        kill_slot(ctx, slot);
+        ctx->nodes[slot].dead = true;
+        ctx->dead++;
+        if(ctx->dead >= TIMER_COMPACT_MIN && ctx->dead * 4 > ctx->count)
+        {
+            timer_compact(ctx);
+        }
+        return 0;
+    }
+    order_remove(ctx, slot);
+    free_slot(ctx, slot);
+    return 0;
+}
+
+/* 回收堆中所有的墓碑，再用剩下的定时器重新建堆，返回回收的个数，可以在空闲时主动调用 */
+unsigned timer_compact(struct timer_ctx *ctx)
+{
+    unsigned reclaimed = ctx->dead;
+    uint32_t i, len = 0;
+    if(reclaimed == 0)
+    {
+        return 0;
+    }
+    for(i = 0; i < ctx->heap_len; i++)
+    {
+        struct heap_entry e = ctx->heap[i];
+        if(ctx->nodes[e.slot].dead)
+        {
+            reclaim(ctx, e.slot);
+        }
+        else
+        {
+            heap_set(ctx, len++, e);
+        }
+    }
+    ctx->heap_len = len;
+    for(i = len / 2; i > 0; i--)
+    {
+        sift_down(ctx, i - 1);
+    }
+    return reclaimed;
+}
+
+/* 周期定时器在now时刻到期之后的下一次超时时间（未折合），一定晚于本次的超时时间 */
+static time_t next_due(const struct timer_node *n, time_t now)
+{
+    switch(n->policy)
+    {
+        case TIMER_SKIP:
+        {
+            if(now < n->due)
+            {
+                return n->due + n->interval;
+            }
+            return n->due + ((now - n->due) / n->interval + 1) * n->interval;
+        }
+        case TIMER_CATCHUP:
+        {
+            return n->due + n->interval;
+        }
+        default:
+        {
+            return (now > n->due ? now : n->due) + n->interval;
+        }
+    }
+}
+
+/*
+ * 处理链表上到期的任务，返回执行的定时任务数。一次性定时器在调用回调函数之前
+ * 就已从链表中删除；周期定时器在调用回调函数之前已经按下一次的超时时间重新
+ * 排入链表。回调函数中可以安全地添加、调整和删除定时器，包括正在执行的这个
+ * 周期定时器。TIMER_CATCHUP的定时器补上的周期也在这一次调用中执行。
+ * 堆的惰性模式下顺带回收堆顶的墓碑，被推迟过的定时器移动到新的位置
+ * */
+int timer_tick(struct timer_ctx *ctx, time_t now)
+{
+    int fired = 0;
 
     /*
      * 从头结点开始处理每个定时器，
      * 直到遇到一个尚未到期的定时器
      */
-    while(tmp)
+    uint32_t slot;
+    while((slot = order_first(ctx)) != TIMER_NIL)
     {
+        struct timer_node *n = &ctx->nodes[slot];
+        if(n->dead)
+        {
+            heap_remove(ctx, 0);
+            reclaim(ctx, slot);
+            continue;
+        }
         /*
          * 因为每个定时器都使用绝对时间作为超时值，
          * 所以我们可以把定时器的超时值和系统当前时间
-         * 进行对比，以判断定时器是否到期 
+         * 进行对比，以判断定时器是否到期
          * */
-        if(cur < tmp->expire)
+        if(now < n->key)
         {
             break;
         }
-        /* 调整定时器的回调函数，以执行定时任务 */
-        tmp->cb_func(tmp->user_data);
+        if(now < n->expire)
+        {
+            /* 惰性推迟过的定时器还没到期，按真正的超时时间重新排入 */
+            n->key = n->expire;
+            order_later(ctx, slot);
+            continue;
+        }
 
-        /* 
-         * 执行完定时器中的定时任务之后，
-         * 就将它从链表中删除，并重置头结点
-         */
-        m_list.head = tmp->next;
-        if(m_list.head)
+        timer_cb cb = n->cb;
+        void *arg = n->arg;
+        if(n->interval > 0)
+        {
+            /* 每次重新排入都按slack折合，而不只是第一次 */
+            n->due = next_due(n, now);
+            n->expire = n->key = timer_coalesce(n->due, n->slack);
+            order_later(ctx, slot);
+        }
+        else
+        {
+            order_remove(ctx, slot);
+            free_slot(ctx, slot);
+        }
+        /* 执行定时任务 */
+        if(cb)
         {
-            m_list.head->prev = NULL;
+            cb(arg);
         }
-        free(tmp);
-        tmp = m_list.head;
+        fired++;
     }
+    return fired;
 }
 
+/* 查询定时器的超时时间和用户数据，句柄已失效时返回-1 */
+int timer_get(struct timer_ctx *ctx, timer_id id, time_t *expire, void **arg)
+{
+    uint32_t slot = id_slot(ctx, id);
+    if(slot == TIMER_NIL)
+    {
+        return -1;
+    }
+    if(expire)
+    {
+        *expire = ctx->nodes[slot].expire;
+    }
+    if(arg)
+    {
+        *arg = ctx->nodes[slot].arg;
+    }
+    return 0;
+}
+
+/*
+ * 第一个定时器，没有定时器时返回TIMER_INVALID。timer_first和timer_next按链表
+ * 顺序遍历，即到期顺序；堆按堆数组的顺序遍历，不是到期顺序
+ */
+timer_id timer_first(struct timer_ctx *ctx)
+{
+    uint32_t slot = iter_from(ctx, ctx->head, 0);
+    return slot == TIMER_NIL ? TIMER_INVALID : make_id(ctx, slot);
+}
+
+/* 下一个定时器，已经是最后一个或者句柄已失效时返回TIMER_INVALID */
+timer_id timer_next(struct timer_ctx *ctx, timer_id id)
+{
+    uint32_t slot = id_slot(ctx, id);
+    if(slot == TIMER_NIL)
+    {
+        return TIMER_INVALID;
+    }
+    slot = iter_from(ctx, ctx->nodes[slot].next, ctx->nodes[slot].pos + 1);
+    return slot == TIMER_NIL ? TIMER_INVALID : make_id(ctx, slot);
+}
+
+/*
+ * 下一次需要调用timer_tick的时间，没有定时器时返回-1。堆的惰性模式下它可能
+ * 早于真正的最早超时时间，到时调用timer_tick只是回收墓碑、调整推迟过的定时器
+ */
+int timer_earliest(struct timer_ctx *ctx, time_t *when)
+{
+    uint32_t slot = order_first(ctx);
+    if(slot == TIMER_NIL)
+    {
+        return -1;
+    }
+    *when = ctx->nodes[slot].key;
+    return 0;
+}
+
+unsigned timer_count(struct timer_ctx *ctx)
+{
+    return ctx->count;
+}
+
+/* 堆中尚未回收的墓碑数 */
+unsigned timer_dead(struct timer_ctx *ctx)
+{
+    return ctx->dead;
+}
+
+/* 遍历定时器并输出 */
+void timer_print(struct timer_ctx *ctx, FILE *fp)
+{
+    timer_id t;
+    for(t = timer_first(ctx); t; t = timer_next(ctx, t))
+    {
+        fprintf(fp, "the timer is %ld\n", (long)ctx->nodes[(uint32_t)t - 1].expire);
+    }
+}
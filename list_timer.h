@@ -1,40 +1,74 @@
 #ifndef __LIST_TIMER_H__
 #define __LIST_TIMER_H__
 
+#include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 
-#define BUFFER_SIZE 64
+/*
+ * 定时器句柄：低32位为定时器所在槽位的下标加1，高32位为槽位的代数。槽位每释放
+ * 一次代数加1，所以定时器到期或被删除之后，旧句柄不会误操作复用该槽位的新定时器。
+ * 0不是有效的句柄
+ */
+typedef uint64_t timer_id;
+#define TIMER_INVALID   ((timer_id)0)
 
-struct util_timer;
-/* 用户数据结构：客户端socket地址、socket文件描述符、读缓存、定时器 */
-struct client_data{
-    struct sockaddr_in address;
-    int sockfd;
-    char buf[BUFFER_SIZE];
-    struct util_timer* timer;
-};
+/* 定时器的回调函数，arg为添加定时器时传入的用户数据 */
+typedef void (*timer_cb)(void *arg);
 
-/* 定时器结构体 */
-struct util_timer{
-    timer_t expire;                     /* 任务的超时时间，这里使用绝对时间 */
-    void (*cb_func) (struct client_data *);    /* 任务的回调函数 */
-    struct client_data *user_data;             /* 回调函数处理的客户数据，由定时器的执行者传递给回调函数 */
-    struct util_timer *prev;                   /* 指向前一个定时器 */
-    struct util_timer *next;                   /* 指向后一个定时器 */
+/*
+ * 周期定时器错过到期时间（timer_tick调用得晚了）时的处理方式
+ */
+enum timer_policy{
+    TIMER_RELATIVE,                     /* 下一次在本次实际执行之后interval到期，会累积漂移 */
+    TIMER_SKIP,                         /* 按first + k * interval的固定时间表到期，错过的周期直接跳过 */
+    TIMER_CATCHUP                       /* 按固定时间表到期，错过的周期在同一次timer_tick中逐个补上 */
 };
 
-/* 双向链表 */
-struct timer_list{
-    struct util_timer* head;
-    struct util_timer* tail;
+/* 定时器上下文，内部结构对使用者不可见，不同的上下文之间互不影响 */
+struct timer_ctx;
+/* 定时器内存的来源，见arena.h */
+struct arena;
+
+/* timer_ctx_new_flags的参数 */
+#define TIMER_CTX_HEAP  0x1             /* 用二叉最小堆代替有序链表，插入是O(log n)，不依赖超时值单调递增 */
+/*
+ * 惰性模式，只对堆有效：删除定时器只标记为墓碑，推迟超时只记下新的超时时间，
+ * 都不调整堆，适合绝大多数定时器在到期之前就被删除或推迟的场景
+ */
+#define TIMER_CTX_LAZY  0x2
+
+/* 批量添加的定时器 */
+struct timer_spec{
+    time_t expire;                      /* 超时时间，这里使用绝对时间 */
+    time_t slack;                       /* 允许推迟到期的时间，0表示准时到期，见timer_slack.h */
+    timer_cb cb;                        /* 任务的回调函数 */
+    void *arg;                          /* 回调函数处理的用户数据 */
 };
-struct timer_list m_list;
 
-void add_timer_nohead(struct util_timer* timer, struct util_timer* lst_head);
-void add_timer(struct util_timer *timer);
-void adjust_timer(struct util_timer *timer);
-void del_timer(struct util_timer *timer);
-void print_list();
-void tick();
+struct timer_ctx *timer_ctx_new(void);
+struct timer_ctx *timer_ctx_new_flags(unsigned flags);
+struct timer_ctx *timer_ctx_new_arena(unsigned flags, struct arena *a);
+void timer_ctx_free(struct timer_ctx *ctx);
+
+timer_id timer_add(struct timer_ctx *ctx, time_t expire, timer_cb cb, void *arg);
+timer_id timer_add_slack(struct timer_ctx *ctx, time_t expire, time_t slack, timer_cb cb, void *arg);
+timer_id timer_add_periodic(struct timer_ctx *ctx, time_t first, time_t interval,
+                            enum timer_policy policy, timer_cb cb, void *arg);
+timer_id timer_add_periodic_slack(struct timer_ctx *ctx, time_t first, time_t interval, time_t slack,
+                                  enum timer_policy policy, timer_cb cb, void *arg);
+int timer_add_batch(struct timer_ctx *ctx, const struct timer_spec *specs, int n, timer_id *ids);
+int timer_adjust(struct timer_ctx *ctx, timer_id id, time_t expire);
+int timer_del(struct timer_ctx *ctx, timer_id id);
+int timer_tick(struct timer_ctx *ctx, time_t now);
+unsigned timer_compact(struct timer_ctx *ctx);
+
+int timer_get(struct timer_ctx *ctx, timer_id id, time_t *expire, void **arg);
+timer_id timer_first(struct timer_ctx *ctx);
+timer_id timer_next(struct timer_ctx *ctx, timer_id id);
+int timer_earliest(struct timer_ctx *ctx, time_t *when);
+unsigned timer_count(struct timer_ctx *ctx);
+unsigned timer_dead(struct timer_ctx *ctx);
+void timer_print(struct timer_ctx *ctx, FILE *fp);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,311 @@
+/*
+ * Description: 异步日志。每个线程拥有一个单生产者/单消费者的无锁环形缓冲区，
+ *              日志在调用线程中格式化到环中的槽位上，后台线程批量取出并通过
+ *              writev 写出，热路径上不会因为 stdout/管道 的 I/O 而阻塞；
+ *              环满时直接丢弃并计数
+ * Author:      Denny
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "log.h"
+
+#define LOG_BATCH   64      /* 后台线程一次 writev 的最大条数 */
+
+/* 环中的一条日志 */
+struct log_slot{
+    int len;
+    char line[LOG_LINE_MAX];
+};
+
+/*
+ * 每个线程的环形缓冲区，head只由后台线程修改，tail只由所属线程修改。
+ * 线程退出时设置closed，后台线程写完其中的日志后把它摘下释放
+ */
+struct log_ring{
+    _Atomic unsigned long head;
+    _Atomic unsigned long tail;
+    atomic_bool closed;
+    struct log_slot slots[LOG_RING_SLOTS];
+    struct log_ring *next;       /* 串联所有线程的环，供后台线程遍历 */
+};
+
+static const char *level_name[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static int log_fd = -1;
+static pthread_t log_thread;
+static atomic_bool log_running = false;
+static atomic_ulong dropped = 0;
+
+/* 所有已注册的环，只在注册和退出时加锁 */
+static struct log_ring *_Atomic rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* log_exit释放所有环时加1，线程缓存的环属于旧的一代时不再使用 */
+static _Atomic unsigned ring_gen = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static __thread struct log_ring *my_ring = NULL;
+static __thread unsigned my_gen = 0;
+
+/* 线程退出时把自己的环标记为关闭，环已被log_exit释放时什么也不做 */
+static void release_ring(void *arg)
+{
+    struct log_ring *ring = (struct log_ring *)arg;
+    pthread_mutex_lock(&rings_lock);
+    if(ring == my_ring && my_gen == atomic_load(&ring_gen))
+    {
+        atomic_store_explicit(&ring->closed, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    my_ring = NULL;
+}
+
+static void ring_key_init(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/* 获取（必要时创建并注册）当前线程的环 */
+static struct log_ring *get_ring(void)
+{
+    if(my_ring && my_gen == atomic_load_explicit(&ring_gen, memory_order_acquire))
+    {
+        return my_ring;
+    }
+    pthread_once(&ring_once, ring_key_init);
+    struct log_ring *ring = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+    if(!ring)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    atomic_store_explicit(&rings, ring, memory_order_release);
+    my_gen = atomic_load(&ring_gen);
+    pthread_mutex_unlock(&rings_lock);
+    my_ring = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+/* 将时间戳、级别和日志内容格式化到buf中，返回长度（保证以换行结尾） */
+static int format_line(char *buf, int level, const char *fmt, va_list ap)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+    int n = snprintf(buf, LOG_LINE_MAX, "[%ld.%03ld] %-5s ",
+                     (long)ts.tv_sec, ts.tv_nsec / 1000000, level_name[level]);
+    int m = vsnprintf(buf + n, LOG_LINE_MAX - n, fmt, ap);
+    if(m < 0)
+    {
+        m = 0;
+    }
+    n += m;
+    /* 被截断时保留最后一个字节放换行 */
+    if(n > LOG_LINE_MAX - 1)
+    {
+        n = LOG_LINE_MAX - 1;
+    }
+    buf[n++] = '\n';
+    return n;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    /* 后台线程尚未启动（或已退出）时同步写出 */
+    if(!atomic_load_explicit(&log_running, memory_order_acquire))
+    {
+        char buf[LOG_LINE_MAX];
+        va_start(ap, fmt);
+        int n = format_line(buf, level, fmt, ap);
+        va_end(ap);
+        if(write(log_fd >= 0 ? log_fd : STDOUT_FILENO, buf, n) < 0)
+        {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        }
+        return;
+    }
+
+    struct log_ring *ring = get_ring();
+    if(!ring)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    /* 环满则丢弃，绝不阻塞调用者 */
+    if(tail - head >= LOG_RING_SLOTS)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct log_slot *slot = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+    va_start(ap, fmt);
+    slot->len = format_line(slot->line, level, fmt, ap);
+    va_end(ap);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* 把一个环中已提交的日志批量写出，返回写出的条数 */
+static int drain_ring(struct log_ring *ring)
+{
+    struct iovec iov[LOG_BATCH];
+    int total = 0;
+
+    while(1)
+    {
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        int cnt = 0;
+        while(head + cnt != tail && cnt < LOG_BATCH)
+        {
+            struct log_slot *slot = &ring->slots[(head + cnt) & (LOG_RING_SLOTS - 1)];
+            iov[cnt].iov_base = slot->line;
+            iov[cnt].iov_len = slot->len;
+            cnt++;
+        }
+        if(cnt == 0)
+        {
+            return total;
+        }
+        /* 写失败（如对端关闭了管道）时同样要推进head，否则生产者会一直丢日志 */
+        if(writev(log_fd, iov, cnt) < 0)
+        {
+            atomic_fetch_add_explicit(&dropped, cnt, memory_order_relaxed);
+        }
+        atomic_store_explicit(&ring->head, head + cnt, memory_order_release);
+        total += cnt;
+    }
+}
+
+/* 把已关闭的环从链表中摘下释放，只由后台线程调用 */
+static void reap_ring(struct log_ring *ring)
+{
+    pthread_mutex_lock(&rings_lock);
+    struct log_ring *prev = atomic_load_explicit(&rings, memory_order_relaxed);
+    if(prev == ring)
+    {
+        atomic_store_explicit(&rings, ring->next, memory_order_release);
+    }
+    else
+    {
+        while(prev->next != ring)
+        {
+            prev = prev->next;
+        }
+        prev->next = ring->next;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    free(ring);
+}
+
+static int drain_all(void)
+{
+    int total = 0;
+    struct log_ring *ring = atomic_load_explicit(&rings, memory_order_acquire);
+    while(ring)
+    {
+        struct log_ring *next = ring->next;
+        /* 先看closed再写出，保证所属线程关闭前提交的日志都已写出 */
+        bool closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        total += drain_ring(ring);
+        if(closed)
+        {
+            reap_ring(ring);
+        }
+        ring = next;
+    }
+    return total;
+}
+
+/* 后台写线程：空闲时逐步退避休眠，最长1ms */
+static void *log_thread_func(void *arg)
+{
+    (void)arg;
+    long idle_ns = 0;
+    while(atomic_load_explicit(&log_running, memory_order_acquire))
+    {
+        if(drain_all() > 0)
+        {
+            idle_ns = 0;
+            continue;
+        }
+        idle_ns = idle_ns ? idle_ns * 2 : 50000;
+        if(idle_ns > 1000000)
+        {
+            idle_ns = 1000000;
+        }
+        struct timespec ts = { 0, idle_ns };
+        nanosleep(&ts, NULL);
+    }
+    /* 退出前把剩余的日志全部写出 */
+    drain_all();
+    return NULL;
+}
+
+/* 启动后台写线程，日志写到fd */
+int log_init(int fd)
+{
+    if(atomic_load(&log_running))
+    {
+        return 0;
+    }
+    log_fd = fd;
+    atomic_store(&log_running, true);
+    if(pthread_create(&log_thread, NULL, log_thread_func, NULL) != 0)
+    {
+        atomic_store(&log_running, false);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 停止后台线程，写出剩余日志并释放所有环，调用前应保证其他线程已不再写日志。
+ * 之后各线程缓存的环都作废，再写日志时同步写出，重新log_init后各自创建新的环
+ */
+void log_exit(void)
+{
+    if(!atomic_load(&log_running))
+    {
+        return;
+    }
+    atomic_store(&log_running, false);
+    pthread_join(log_thread, NULL);
+
+    pthread_mutex_lock(&rings_lock);
+    struct log_ring *ring = atomic_exchange(&rings, NULL);
+    while(ring)
+    {
+        struct log_ring *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    atomic_fetch_add(&ring_gen, 1);
+    pthread_mutex_unlock(&rings_lock);
+    my_ring = NULL;
+}
+
+/* 因环满或写失败而丢弃的日志条数 */
+unsigned long log_dropped(void)
+{
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
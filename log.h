@@ -0,0 +1,41 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+/* 日志级别 */
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE  4
+
+/*
+ * 编译期日志级别，低于该级别的日志调用在编译时被消除（参数不会被求值），
+ * 可以通过 make CFLAGS+=-DLOG_LEVEL=0 之类的方式覆盖
+ */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SLOTS  1024    /* 每个线程环形缓冲区的槽数，必须是2的幂 */
+#define LOG_LINE_MAX    256     /* 单条日志（含时间戳和级别）的最大长度 */
+
+int log_init(int fd);
+void log_exit(void);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+unsigned long log_dropped(void);
+
+/* 被过滤掉的级别展开为 if(0)，保留参数的类型检查但不产生任何代码 */
+#define LOG_AT(level, fmt, ...)                             \
+    do {                                                    \
+        if((level) >= LOG_LEVEL)                            \
+        {                                                   \
+            log_write((level), fmt, ##__VA_ARGS__);         \
+        }                                                   \
+    } while(0)
+
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...)  LOG_AT(LOG_LEVEL_INFO,  fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...)  LOG_AT(LOG_LEVEL_WARN,  fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+
+#endif
@@ -6,6 +6,7 @@
  * 
  * */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <signal.h>
@@ -15,9 +16,16 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <libgen.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -27,15 +35,179 @@
 
 
 #include "list_timer.h"
+#include "arena.h"
+#include "conn.h"
+#include "uring.h"
+#include "handoff.h"
+#include "log.h"
+
+/* epoll实例的忙轮询参数，Linux 6.9加入，旧的头文件中没有 */
+#ifndef EPIOCSPARAMS
+struct epoll_params{
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
 
 /* 超时时间 */
 #define TIMESLOT 5
+/* 非活动连接的空闲超时，过载时最短缩到IDLE_TIMEOUT_MIN秒 */
+#define IDLE_TIMEOUT (3 * TIMESLOT)
+#define IDLE_TIMEOUT_MIN 2
+/* 过载时每次至少关闭的连接数 */
+#define SHED_MIN_DEFAULT 16
 /* epoll处理的最大事件数目 */
 #define MAX_EVENT_NUMBER 1024
+/* 每轮循环最多accept的连接数 */
+#define ACCEPT_CAP_DEFAULT 256
+/* 连接表大小的上限，描述符上限为RLIM_INFINITY或者更大时按这个值截断 */
+#define MAX_FDS_LIMIT (1 << 20)
+
+/* 事件循环后端 */
+enum backend_type{
+    BACKEND_EPOLL,
+    BACKEND_URING
+};
 
 /* 信号管道 */
 static int pipefd[2];
-static int epollfd = 0;
+static int epollfd = -1;
+
+/* 以文件描述符为下标的连接表 */
+static struct client_data *users = NULL;
+static int max_fds = 0;
+
+static bool stop_server = false;
+static bool timeout = false;
+
+/* 每个连接每次事件最多读取的字节数，可通过 -r 配置 */
+static int read_cap = READ_CAP_DEFAULT;
+/* 事件循环后端，可通过 -B 选择，io_uring不可用时退回到epoll */
+static enum backend_type backend = BACKEND_EPOLL;
+/* io_uring后端下使用关联超时而不是定时器链表检测非活动连接，可通过 -T 开启 */
+static bool native_timeout = false;
+/* 监听队列长度，可通过 -b 配置 */
+static int listen_backlog = SOMAXCONN;
+/* 每轮循环最多accept的连接数，可通过 -a 配置 */
+static int accept_cap = ACCEPT_CAP_DEFAULT;
+/* 预留的文件描述符，描述符耗尽时用来接受并关闭排队的连接 */
+static int reserve_fd = -1;
+/* 回显模式：把收到的每一行原样发回，可通过 -e 开启 */
+static bool echo_mode = false;
+/* 大块响应使用MSG_ZEROCOPY发送，可通过 -z 开启 */
+static bool zerocopy = false;
+/* 非活动连接的超时允许推迟的秒数，超时值相近的连接折合到同一时间点一起关闭，可通过 -s 配置 */
+static time_t conn_slack = 0;
+/* epoll后端不再每TIMESLOT秒唤醒一次，闹钟只定在最早的定时器到期时，可通过 -L 开启 */
+static bool tickless = false;
+static time_t alarm_at = 0;
+
+/*
+ * 忙轮询：epoll后端用0超时的epoll_wait空转，不经过闹钟信号和信号管道，每轮循环
+ * 直接比较最早的定时器超时时间；连续空转 -y 指定的微秒数都没有事件时退回到阻塞，
+ * 阻塞到最早的定时器到期，被唤醒后重新开始空转。-C 把事件循环线程绑定到指定的CPU
+ */
+static long busy_poll_us = 0;
+static int pin_cpu = -1;
+
+/*
+ * 过载保护：连接数达到上限（-c，-O 时默认为描述符上限的9/10）、RSS达到 -m 指定的
+ * 兆字节数或者accept遇到描述符耗尽时，从定时器链表头部开始关闭最接近超时的连接，
+ * 每次至少 -n 个，同时把空闲超时减半；连接数和RSS都回落到上限的7/8以下后，每个
+ * TIMESLOT把空闲超时加倍，直到恢复为IDLE_TIMEOUT。io_uring自身超时（-T）下没有
+ * 定时器链表，不做过载保护
+ */
+static int conn_high = 0;
+static long rss_high = 0;
+static int shed_min = SHED_MIN_DEFAULT;
+static time_t idle_timeout = IDLE_TIMEOUT;
+static time_t idle_adjusted = 0;
+static int live_conns = 0;
+static bool fd_exhausted = false;
+static long rss_now = 0;
+static time_t rss_sampled = 0;
+
+/*
+ * epoll后端的就绪队列：因达到读取上限而没有读完、或者输出降到低水位以下
+ * 恢复读取的连接，在下一轮循环中继续读取
+ */
+static int *ready = NULL;
+static int *ready_next = NULL;
+static int nready = 0;
+static int nnext = 0;
+
+/*
+ * 热升级：收到SIGUSR2后以相同的参数启动新的可执行文件，并把监听socket、所有连接
+ * 以及它们剩余的超时时间交给它，新进程通过 -H 参数得知交接用的描述符
+ */
+static bool upgrade = false;
+static int handoff_fd = -1;
+static char exe_path[PATH_MAX];
+static char **saved_argv = NULL;
+static int saved_argc = 0;
+/* 新进程从旧进程接过来、尚未注册到事件循环的连接 */
+static int *adopted = NULL;
+static int nadopted = 0;
+
+/* 本轮accept到、尚未创建定时器的连接 */
+static int *accepted = NULL;
+static int naccepted = 0;
+static struct timer_spec *timer_batch = NULL;
+static timer_id *timer_ids = NULL;
+
+/* 非活动连接的定时器链表 */
+static struct timer_ctx *timers = NULL;
+/* 主线程的arena，连接表和定时器链表从本地NUMA节点的大页上分配 */
+static struct arena *arena = NULL;
+
+/* accept路径的统计信息 */
+static struct{
+    unsigned long accepted;         /* 接受的连接数 */
+    unsigned long batches;          /* 批量创建定时器的次数 */
+    unsigned long cap_hits;         /* 因达到accept上限而留到下一轮的次数 */
+    unsigned long reserve_drops;    /* 描述符耗尽时通过预留描述符关闭的连接数 */
+} accept_stats;
+
+/* 定时器的统计信息 */
+static struct{
+    unsigned long wakeups;          /* 处理定时任务的次数 */
+    unsigned long expired;          /* 到期的定时器数 */
+} timer_stats;
+
+/* 忙轮询的统计信息 */
+static struct{
+    unsigned long empty_polls;      /* 空转时没有事件的epoll_wait次数 */
+    unsigned long spin_ns;          /* 空转花费的时间 */
+    unsigned long spin_hits;        /* 空转中取到事件的次数，每次省去一次阻塞和唤醒 */
+    unsigned long sleeps;           /* 退回到阻塞的次数 */
+} busy_stats;
+
+/* 过载保护的统计信息 */
+static struct{
+    unsigned long sheds;            /* 因过载关闭连接的次数 */
+    unsigned long evicted;          /* 因过载关闭的连接数 */
+    unsigned long fd_exhausted;     /* accept遇到描述符耗尽的次数 */
+    time_t min_timeout;             /* 空闲超时缩到的最小值 */
+} overload_stats;
+
+static long mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * 连接定时器使用的时间（秒），取单调时钟，不受系统时间调整的影响。
+ * 交接时快照中只记录剩余的秒数，新旧进程之间不需要同一个时间起点
+ */
+static time_t now_sec()
+{
+    return (time_t)(mono_ns() / 1000000000L);
+}
 
 /* 添加非阻塞选项 */
 static int set_nonblocking(int fd)
@@ -46,14 +218,17 @@ static int set_nonblocking(int fd)
     return old_option;
 }
 
-/* 添加fd到epoll事件表 */
-static void add_fd(int epollfd, int fd)
+/* 添加fd到epoll事件表，nonblock为false表示fd已经是非阻塞的 */
+static void add_fd(int epollfd, int fd, bool nonblock)
 {
     struct epoll_event event;
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLET;  /* 边缘触发 */
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    set_nonblocking(fd);
+    if(nonblock)
+    {
+        set_nonblocking(fd);
+    }
 }
 
 static void add_sig(int sig, void (*handler)(int), bool restart)
@@ -75,13 +250,13 @@ static void add_sig(int sig, void (*handler)(int), bool restart)
     }
 }
 
-/* create a socket and bind */
-static int socket_new(const char *ip, const int port)
+/* create a socket and bind, the listening socket is non-blocking */
+static int socket_new(const char *ip, const int port, int backlog)
 {
     struct sockaddr_in servaddr;
     int sockfd;
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sockfd == -1)
     {
         perror("socket error:");
@@ -108,9 +283,9 @@ static int socket_new(const char *ip, const int port)
         return -1;
     }
 
-    if (listen(sockfd, 5) < 0)
+    if (listen(sockfd, backlog) < 0)
     {
-    	perror("bind error: ");
+    	perror("listen error: ");
         return -1;
     }
     return sockfd;
@@ -126,243 +301,2026 @@ void sig_handler(int sig)
 }
 
 /* 定时器回调函数，删除非活动连接socket上的注册事件，并关闭之 */
-void cb_func(struct client_data* user_data)
+static void cb_func(void *arg)
 {
-    epoll_ctl( epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0 );
+    struct client_data *user_data = (struct client_data *)arg;
     assert(user_data);
+    if(epollfd >= 0)
+    {
+        epoll_ctl( epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0 );
+    }
+    else
+    {
+        /* io_uring中的recv请求持有文件的引用，close不会让它结束，先shutdown */
+        shutdown(user_data->sockfd, SHUT_RDWR);
+    }
+    conn_release(user_data);
     close(user_data->sockfd);
-    printf("close fd %d\n", user_data->sockfd);
+    LOG_DEBUG("close fd %d", user_data->sockfd);
+    /* 标记连接已关闭，之后到达的该连接的完成事件都会被忽略 */
+    user_data->sockfd = -1;
+    user_data->timer = TIMER_INVALID;
+    live_conns--;
 }
 
-/* 处理定时任务 */
-void timer_handler()
+/* 主动关闭连接，并移除对应的定时器 */
+static void close_conn(struct client_data *c)
 {
-     printf("time is out \n");
-    /* 定时处理任务 */
-    tick();
+    timer_del(timers, c->timer);
+    cb_func(c);
+}
 
-    /* 
-     * 一次alarm调用只会引起一次SIGALRM信号
-     * 所以我们要重新定时，以不断触发SIGALRM信号
-     */
-    alarm( TIMESLOT );
+/*
+ * 处理读到的数据：按行处理，最后一个换行符之后的不完整数据
+ * 留给下一次读取，返回已处理的字节数
+ */
+static int handle_data(struct client_data *c, const char *data, int len)
+{
+    const char *end = memrchr(data, '\n', len);
+    if(!end)
+    {
+        return 0;
+    }
+    int used = end - data + 1;
+    LOG_DEBUG("get %d bytes of client data from %d", used, c->sockfd);
+    /* 回显模式下响应先进入输出队列，本次读取结束后合并发出 */
+    if(echo_mode && conn_queue(c, data, used) < 0)
+    {
+        return -1;
+    }
+    return used;
 }
 
-/* 统一事件源，监听信号，以及添加信号处理函数 */
-static void set_sig_pipe(int epollfd)
+/* 有数据读写，则调整该连接对应的定时器，以延迟该连接被关闭的时间 */
+static void conn_active(struct client_data *c)
 {
-    int ret;
-    /* 创建信号管道 */
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
-    if(ret == -1)
+    if(c->timer)
     {
-        perror("create socketpair failed \n");
-        return;
+        time_t cur = now_sec();
+        LOG_DEBUG( "adjust timer once" );
+        timer_adjust(timers, c->timer, cur + idle_timeout);
     }
+}
 
-    set_nonblocking(pipefd[1]);  /* 将写端设置为非阻塞 */
-    add_fd(epollfd, pipefd[0]);  /* 将读端添加到epoll事件集中进行监听 */
+/* 填充连接的用户数据 */
+static struct client_data *init_conn(int connfd, const struct sockaddr_in *client_address)
+{
+    struct client_data *c = &users[connfd];
 
-    /* 添加信号处理 */
-    add_sig(SIGALRM, sig_handler, true);
-    add_sig(SIGTERM, sig_handler, true);
+    /* 填充用户数据 */
+    if(client_address)
+    {
+        c->address = *client_address;
+    }
+    else
+    {
+        memset(&c->address, 0, sizeof(c->address));
+    }
+    c->sockfd = connfd;
+    c->gen++;
+    c->timer = TIMER_INVALID;
+    live_conns++;
+    if(zerocopy)
+    {
+        int on = 1;
+        c->zerocopy = (setsockopt(connfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0);
+    }
+    return c;
 }
 
-int main(int argc, char* argv[])
+/* 填充新连接的用户数据，并记录下来等待批量创建定时器 */
+static void new_conn(int connfd, const struct sockaddr_in *client_address)
+{
+    init_conn(connfd, client_address);
+    accepted[naccepted++] = connfd;
+    accept_stats.accepted++;
+}
+
+/*
+ * 为一批连接创建定时器，设置其回调函数与超时时间，然后绑定定时器与用户数据。
+ * specs须按超时时间升序排列，整批一次插入定时器链表
+ */
+static void add_conn_timers(struct timer_spec *specs, timer_id *ids, int n)
 {
-    if( argc <= 2 )
+    int i;
+    timer_add_batch(timers, specs, n, ids);
+    for(i = 0; i < n; i++)
     {
-        printf( "usage: %s ip_address port_number\n", basename(argv[0]));
-        return 1;
+        ((struct client_data *)specs[i].arg)->timer = ids[i];
     }
-    
-    int ret = 0;
-    int listenfd = 0;
-    struct epoll_event events[MAX_EVENT_NUMBER];
-    int i, number;
-
-    const char* ip = argv[1];
-    const int port = atoi(argv[2]);
-    /* socket的监听描述符 */
-    listenfd = socket_new(ip, port);
-    
-    epollfd = epoll_create(5);
-    if(epollfd == -1)
+}
+
+/* 为本轮accept到的所有连接创建定时器，整批连接只取一次当前时间 */
+static void arm_accepted_timers()
+{
+    int i;
+    if(naccepted == 0 || native_timeout)
     {
-        perror("create epoll failed \n");
-        return -1;
+        return;
+    }
+    time_t cur = now_sec();
+    for(i = 0; i < naccepted; i++)
+    {
+        timer_batch[i].expire = cur + idle_timeout;
+        timer_batch[i].slack = conn_slack;
+        timer_batch[i].cb = cb_func;             /* 定时器的回调函数 */
+        timer_batch[i].arg = &users[accepted[i]];/* 用户数据，传递给回调函数处理 */
     }
-    add_fd(epollfd, listenfd);
-    
-    /* 统一事件源，将信号和IO处理一起处理 */
-    set_sig_pipe(epollfd);
+    add_conn_timers(timer_batch, timer_ids, naccepted);     /* 添加到链表 */
+    accept_stats.batches++;
+}
 
-    bool stop_server = false;
-    struct client_data *users = (struct client_data*)malloc(sizeof(struct client_data));
-    bool timeout = false;
-    alarm(TIMESLOT); /* 定时器 */
+/*
+ * 描述符耗尽时accept会一直失败而连接一直留在队列中，边缘触发下也不会再收到通知。
+ * 这时先关闭预留的描述符腾出一个位置，接受并立即关闭排队的连接，再重新预留，
+ * 返回false表示队列已空或者没有可用的预留描述符
+ */
+static bool accept_with_reserve(int listenfd)
+{
+    if(reserve_fd < 0)
+    {
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return false;
+    }
+    close(reserve_fd);
+    int fd = accept(listenfd, NULL, NULL);
+    if(fd >= 0)
+    {
+        close(fd);
+        accept_stats.reserve_drops++;
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0;
+}
 
-    while(!stop_server)
+/*
+ * 边缘触发的监听socket每次事件都要把全连接队列取空，但一轮最多处理accept_cap个，
+ * 返回true表示达到上限，队列中可能还有连接，需要在下一轮继续
+ */
+static bool accept_batch(int listenfd)
+{
+    int i;
+    naccepted = 0;
+    for(i = 0; i < accept_cap; i++)
     {
-        //获取就绪的文件描述符个数
-        number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-        if ( ( number < 0 ) && ( errno != EINTR ) )
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        int connfd = accept4( listenfd, ( struct sockaddr* )&client_address, &client_addrlength,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if(connfd < 0)
         {
-            printf( "epoll failure\n" );
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                fd_exhausted = true;
+                overload_stats.fd_exhausted++;
+            }
+            if((errno == EMFILE || errno == ENFILE) && accept_with_reserve(listenfd))
+            {
+                LOG_WARN("out of file descriptors, dropped a pending connection");
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOG_WARN("accept failure: %s", strerror(errno));
+            }
             break;
         }
+        /* 添加connfd到epoll事件集中 */
+        add_fd( epollfd, connfd, false );
+        new_conn(connfd, &client_address);
+    }
+    arm_accepted_timers();
+    if(i == accept_cap)
+    {
+        accept_stats.cap_hits++;
+        return true;
+    }
+    return false;
+}
 
-        for(i = 0; i < number; i++)
+static void uring_arm_recv(struct client_data *c);
+static void uring_arm_pollout(struct client_data *c);
+static void uring_refresh_idle(struct client_data *c);
+
+/* epoll后端：把连接放入下一轮的就绪队列 */
+static void mark_ready(struct client_data *c)
+{
+    if(!c->in_ready)
+    {
+        c->in_ready = true;
+        ready_next[nnext++] = c->sockfd;
+    }
+}
+
+/* 输出队列写不完时等待可写事件，写完后取消 */
+static void want_write(struct client_data *c, bool on)
+{
+    if(backend == BACKEND_URING)
+    {
+        /* 单次的poll请求完成时清除want_out */
+        if(on && !c->want_out)
         {
-            int sockfd = events[i].data.fd;
-            /* 处理新的客户连接 */
-            if(sockfd == listenfd)
-            {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                /* 添加connfd到epoll事件集中 */
-                add_fd( epollfd, connfd );
-
-                /* 填充用户数据 */
-                users[connfd].address = client_address;
-                users[connfd].sockfd = connfd;
-                
-                /* 
-                 * 创建定时器，设置其回调函数与超时时间，然后绑定定时器与用户数据
-                 * 最后将定时器添加到链表timer_list中  
-                 * */
-                struct util_timer *timer = (struct util_timer *)malloc(sizeof(struct util_timer));
-                timer->user_data = &users[connfd];   /* 用户数据，传递给回调函数处理 */
-                timer->cb_func = cb_func;            /* 定时器的回调函数 */
-                time_t cur = time(NULL);
-                timer->expire = cur + 3 * TIMESLOT;
+            uring_arm_pollout(c);
+            c->want_out = true;
+        }
+        return;
+    }
+    if(on == c->want_out)
+    {
+        return;
+    }
+    struct epoll_event event;
+    event.data.fd = c->sockfd;
+    event.events = EPOLLIN | EPOLLET | (on ? EPOLLOUT : 0);
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, c->sockfd, &event);
+    c->want_out = on;
+}
+
+/* 输出积压降下来之后恢复读取 */
+static void resume_read(struct client_data *c)
+{
+    if(backend == BACKEND_URING)
+    {
+        if(!c->recv_armed)
+        {
+            uring_arm_recv(c);
+        }
+        return;
+    }
+    /* 暂停期间到达的数据不会再有边缘事件通知，直接放入就绪队列 */
+    mark_ready(c);
+}
 
-                users[connfd].timer = timer;
-                add_timer(timer);                   /* 添加到链表 */
+/* 发送连接的输出队列，返回false表示连接已被关闭 */
+static bool write_conn(struct client_data *c)
+{
+    int written;
 
-            }
-            /* 处理信号 */
-            else if( ( sockfd == pipefd[0] ) && ( events[i].events & EPOLLIN ) )
-            {
-                int sig;
-                char signals[1024];
-                ret = recv( pipefd[0], signals, sizeof(signals), 0);
-                if( ret == -1 )
-                {
-                    /* 可以在这里添加错误处理 */
-                    continue;
-                }
-                else if( ret == 0 )
-                {
-                    continue;
-                }
-                else
-                {
-                    for(i = 0; i < ret; ++i )
-                    {
-                        switch( signals[i] )
-                        {
-                            case SIGALRM:
-                            {
-                                /* 
-                                 * 收到SIGALRM时，将timeout用来标记有定时任务需要处理，但不立即处理定时任务
-                                 * 因为定时任务的优先级不是很高，我们优先处理其他更重要的任务
-                                 * */
-                                timeout = true;
-                                break;
-                            }
-                            case SIGTERM:
-                            {
-                                stop_server = true;
-                            }
-                        }
-                    }
-                }
-            }
-            /* 处理客户连接接收到的数据 */
-            else if(events[i].events & EPOLLIN )
-            {
-                memset(users[sockfd].buf, '\0', BUFFER_SIZE);
-                ret = recv(sockfd, users[sockfd].buf, BUFFER_SIZE - 1, 0);
-                printf( "get %d bytes of client data %s from %d\n", ret, users[sockfd].buf, sockfd );
-                struct util_timer* timer = users[sockfd].timer;
-                if(ret < 0)
-                {
-                    /* 如果发生读错误，则关闭连接，并移除其对应的定时器 */
-                    if(errno != EAGAIN)
-                    {
-                        cb_func(&users[sockfd]);
-                        if(timer)
-                        {
-                            del_timer(timer);
-                        }
-                    }
-                }
-                else if(ret == 0)
-                {
-                    /* 对方关闭连接，则我们也关闭连接，并移除对应的定时器 */
-                    cb_func( &users[sockfd] );
-                    if( timer )
-                    {
-                        del_timer( timer );
-                    }
-                }
-                else
-                {
-                    /* 有数据可读，则调整该连接对应的定时器，以延迟该连接被关闭的时间 */
-                    if(timer)
-                    {
-                        time_t cur = time( NULL );
-                        timer->expire = cur + 3 * TIMESLOT;
-                        printf( "adjust timer once\n" );
-                        adjust_timer( timer );
-                    }
+    if(c->zc_head)
+    {
+        conn_reap_zerocopy(c);
+    }
+    enum conn_state state = conn_flush(c, &written);
+    if(state == CONN_CLOSED)
+    {
+        close_conn(c);
+        return false;
+    }
 
-                }
-            }
-            else{
+    /* 写出数据同样说明连接是活动的 */
+    if(written > 0)
+    {
+        conn_active(c);
+        if(native_timeout && backend == BACKEND_URING)
+        {
+            uring_refresh_idle(c);
+        }
+    }
+    want_write(c, state == CONN_MORE);
 
-            }
+    if(c->read_blocked && c->out_bytes <= OUT_LOW_WATER)
+    {
+        c->read_blocked = false;
+        resume_read(c);
+    }
+    return true;
+}
+
+/* 读取连接上的数据，返回false表示连接已被关闭 */
+static bool read_conn(struct client_data *c)
+{
+    enum conn_state state;
+
+    /* 对端不读取响应时输出会一直积压，超过高水位后暂停读取，形成反压 */
+    if(c->out_bytes >= OUT_HIGH_WATER)
+    {
+        c->read_blocked = true;
+        return true;
+    }
+
+    int n = conn_read(c, read_cap, handle_data, &state);
+    if(state == CONN_CLOSED)
+    {
+        /* 对方关闭连接或者发生读错误，则关闭连接，并移除对应的定时器 */
+        close_conn(c);
+        return false;
+    }
+
+    if(n > 0)
+    {
+        conn_active(c);
+    }
+
+    /* 本次读取产生的所有响应合并成一次writev，正在等待可写事件时由可写事件负责 */
+    if(c->out_head && !c->want_out && !write_conn(c))
+    {
+        return false;
+    }
+
+    /*
+     * 边缘触发不会再次通知尚未读完的数据，达到读取上限的连接
+     * 放入就绪队列，在下一轮循环中继续读取，避免饿死其他连接
+     */
+    if(state == CONN_MORE)
+    {
+        mark_ready(c);
+    }
+    return true;
+}
+
+/* fd上是否为一个仍然打开的连接，从未使用过的表项gen为0，已关闭的sockfd为-1 */
+static bool conn_live(int fd)
+{
+    return users[fd].gen > 0 && users[fd].sockfd == fd;
+}
+
+/*
+ * 收集要交给新进程的连接。使用定时器链表时直接按链表顺序收集，快照中的记录
+ * 因此已经按剩余时间升序排列；使用io_uring自身超时时扫描连接表
+ */
+static int collect_conns(int *fds)
+{
+    int n = 0;
+    if(!native_timeout)
+    {
+        timer_id t;
+        for(t = timer_first(timers); t; t = timer_next(timers, t))
+        {
+            void *arg;
+            timer_get(timers, t, NULL, &arg);
+            fds[n++] = ((struct client_data *)arg)->sockfd;
         }
-        /* 最后处理定时事件，因为I/O事件拥有更高的优先级
-         * 当然，这样做将导致定时任务不能精确的按照预期执行
-         */
-        if(timeout)
+        return n;
+    }
+    int fd;
+    for(fd = 0; fd < max_fds; fd++)
+    {
+        if(conn_live(fd))
         {
-            timer_handler();
-            timeout = false;
+            fds[n++] = fd;
         }
     }
+    return n;
+}
 
-    close(listenfd);
-    close(pipefd[0]);
-    close(pipefd[1]);
-    free(users);
-    users = NULL;
+/*
+ * 把连接的剩余超时时间、不完整输入和未发送的输出写入快照，返回快照的描述符。
+ * io_uring自身超时没有记录截止时间，这种情况下给每个连接一个完整的超时周期
+ */
+static int write_snapshot(const int *fds, int n)
+{
+    size_t size = sizeof(struct snapshot_header) + n * sizeof(struct snapshot_conn);
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        size += users[fds[i]].pending_len + users[fds[i]].out_bytes;
+    }
 
-    return 0;
+    void *base;
+    int memfd = snapshot_create(size, &base);
+    if(memfd < 0)
+    {
+        return -1;
+    }
+
+    struct snapshot_header *hdr = (struct snapshot_header *)base;
+    struct snapshot_conn *rec = (struct snapshot_conn *)(hdr + 1);
+    char *data = (char *)(rec + n);
+    time_t cur = now_sec();
+
+    hdr->magic = HANDOFF_MAGIC;
+    hdr->version = HANDOFF_VERSION;
+    hdr->count = n;
+    hdr->size = size;
+    for(i = 0; i < n; i++)
+    {
+        struct client_data *c = &users[fds[i]];
+        time_t remaining = idle_timeout;
+        time_t expire;
+        if(timer_get(timers, c->timer, &expire, NULL) == 0)
+        {
+            remaining = expire > cur ? expire - cur : 0;
+        }
+        rec[i].address = c->address;
+        rec[i].remaining = remaining;
+        rec[i].in_len = c->pending_len;
+        rec[i].out_len = c->out_bytes;
 
+        memcpy(data, c->pending, c->pending_len);
+        data += c->pending_len;
+        struct out_buf *b;
+        for(b = c->out_head; b; b = b->next)
+        {
+            memcpy(data, b->data + b->start, b->end - b->start);
+            data += b->end - b->start;
+        }
+    }
+    snapshot_close(base, size);
+    return memfd;
 }
 
-/* 测试双向链表 */
-/*void test()
+/*
+ * 等待交接用的socket可读或可写，deadline是单调时钟的纳秒数。闹钟等信号打断时
+ * 按剩余时间继续等待，超时返回-1
+ */
+static int wait_handoff(int sock, short events, long deadline)
 {
-    struct util_timer *timer1 = (struct util_timer *)malloc(sizeof(struct util_timer));
-    struct util_timer *timer2 = (struct util_timer *)malloc(sizeof(struct util_timer));
-    struct util_timer *timer3 = (struct util_timer *)malloc(sizeof(struct util_timer));
-    time_t cur = time( NULL );
-    
-    timer1->expire = cur + TIMESLOT;
-    timer2->expire = cur + 2 * TIMESLOT;
-    timer3->expire = cur +  3 * TIMESLOT;
-    add_timer(timer1);
-    add_timer(timer2);
-    add_timer(timer3);
+    struct pollfd pfd = { sock, events, 0 };
+    for(;;)
+    {
+        long left = deadline - mono_ns();
+        if(left <= 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        int r = poll(&pfd, 1, (int)((left + 999999) / 1000000));
+        if(r > 0)
+        {
+            return 0;
+        }
+        if(r < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+/*
+ * 以相同的参数执行新的可执行文件，交接用的描述符通过 -H 传递，参数中原有的
+ * -H（当前进程本身也是接管来的）被去掉。argv必须在fork之前准备好，
+ * 子进程中只调用异步信号安全的函数
+ */
+static char **successor_argv(char *fdarg)
+{
+    char **argv = (char **)malloc((saved_argc + 3) * sizeof(char *));
+    int i, k = 0;
+    argv[k++] = saved_argv[0];
+    argv[k++] = "-H";
+    argv[k++] = fdarg;
+    for(i = 1; i < saved_argc; i++)
+    {
+        if(strcmp(saved_argv[i], "-H") == 0)
+        {
+            i++;
+            continue;
+        }
+        if(strncmp(saved_argv[i], "-H", 2) == 0)
+        {
+            continue;
+        }
+        argv[k++] = saved_argv[i];
+    }
+    argv[k] = NULL;
+    return argv;
+}
+
+/*
+ * 热升级：启动新进程，把监听socket、快照以及所有连接的描述符交给它，并等待它
+ * 确认接管。成功返回0，之后当前进程不能再读写任何连接，直接退出；新进程启动
+ * 失败返回-1，当前进程继续服务
+ */
+static int hand_off(int listenfd)
+{
+    int *fds = (int *)malloc(max_fds * sizeof(int));
+    int n = collect_conns(fds);
+    int memfd = write_snapshot(fds, n);
+    int sv[2] = { -1, -1 };
+    pid_t pid = -1;
+    char ack = 0;
+    int i;
+
+    if(memfd < 0 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        LOG_ERROR("hot upgrade failed to prepare handoff: %s", strerror(errno));
+        goto fail;
+    }
+    /*
+     * 新进程卡住（挂起或者被SIGSTOP）时不能让事件循环一直阻塞在交接上：socket设为
+     * 非阻塞，每次收发之前等待，整个交接不超过HANDOFF_TIMEOUT秒
+     */
+    long deadline = mono_ns() + HANDOFF_TIMEOUT * 1000000000L;
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+    char fdarg[16];
+    snprintf(fdarg, sizeof(fdarg), "%d", sv[1]);
+    char **argv = successor_argv(fdarg);
+    pid = fork();
+    if(pid == 0)
+    {
+        /* 只有交接用的描述符需要保留到新的可执行文件中 */
+        fcntl(sv[1], F_SETFD, 0);
+        execv(exe_path, argv);
+        _exit(127);
+    }
+    free(argv);
+    close(sv[1]);
+    if(pid < 0)
+    {
+        LOG_ERROR("hot upgrade fork failure: %s", strerror(errno));
+        goto fail;
+    }
+
+    struct handoff_hello hello = { HANDOFF_MAGIC, HANDOFF_VERSION, (uint32_t)n };
+    int first[2] = { listenfd, memfd };
+    if(wait_handoff(sv[0], POLLOUT, deadline) < 0 ||
+       handoff_send(sv[0], first, 2, &hello, sizeof(hello)) < 0)
+    {
+        LOG_ERROR("hot upgrade failed to send listening socket: %s", strerror(errno));
+        goto fail;
+    }
+    for(i = 0; i < n; i += HANDOFF_FDS_MAX)
+    {
+        int cnt = n - i < HANDOFF_FDS_MAX ? n - i : HANDOFF_FDS_MAX;
+        if(wait_handoff(sv[0], POLLOUT, deadline) < 0 ||
+           handoff_send(sv[0], fds + i, cnt, "", 1) < 0)
+        {
+            LOG_ERROR("hot upgrade failed to send connections: %s", strerror(errno));
+            goto fail;
+        }
+    }
+    int r = -1;
+    if(wait_handoff(sv[0], POLLIN, deadline) == 0)
+    {
+        r = recv(sv[0], &ack, 1, 0);
+    }
+    if(r != 1 || ack != HANDOFF_ACK)
+    {
+        if(r < 0 && errno == ETIMEDOUT)
+        {
+            LOG_ERROR("hot upgrade: successor %d did not answer within %d seconds", pid, HANDOFF_TIMEOUT);
+        }
+        else
+        {
+            LOG_ERROR("hot upgrade: successor %d did not take over", pid);
+        }
+        goto fail;
+    }
+
+    LOG_INFO("handed off %d connections to pid %d", n, pid);
+    close(sv[0]);
+    close(memfd);
+    free(fds);
+    return 0;
+
+fail:
+    if(pid > 0)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    if(sv[0] >= 0)
+    {
+        close(sv[0]);
+    }
+    if(memfd >= 0)
+    {
+        close(memfd);
+    }
+    free(fds);
+    return -1;
+}
+
+/*
+ * 新进程：从旧进程接过监听socket和所有连接，恢复连接的暂存数据和输出队列，
+ * 按快照中的剩余时间一次性建立定时器链表，返回监听socket
+ */
+static int take_over(int sock)
+{
+    struct handoff_hello hello;
+    int first[2];
+    int listenfd = -1;
+    int *fds = NULL;
+    struct timer_spec *specs = NULL;
+    timer_id *ids = NULL;
+    char *base = NULL;
+    size_t size = 0;
+    int i, got = 0, done = 0;
+
+    if(handoff_recv(sock, first, 2, &hello, sizeof(hello)) != 2 ||
+       hello.magic != HANDOFF_MAGIC || hello.version != HANDOFF_VERSION)
+    {
+        LOG_ERROR("invalid handoff from the previous process");
+        return -1;
+    }
+    listenfd = first[0];
+    base = (char *)snapshot_open(first[1], &size);
+    close(first[1]);
+
+    struct snapshot_header *hdr = (struct snapshot_header *)base;
+    int n = hello.count;
+    if(!base || hdr->magic != HANDOFF_MAGIC || hdr->count != hello.count || hdr->size != size ||
+       size < sizeof(*hdr) + (size_t)n * sizeof(struct snapshot_conn))
+    {
+        LOG_ERROR("invalid timer snapshot from the previous process");
+        goto fail;
+    }
+
+    fds = (int *)malloc((n + 1) * sizeof(int));
+    specs = (struct timer_spec *)malloc((n + 1) * sizeof(struct timer_spec));
+    ids = (timer_id *)malloc((n + 1) * sizeof(timer_id));
+    adopted = (int *)malloc((n + 1) * sizeof(int));
+    if(!fds || !specs || !ids || !adopted)
+    {
+        LOG_ERROR("no memory to take over %d connections", n);
+        goto fail;
+    }
+    while(got < n)
+    {
+        char byte;
+        int r = handoff_recv(sock, fds + got, n - got, &byte, 1);
+        if(r < 0)
+        {
+            LOG_ERROR("failed to receive connections from the previous process");
+            goto fail;
+        }
+        got += r;
+    }
+
+    struct snapshot_conn *rec = (struct snapshot_conn *)(hdr + 1);
+    const char *data = (const char *)(rec + n);
+    const char *end = base + size;
+    time_t cur = now_sec();
+    int ntimers = 0;
+    for(i = 0; i < n; i++)
+    {
+        /* fds中前done个描述符已经关闭或者接管 */
+        done = i;
+        const char *in = data;
+        const char *out = in + rec[i].in_len;
+        data = out + rec[i].out_len;
+        if(data > end || rec[i].in_len > PENDING_MAX)
+        {
+            LOG_ERROR("truncated timer snapshot");
+            goto fail;
+        }
+        if(fds[i] >= max_fds)
+        {
+            close(fds[i]);
+            continue;
+        }
+
+        struct client_data *c = init_conn(fds[i], &rec[i].address);
+        if(conn_restore(c, in, rec[i].in_len, out, rec[i].out_len) < 0)
+        {
+            conn_release(c);
+            close(fds[i]);
+            c->sockfd = -1;
+            live_conns--;
+            continue;
+        }
+        /* 快照中的记录按剩余时间升序排列，整批插入即可，不需要逐个查找位置 */
+        if(!native_timeout)
+        {
+            specs[ntimers].expire = cur + rec[i].remaining;
+            specs[ntimers].slack = conn_slack;
+            specs[ntimers].cb = cb_func;
+            specs[ntimers].arg = c;
+            ntimers++;
+        }
+        adopted[nadopted++] = fds[i];
+    }
+    add_conn_timers(specs, ids, ntimers);
+
+    char ack = HANDOFF_ACK;
+    send(sock, &ack, 1, MSG_NOSIGNAL);
+    LOG_INFO("took over %d connections from the previous process", nadopted);
+    snapshot_close(base, size);
+    close(sock);
+    free(specs);
+    free(ids);
+    free(fds);
+    return listenfd;
+
+fail:
+    /* 已经接管的连接释放状态后关闭，其余收到的描述符直接关闭 */
+    for(i = 0; i < nadopted; i++)
+    {
+        struct client_data *c = &users[adopted[i]];
+        conn_release(c);
+        close(c->sockfd);
+        c->sockfd = -1;
+        live_conns--;
+    }
+    for(i = done; i < got; i++)
+    {
+        close(fds[i]);
+    }
+    free(adopted);
+    adopted = NULL;
+    nadopted = 0;
+    if(base)
+    {
+        snapshot_close(base, size);
+    }
+    close(listenfd);
+    close(sock);
+    free(specs);
+    free(ids);
+    free(fds);
+    return -1;
+}
+
+/* 新进程：把接过来的连接注册到事件循环中，并继续发送旧进程没有发完的输出 */
+static void start_adopted()
+{
+    int i;
+    for(i = 0; i < nadopted; i++)
+    {
+        struct client_data *c = &users[adopted[i]];
+        if(backend == BACKEND_EPOLL)
+        {
+            /* 注册时socket中已有的数据也会产生一次边缘事件 */
+            add_fd(epollfd, c->sockfd, false);
+        }
+        if(c->out_bytes >= OUT_HIGH_WATER)
+        {
+            c->read_blocked = true;
+        }
+        else if(backend == BACKEND_URING)
+        {
+            uring_arm_recv(c);
+        }
+        if(c->out_head)
+        {
+            write_conn(c);
+        }
+    }
+    free(adopted);
+    adopted = NULL;
+    nadopted = 0;
+}
+
+/* 处理信号管道中读出的信号 */
+static void handle_signals(const char *signals, int n)
+{
+    int i;
+    for(i = 0; i < n; ++i )
+    {
+        switch( signals[i] )
+        {
+            case SIGALRM:
+            {
+                /*
+                 * 收到SIGALRM时，将timeout用来标记有定时任务需要处理，但不立即处理定时任务
+                 * 因为定时任务的优先级不是很高，我们优先处理其他更重要的任务
+                 * */
+                timeout = true;
+                break;
+            }
+            case SIGTERM:
+            {
+                stop_server = true;
+                break;
+            }
+            case SIGUSR2:
+            {
+                upgrade = true;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * 无周期滴答模式下把闹钟定在最早的定时器到期时，定时器链表为空时取消闹钟。
+ * 最早的超时值没有变化时不需要重新设置，连接的定时器带有slack时很多连接
+ * 共享同一个超时值，闹钟的设置次数和唤醒次数都会减少
+ */
+static void arm_alarm()
+{
+    time_t expire = 0;
+    timer_earliest(timers, &expire);
+    if(expire == alarm_at)
+    {
+        return;
+    }
+    alarm_at = expire;
+    if(expire == 0)
+    {
+        alarm(0);
+        return;
+    }
+    time_t cur = now_sec();
+    alarm(expire > cur ? expire - cur : 1);
+}
+
+/* 处理定时任务 */
+void timer_handler()
+{
+    LOG_DEBUG("time is out");
+    /* 定时处理任务 */
+    timer_stats.wakeups++;
+    timer_stats.expired += timer_tick(timers, now_sec());
+
+    /*
+     * 一次alarm调用只会引起一次SIGALRM信号
+     * 所以我们要重新定时，以不断触发SIGALRM信号，
+     * io_uring后端使用自己的超时请求，不需要alarm
+     */
+    if(backend == BACKEND_EPOLL && busy_poll_us == 0)
+    {
+        if(tickless)
+        {
+            alarm_at = 0;
+            arm_alarm();
+        }
+        else
+        {
+            alarm( TIMESLOT );
+        }
+    }
+}
+
+/* 进程的常驻内存字节数，读取失败时返回0 */
+static long read_rss()
+{
+    char buf[128];
+    long size = 0, resident = 0;
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0)
+    {
+        return 0;
+    }
+    buf[n] = '\0';
+    if(sscanf(buf, "%ld %ld", &size, &resident) != 2)
+    {
+        return 0;
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* 从定时器链表头部开始关闭n个最接近超时的连接，返回实际关闭的连接数 */
+static int shed_conns(int n)
+{
+    int k = 0;
+    timer_id t;
+    while(k < n && (t = timer_first(timers)) != TIMER_INVALID)
+    {
+        void *arg;
+        timer_get(timers, t, NULL, &arg);
+        close_conn((struct client_data *)arg);
+        k++;
+    }
+    overload_stats.evicted += k;
+    return k;
+}
+
+/*
+ * 每轮事件循环结束时检查是否过载。连接数超过上限时关闭的连接数使连接数回到
+ * 上限的7/8；RSS每秒最多采样一次，只在新的采样超过上限时关闭连接，因为释放的内存
+ * 不一定马上还给系统，RSS的回落比连接数慢
+ */
+static void check_overload()
+{
+    if(native_timeout || (conn_high <= 0 && rss_high <= 0))
+    {
+        fd_exhausted = false;
+        return;
+    }
+    time_t cur = time(NULL);
+    bool sampled = false;
+    if(cur != rss_sampled)
+    {
+        rss_now = read_rss();
+        rss_sampled = cur;
+        sampled = true;
+    }
+
+    bool conn_over = conn_high > 0 && live_conns >= conn_high;
+    bool rss_over = rss_high > 0 && rss_now >= rss_high;
+    if(conn_over || fd_exhausted || (rss_over && sampled))
+    {
+        int n = shed_min;
+        if(conn_over && live_conns - conn_high / 8 * 7 > n)
+        {
+            n = live_conns - conn_high / 8 * 7;
+        }
+        n = shed_conns(n);
+        overload_stats.sheds++;
+        fd_exhausted = false;
+        /* 过载期间每秒最多把空闲超时减半一次 */
+        if(idle_timeout > IDLE_TIMEOUT_MIN && cur != idle_adjusted)
+        {
+            idle_timeout = idle_timeout / 2 > IDLE_TIMEOUT_MIN ? idle_timeout / 2 : IDLE_TIMEOUT_MIN;
+            idle_adjusted = cur;
+        }
+        if(overload_stats.min_timeout == 0 || idle_timeout < overload_stats.min_timeout)
+        {
+            overload_stats.min_timeout = idle_timeout;
+        }
+        LOG_WARN("overload: %d connections, rss %ld KB, closed %d idle connections, idle timeout %lds",
+                 live_conns, rss_now / 1024, n, (long)idle_timeout);
+        return;
+    }
+
+    bool conn_low = conn_high <= 0 || live_conns < conn_high / 8 * 7;
+    bool rss_low = rss_high <= 0 || rss_now < rss_high / 8 * 7;
+    if(idle_timeout < IDLE_TIMEOUT && conn_low && rss_low && cur - idle_adjusted >= TIMESLOT)
+    {
+        idle_timeout = idle_timeout * 2 < IDLE_TIMEOUT ? idle_timeout * 2 : IDLE_TIMEOUT;
+        idle_adjusted = cur;
+        LOG_INFO("load receded: %d connections, idle timeout %lds", live_conns, (long)idle_timeout);
+    }
+}
+
+/* 统一事件源，创建信号管道，以及添加信号处理函数 */
+static int set_sig_pipe()
+{
+    int ret;
+    /* 创建信号管道 */
+    ret = socketpair(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pipefd);
+    if(ret == -1)
+    {
+        perror("create socketpair failed \n");
+        return -1;
+    }
+
+    set_nonblocking(pipefd[1]);  /* 将写端设置为非阻塞 */
+
+    /* 添加信号处理 */
+    add_sig(SIGALRM, sig_handler, true);
+    add_sig(SIGTERM, sig_handler, true);
+    add_sig(SIGUSR2, sig_handler, true);
+    return 0;
+}
+
+/* 本轮放入的就绪连接在下一轮循环中读取 */
+static void swap_ready()
+{
+    int *tmp = ready;
+    ready = ready_next;
+    ready_next = tmp;
+    nready = nnext;
+}
+
+/* 忙轮询模式下阻塞等待的毫秒数：阻塞到最早的定时器到期，没有定时器时一直阻塞 */
+static int busy_block_ms()
+{
+    time_t expire;
+    if(timer_earliest(timers, &expire) < 0)
+    {
+        return -1;
+    }
+    long ms = (long)expire * 1000 - mono_ns() / 1000000;
+    if(ms <= 0)
+    {
+        return 0;
+    }
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/* 忙轮询模式下每轮循环检查定时器，代替闹钟信号 */
+static void busy_check_timers()
+{
+    time_t expire;
+    if(timer_earliest(timers, &expire) == 0 && now_sec() >= expire)
+    {
+        timeout = true;
+    }
+}
+
+/* 让内核在epoll_wait中忙轮询网卡队列，内核或网卡不支持时忽略 */
+static void busy_poll_epoll(int fd)
+{
+    struct epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = busy_poll_us;
+    params.busy_poll_budget = 8;
+    params.prefer_busy_poll = 1;
+    if(ioctl(fd, EPIOCSPARAMS, &params) < 0)
+    {
+        LOG_INFO("epoll busy poll not available: %s", strerror(errno));
+    }
+}
+
+/* 基于epoll的事件循环 */
+static int run_epoll(int listenfd)
+{
+    int ret = 0;
+    struct epoll_event events[MAX_EVENT_NUMBER];
+    int i, j, number;
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollfd == -1)
+    {
+        perror("create epoll failed \n");
+        return -1;
+    }
+    add_fd(epollfd, listenfd, false);
+    /* 统一事件源，将信号和IO处理一起处理，管道读端添加到epoll事件集中进行监听 */
+    add_fd(epollfd, pipefd[0], true);
+
+    ready = (int *)malloc(max_fds * sizeof(int));
+    ready_next = (int *)malloc(max_fds * sizeof(int));
+    nnext = 0;
+    /* 热升级接过来的连接，恢复读取时放入就绪队列的连接在第一轮循环中读取 */
+    start_adopted();
+    swap_ready();
+    /* 上一轮达到accept上限，监听队列中可能还有连接 */
+    bool accept_more = false;
+    /* 忙轮询模式下最近一次有事件的时间 */
+    long last_work = mono_ns();
+    /* 定时器 */
+    if(busy_poll_us > 0)
+    {
+        busy_poll_epoll(epollfd);
+    }
+    else if(tickless)
+    {
+        arm_alarm();
+    }
+    else
+    {
+        alarm(TIMESLOT);
+    }
+
+    while(!stop_server)
+    {
+        //获取就绪的文件描述符个数，就绪队列不为空或者还有待accept的连接时不能阻塞
+        int wait_ms = (nready > 0 || accept_more) ? 0 : -1;
+        bool spinning = false;
+        long before = 0;
+        if(busy_poll_us > 0 && wait_ms < 0)
+        {
+            before = mono_ns();
+            spinning = (before - last_work < busy_poll_us * 1000);
+            wait_ms = spinning ? 0 : busy_block_ms();
+        }
+        number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, wait_ms);
+        if ( ( number < 0 ) && ( errno != EINTR ) )
+        {
+            LOG_ERROR( "epoll failure: %s", strerror(errno) );
+            break;
+        }
+        if(busy_poll_us > 0)
+        {
+            long after = mono_ns();
+            if(spinning && number <= 0)
+            {
+                busy_stats.empty_polls++;
+                busy_stats.spin_ns += after - before;
+            }
+            else
+            {
+                if(spinning)
+                {
+                    busy_stats.spin_hits++;
+                }
+                else if(wait_ms != 0)
+                {
+                    busy_stats.sleeps++;
+                }
+                last_work = after;
+            }
+            busy_check_timers();
+        }
+
+        /*
+         * 先继续读取上一轮因达到读取上限而没有读完的连接，仍未读完的留在就绪队列中，
+         * 已关闭的连接in_ready被清除，直接丢弃
+         */
+        nnext = 0;
+        for(j = 0; j < nready; j++)
+        {
+            struct client_data *c = &users[ready[j]];
+            if(c->in_ready)
+            {
+                c->in_ready = false;
+                read_conn(c);
+            }
+        }
+        if(accept_more)
+        {
+            accept_more = accept_batch(listenfd);
+        }
+
+        for(i = 0; i < number; i++)
+        {
+            int sockfd = events[i].data.fd;
+            /* 处理新的客户连接 */
+            if(sockfd == listenfd)
+            {
+                accept_more = accept_batch(listenfd);
+            }
+            /* 处理信号 */
+            else if( ( sockfd == pipefd[0] ) && ( events[i].events & EPOLLIN ) )
+            {
+                char signals[1024];
+                ret = recv( pipefd[0], signals, sizeof(signals), 0);
+                if( ret == -1 )
+                {
+                    /* 可以在这里添加错误处理 */
+                    continue;
+                }
+                else if( ret == 0 )
+                {
+                    continue;
+                }
+                else
+                {
+                    handle_signals(signals, ret);
+                }
+            }
+            /* 处理客户连接上的事件 */
+            else
+            {
+                struct client_data *c = &users[sockfd];
+                unsigned ev = events[i].events;
+                /* 连接可能已经在本轮的处理中被关闭 */
+                if(c->sockfd != sockfd)
+                {
+                    continue;
+                }
+                /* 零拷贝的完成通知通过错误队列到达 */
+                if((ev & EPOLLERR) && c->zc_head)
+                {
+                    conn_reap_zerocopy(c);
+                }
+                if((ev & EPOLLOUT) && c->want_out && !write_conn(c))
+                {
+                    continue;
+                }
+                /* 已在就绪队列中的连接在处理就绪队列时已经读过了，暂停读取的连接等输出降下来再读 */
+                if((ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->in_ready && !c->read_blocked)
+                {
+                    read_conn(c);
+                }
+            }
+        }
+        swap_ready();
+        check_overload();
+
+        /* 最后处理定时事件，因为I/O事件拥有更高的优先级
+         * 当然，这样做将导致定时任务不能精确的按照预期执行
+         */
+        if(timeout)
+        {
+            timer_handler();
+            timeout = false;
+        }
+        /* 本轮新建或调整的定时器可能比闹钟更早到期 */
+        if(tickless && busy_poll_us == 0)
+        {
+            arm_alarm();
+        }
+
+        if(upgrade)
+        {
+            upgrade = false;
+            stop_server = (hand_off(listenfd) == 0);
+        }
+    }
+
+    free(ready);
+    free(ready_next);
+    ready = ready_next = NULL;
+    close(epollfd);
+    epollfd = -1;
+    return 0;
+}
+
+/*
+ * io_uring请求的user_data：高8位为请求类型，低32位为文件描述符，
+ * 中间24位为连接的代数，用来识别连接关闭后才到达的旧请求的完成事件
+ */
+#define UD_ACCEPT       1ULL
+#define UD_RECV         2ULL
+#define UD_LINK_TIMEOUT 3ULL
+#define UD_TICK         4ULL
+#define UD_SIGNAL       5ULL
+#define UD_POLLOUT      6ULL
+#define UD_CANCEL       7ULL
+#define UD_QUIESCE      8ULL
+
+#define UD_MAKE(type, gen, fd)  (((type) << 56) | (((unsigned long long)(gen) & 0xffffff) << 32) | (unsigned)(fd))
+#define UD_TYPE(ud)             ((ud) >> 56)
+#define UD_GEN(ud)              ((unsigned)(((ud) >> 32) & 0xffffff))
+#define UD_FD(ud)               ((int)((ud) & 0xffffffff))
+
+#define URING_ENTRIES       1024        /* 提交队列长度 */
+#define URING_BUF_COUNT     4096        /* 缓冲区环中的缓冲区数目，必须是2的幂 */
+#define URING_BUF_SIZE      4096        /* 每个缓冲区的大小 */
+#define URING_BGID          0
+
+static struct uring ring;
+static struct uring_buf_ring bufs;
+static struct __kernel_timespec tick_ts = { TIMESLOT, 0 };
+static struct __kernel_timespec idle_ts = { IDLE_TIMEOUT, 0 };
+static bool tick_multishot = true;
+static char uring_signals[1024];
+
+/*
+ * 获取sqe。提交队列满时uring_get_sqe把请求放进积压数组，留到之后的循环提交，
+ * 只有内存不足时失败，这时记录错误并停止服务器
+ */
+static struct io_uring_sqe *uring_sqe()
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if(!sqe)
+    {
+        LOG_ERROR("no memory for io_uring submissions, stopping server");
+        stop_server = true;
+    }
+    return sqe;
+}
+
+static void uring_arm_accept(int listenfd)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if(!sqe)
+    {
+        return;
+    }
+    uring_prep_accept_multishot(sqe, listenfd, UD_MAKE(UD_ACCEPT, 0, listenfd));
+}
+
+/*
+ * 为连接提交recv。使用定时器链表时是多次触发的recv；使用io_uring自身超时时，
+ * 每次是一个单次recv加上关联的超时，超时前没有收到数据则recv被取消，连接被关闭
+ */
+static void uring_arm_recv(struct client_data *c)
+{
+    /* recv和关联的超时必须在同一次提交中 */
+    uring_reserve(&ring, native_timeout ? 2 : 1);
+    struct io_uring_sqe *sqe = uring_sqe();
+    if(!sqe)
+    {
+        return;
+    }
+    c->recv_armed = true;
+    c->recv_cancelled = false;
+    c->recv_armed_at = now_sec();
+    unsigned long long ud = UD_MAKE(UD_RECV, c->gen, c->sockfd);
+    uring_prep_recv_select(sqe, c->sockfd, URING_BGID, !native_timeout, ud);
+    if(native_timeout)
+    {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = uring_sqe();
+        if(!sqe)
+        {
+            return;
+        }
+        /* 内核在提交时复制超时值，之后idle_timeout变化不影响已提交的请求 */
+        idle_ts.tv_sec = idle_timeout;
+        uring_prep_link_timeout(sqe, &idle_ts, UD_MAKE(UD_LINK_TIMEOUT, c->gen, c->sockfd));
+    }
+}
+
+/* 等待连接可写，以继续发送输出队列 */
+static void uring_arm_pollout(struct client_data *c)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if(!sqe)
+    {
+        return;
+    }
+    uring_prep_poll_add(sqe, c->sockfd, POLLOUT, UD_MAKE(UD_POLLOUT, c->gen, c->sockfd));
+}
+
+/* 取消连接上的多次触发recv，用于暂停读取 */
+static void uring_cancel_recv(struct client_data *c)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if(!sqe)
+    {
+        return;
+    }
+    uring_prep_cancel(sqe, UD_MAKE(UD_RECV, c->gen, c->sockfd), UD_MAKE(UD_CANCEL, c->gen, c->sockfd));
+    c->recv_cancelled = true;
+}
+
+/*
+ * -T模式下写出数据时重置空闲超时。关联的超时只能和recv一起提交，所以取消当前的
+ * recv，完成事件按暂停读取时的取消处理，重新提交recv和新的超时。同一秒内提交
+ * 的recv不再重置，每个连接每秒最多多一次取消和提交
+ */
+static void uring_refresh_idle(struct client_data *c)
+{
+    if(!c->recv_armed || c->recv_cancelled || c->read_blocked)
+    {
+        return;
+    }
+    if(now_sec() == c->recv_armed_at)
+    {
+        return;
+    }
+    uring_cancel_recv(c);
+}
+
+/* 完成事件对应的连接，连接已经关闭（或者fd已被新连接复用）时返回NULL */
+static struct client_data *uring_conn(struct io_uring_cqe *cqe)
+{
+    int fd = UD_FD(cqe->user_data);
+    struct client_data *c = &users[fd];
+    if(c->sockfd != fd || (c->gen & 0xffffff) != UD_GEN(cqe->user_data))
+    {
+        return NULL;
+    }
+    return c;
+}
+
+static void uring_arm_tick()
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if(!sqe)
+    {
+        return;
+    }
+    uring_prep_timeout(sqe, &tick_ts, tick_multishot ? IORING_TIMEOUT_MULTISHOT : 0,
+                       UD_MAKE(UD_TICK, 0, 0));
+}
+
+static void uring_arm_signal()
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if(!sqe)
+    {
+        return;
+    }
+    uring_prep_recv(sqe, pipefd[0], uring_signals, sizeof(uring_signals), UD_MAKE(UD_SIGNAL, 0, 0));
+}
+
+/* 为本轮accept到的连接批量创建定时器并提交recv */
+static void uring_flush_accepted()
+{
+    int i;
+    arm_accepted_timers();
+    for(i = 0; i < naccepted; i++)
+    {
+        uring_arm_recv(&users[accepted[i]]);
+    }
+    naccepted = 0;
+}
+
+/* 处理recv的完成事件 */
+static void uring_handle_recv(struct io_uring_cqe *cqe)
+{
+    struct client_data *c = uring_conn(cqe);
+    char *data = NULL;
+    unsigned short bid = 0;
+
+    if(cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        data = uring_buf_get(&bufs, bid);
+    }
+
+    /* 连接已经关闭，只需要归还缓冲区 */
+    if(!c)
+    {
+        if(data)
+        {
+            uring_buf_recycle(&bufs, bid);
+        }
+        return;
+    }
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        c->recv_armed = false;
+    }
+
+    if(cqe->res > 0 && data)
+    {
+        enum conn_state state;
+        conn_stats.recv_calls++;
+        conn_feed(c, data, cqe->res, handle_data, &state);
+        uring_buf_recycle(&bufs, bid);
+        if(state == CONN_CLOSED)
+        {
+            close_conn(c);
+            return;
+        }
+        conn_active(c);
+        if(c->out_head && !c->want_out && !write_conn(c))
+        {
+            return;
+        }
+        /* 输出积压超过高水位，取消recv暂停读取，等输出降下来再重新提交 */
+        if(c->out_bytes >= OUT_HIGH_WATER)
+        {
+            c->read_blocked = true;
+            if(c->recv_armed && !c->recv_cancelled)
+            {
+                uring_cancel_recv(c);
+            }
+            return;
+        }
+        /* 多次触发的recv仍然有效时不需要重新提交 */
+        if(!c->recv_armed)
+        {
+            uring_arm_recv(c);
+        }
+        return;
+    }
+
+    /* 缓冲区环暂时耗尽，重新提交即可 */
+    if(cqe->res == -ENOBUFS)
+    {
+        if(!c->recv_armed && !c->read_blocked)
+        {
+            uring_arm_recv(c);
+        }
+        return;
+    }
+
+    /* 为了暂停读取而取消的recv */
+    if(cqe->res == -ECANCELED && c->recv_cancelled)
+    {
+        c->recv_cancelled = false;
+        if(!c->read_blocked && !c->recv_armed)
+        {
+            uring_arm_recv(c);
+        }
+        return;
+    }
+
+    /* 对端关闭、出错或者关联的超时到期（-ECANCELED） */
+    if(cqe->res == -ECANCELED)
+    {
+        LOG_DEBUG("fd %d idle timeout", c->sockfd);
+    }
+    close_conn(c);
+}
+
+/* 处理可写的完成事件 */
+static void uring_handle_pollout(struct io_uring_cqe *cqe)
+{
+    struct client_data *c = uring_conn(cqe);
+    if(!c)
+    {
+        return;
+    }
+    c->want_out = false;
+    write_conn(c);
+}
+
+/*
+ * 热升级前取消io_uring中的所有请求，之后内核不会再从socket中读走数据。取消之前
+ * 已经读到的数据照常处理，已经accept到的连接照常记录，一起交给新进程
+ */
+static int uring_quiesce()
+{
+    bool done = false;
+    struct io_uring_sqe *sqe = uring_sqe();
+    if(!sqe)
+    {
+        return -1;
+    }
+    uring_prep_cancel_all(sqe, UD_MAKE(UD_QUIESCE, 0, 0));
+
+    while(!done)
+    {
+        int ret = uring_submit_and_wait(&ring, 1);
+        if(ret < 0 && ret != -EINTR && ret != -EBUSY)
+        {
+            LOG_ERROR("io_uring_enter failure: %s", strerror(-ret));
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek_cqe(&ring)) != NULL)
+        {
+            switch(UD_TYPE(cqe->user_data))
+            {
+                case UD_QUIESCE:
+                {
+                    done = true;
+                    if(cqe->res < 0)
+                    {
+                        LOG_WARN("failed to cancel io_uring requests: %s", strerror(-cqe->res));
+                    }
+                    break;
+                }
+                case UD_ACCEPT:
+                {
+                    if(cqe->res >= 0)
+                    {
+                        new_conn(cqe->res, NULL);
+                    }
+                    break;
+                }
+                case UD_RECV:
+                {
+                    struct client_data *c = uring_conn(cqe);
+                    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    if(c && !(cqe->flags & IORING_CQE_F_MORE))
+                    {
+                        c->recv_armed = false;
+                    }
+                    if(c && cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+                    {
+                        enum conn_state state;
+                        conn_stats.recv_calls++;
+                        conn_feed(c, uring_buf_get(&bufs, bid), cqe->res, handle_data, &state);
+                        if(state == CONN_CLOSED)
+                        {
+                            close_conn(c);
+                        }
+                    }
+                    else if(c && cqe->res == 0)
+                    {
+                        close_conn(c);
+                    }
+                    if(cqe->flags & IORING_CQE_F_BUFFER)
+                    {
+                        uring_buf_recycle(&bufs, bid);
+                    }
+                    break;
+                }
+                default:
+                {
+                    /* 被取消的其他请求不需要处理 */
+                    break;
+                }
+            }
+            uring_cqe_seen(&ring);
+        }
+    }
+    arm_accepted_timers();
+    naccepted = 0;
+    return 0;
+}
+
+/* 热升级失败，重新提交被取消的请求，继续服务 */
+static void uring_resume(int listenfd)
+{
+    int fd;
+    uring_arm_accept(listenfd);
+    uring_arm_signal();
+    if(!native_timeout)
+    {
+        uring_arm_tick();
+    }
+    for(fd = 0; fd < max_fds; fd++)
+    {
+        if(!conn_live(fd))
+        {
+            continue;
+        }
+        struct client_data *c = &users[fd];
+        c->recv_armed = false;
+        c->recv_cancelled = false;
+        c->want_out = false;
+        if(!c->read_blocked)
+        {
+            uring_arm_recv(c);
+        }
+        if(c->out_head)
+        {
+            want_write(c, true);
+        }
+    }
+}
+
+/* 基于io_uring的事件循环，io_uring不可用时返回-1，由调用者退回到epoll */
+static int run_uring(int listenfd)
+{
+    int ret = uring_init(&ring, URING_ENTRIES);
+    if(ret < 0)
+    {
+        LOG_WARN("io_uring unavailable (%s), falling back to epoll", strerror(-ret));
+        return -1;
+    }
+    ret = uring_buf_ring_init(&ring, &bufs, URING_BGID, URING_BUF_COUNT, URING_BUF_SIZE);
+    if(ret < 0)
+    {
+        LOG_WARN("io_uring buffer ring unavailable (%s), falling back to epoll", strerror(-ret));
+        uring_exit(&ring);
+        return -1;
+    }
+    LOG_INFO("using io_uring backend, %s idle timeouts", native_timeout ? "native" : "timer list");
+
+    uring_arm_accept(listenfd);
+    uring_arm_signal();
+    if(!native_timeout)
+    {
+        uring_arm_tick();
+    }
+    start_adopted();
+
+    while(!stop_server)
+    {
+        /* 一次系统调用既提交上一轮产生的所有请求，又等待新的完成事件 */
+        ret = uring_submit_and_wait(&ring, 1);
+        if(ret < 0 && ret != -EINTR && ret != -EBUSY)
+        {
+            LOG_ERROR("io_uring_enter failure: %s", strerror(-ret));
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek_cqe(&ring)) != NULL)
+        {
+            switch(UD_TYPE(cqe->user_data))
+            {
+                case UD_ACCEPT:
+                {
+                    if(cqe->res >= 0)
+                    {
+                        new_conn(cqe->res, NULL);
+                        if(naccepted == accept_cap)
+                        {
+                            uring_flush_accepted();
+                        }
+                    }
+                    else if(cqe->res == -EMFILE || cqe->res == -ENFILE)
+                    {
+                        /* 描述符耗尽，把排队的连接逐个接受并关闭 */
+                        int k = 0;
+                        fd_exhausted = true;
+                        overload_stats.fd_exhausted++;
+                        while(k < accept_cap && accept_with_reserve(listenfd))
+                        {
+                            k++;
+                        }
+                        LOG_WARN("out of file descriptors, dropped %d pending connections", k);
+                    }
+                    else
+                    {
+                        LOG_WARN("accept failure: %s", strerror(-cqe->res));
+                    }
+                    if(!(cqe->flags & IORING_CQE_F_MORE))
+                    {
+                        uring_arm_accept(listenfd);
+                    }
+                    break;
+                }
+                case UD_RECV:
+                {
+                    uring_handle_recv(cqe);
+                    break;
+                }
+                case UD_POLLOUT:
+                {
+                    uring_handle_pollout(cqe);
+                    break;
+                }
+                case UD_TICK:
+                {
+                    /* 内核不支持多次触发的超时则改为每次重新提交 */
+                    if(cqe->res == -EINVAL && tick_multishot)
+                    {
+                        tick_multishot = false;
+                        uring_arm_tick();
+                        break;
+                    }
+                    timeout = true;
+                    if(!(cqe->flags & IORING_CQE_F_MORE))
+                    {
+                        uring_arm_tick();
+                    }
+                    break;
+                }
+                case UD_SIGNAL:
+                {
+                    if(cqe->res > 0)
+                    {
+                        handle_signals(uring_signals, cqe->res);
+                    }
+                    uring_arm_signal();
+                    break;
+                }
+                default:
+                {
+                    /* 关联超时和取消请求的完成事件不需要处理 */
+                    break;
+                }
+            }
+            uring_cqe_seen(&ring);
+        }
+        uring_flush_accepted();
+        check_overload();
+
+        if(timeout)
+        {
+            timer_handler();
+            timeout = false;
+        }
+
+        if(upgrade)
+        {
+            upgrade = false;
+            if(uring_quiesce() == 0)
+            {
+                stop_server = (hand_off(listenfd) == 0);
+                if(!stop_server)
+                {
+                    uring_resume(listenfd);
+                }
+            }
+        }
+    }
+
+    LOG_INFO("io_uring stats: %lu io_uring_enter calls, %lu completions",
+             ring.enter_calls, ring.cqe_count);
+    uring_buf_ring_exit(&ring, &bufs);
+    uring_exit(&ring);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    log_init(STDOUT_FILENO);
+
+    /* 热升级时以相同的参数启动新进程，getopt会调整argv的顺序，先保存一份 */
+    saved_argc = argc;
+    saved_argv = (char **)malloc((argc + 1) * sizeof(char *));
+    memcpy(saved_argv, argv, (argc + 1) * sizeof(char *));
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if(len > 0)
+    {
+        exe_path[len] = '\0';
+    }
+    else
+    {
+        snprintf(exe_path, sizeof(exe_path), "%s", argv[0]);
+    }
+
+    int opt;
+    while((opt = getopt(argc, argv, "r:B:Tb:a:ezs:LOc:m:n:y:C:H:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'r':
+            {
+                read_cap = atoi(optarg);
+                break;
+            }
+            case 'B':
+            {
+                if(strcmp(optarg, "uring") == 0)
+                {
+                    backend = BACKEND_URING;
+                }
+                else if(strcmp(optarg, "epoll") != 0)
+                {
+                    argc = 0;
+                }
+                break;
+            }
+            case 'T':
+            {
+                native_timeout = true;
+                break;
+            }
+            case 'b':
+            {
+                listen_backlog = atoi(optarg);
+                break;
+            }
+            case 'a':
+            {
+                accept_cap = atoi(optarg);
+                break;
+            }
+            case 'e':
+            {
+                echo_mode = true;
+                break;
+            }
+            case 'z':
+            {
+                zerocopy = true;
+                break;
+            }
+            case 's':
+            {
+                conn_slack = atoi(optarg);
+                break;
+            }
+            case 'L':
+            {
+                tickless = true;
+                break;
+            }
+            case 'O':
+            {
+                conn_high = -1;
+                break;
+            }
+            case 'c':
+            {
+                conn_high = atoi(optarg);
+                break;
+            }
+            case 'm':
+            {
+                rss_high = atol(optarg) * 1024 * 1024;
+                break;
+            }
+            case 'n':
+            {
+                shed_min = atoi(optarg);
+                break;
+            }
+            case 'y':
+            {
+                busy_poll_us = atol(optarg);
+                break;
+            }
+            case 'C':
+            {
+                pin_cpu = atoi(optarg);
+                break;
+            }
+            case 'H':
+            {
+                handoff_fd = atoi(optarg);
+                break;
+            }
+            default:
+            {
+                argc = 0;
+            }
+        }
+    }
+    if( argc - optind < 2 || read_cap <= 0 || listen_backlog <= 0 || accept_cap <= 0 || conn_slack < 0 || shed_min <= 0 || rss_high < 0 || busy_poll_us < 0 )
+    {
+        LOG_ERROR( "usage: %s [-r read_cap_bytes] [-B epoll|uring] [-T] [-b backlog] [-a accept_cap]"
+                   " [-e [-z]] [-s slack_seconds] [-L] [-O] [-c max_conns] [-m max_rss_mb] [-n shed_count]"
+                   " [-y busy_poll_us] [-C cpu] [-H handoff_fd] ip_address port_number", basename(argv[0]));
+        log_exit();
+        return 1;
+    }
+
+    /*
+     * 以文件描述符为下标的连接表，大小为进程可打开的文件描述符上限，超过MAX_FDS_LIMIT
+     * 时截断，同时把软上限降到同样大小，保证内核分配的描述符不会超出连接表
+     */
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) < 0)
+    {
+        rl.rlim_cur = 1024;
+    }
+    if(rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > MAX_FDS_LIMIT)
+    {
+        rl.rlim_cur = MAX_FDS_LIMIT;
+        if(setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        {
+            LOG_WARN("setrlimit(RLIMIT_NOFILE, %d) failed, errno is: %d", MAX_FDS_LIMIT, errno);
+        }
+    }
+    max_fds = (int)rl.rlim_cur;
+    if(conn_high < 0)
+    {
+        conn_high = max_fds / 10 * 9;
+    }
+    arena = arena_thread();
+    users = (struct client_data*)arena_calloc(arena, max_fds * sizeof(struct client_data));
+    if(!users)
+    {
+        LOG_ERROR("can not allocate the connection table for %d fds", max_fds);
+        log_exit();
+        return 1;
+    }
+    accepted = (int *)malloc(accept_cap * sizeof(int));
+    timer_batch = (struct timer_spec *)malloc(accept_cap * sizeof(struct timer_spec));
+    timer_ids = (timer_id *)malloc(accept_cap * sizeof(timer_id));
+    timers = timer_ctx_new_arena(0, arena);
+    if(!accepted || !timer_batch || !timer_ids || !timers)
+    {
+        LOG_ERROR("can not allocate the timer list and accept batch of %d", accept_cap);
+        log_exit();
+        return 1;
+    }
+
+    int listenfd = 0;
+    const char* ip = argv[optind];
+    const int port = atoi(argv[optind + 1]);
+    if(set_sig_pipe() < 0)
+    {
+        log_exit();
+        return -1;
+    }
+    /* socket的监听描述符，热升级启动的新进程从旧进程接过监听socket和所有连接 */
+    if(handoff_fd >= 0)
+    {
+        listenfd = take_over(handoff_fd);
+    }
+    else
+    {
+        listenfd = socket_new(ip, port, listen_backlog);
+    }
+    if(listenfd < 0)
+    {
+        log_exit();
+        return -1;
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    /* 只绑定事件循环所在的主线程，日志线程已经创建，不受影响 */
+    if(pin_cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pin_cpu, &set);
+        if(sched_setaffinity(0, sizeof(set), &set) < 0)
+        {
+            LOG_WARN("failed to pin to cpu %d: %s", pin_cpu, strerror(errno));
+        }
+    }
+    if(busy_poll_us > 0 && backend == BACKEND_URING)
+    {
+        LOG_WARN("busy poll is only supported by the epoll backend");
+        backend = BACKEND_EPOLL;
+    }
+    struct rusage ru_start;
+    getrusage(RUSAGE_THREAD, &ru_start);
+    long loop_start = mono_ns();
+
+    if(backend == BACKEND_URING && run_uring(listenfd) < 0)
+    {
+        backend = BACKEND_EPOLL;
+    }
+    if(backend == BACKEND_EPOLL)
+    {
+        run_epoll(listenfd);
+    }
+
+    struct rusage ru_end;
+    getrusage(RUSAGE_THREAD, &ru_end);
+    long loop_ns = mono_ns() - loop_start;
+
+    close(listenfd);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    LOG_INFO("read stats: %lu bytes, %lu recv calls, %lu eagain, %lu short reads, %lu cap hits",
+             conn_stats.bytes_in, conn_stats.recv_calls, conn_stats.eagain,
+             conn_stats.short_reads, conn_stats.cap_hits);
+    LOG_INFO("write stats: %lu bytes, %lu send calls, %lu blocked, %lu zerocopy sends, %lu zerocopy copied",
+             conn_stats.bytes_out, conn_stats.send_calls, conn_stats.send_blocked,
+             conn_stats.zc_sends, conn_stats.zc_copied);
+    LOG_INFO("accept stats: %lu accepted, %lu timer batches, %lu cap hits, %lu dropped on fd exhaustion",
+             accept_stats.accepted, accept_stats.batches, accept_stats.cap_hits,
+             accept_stats.reserve_drops);
+    LOG_INFO("timer stats: %lu wakeups, %lu expired", timer_stats.wakeups, timer_stats.expired);
+    LOG_INFO("overload stats: %lu sheds, %lu evicted, %lu fd exhaustion, min idle timeout %lds",
+             overload_stats.sheds, overload_stats.evicted, overload_stats.fd_exhausted,
+             (long)overload_stats.min_timeout);
+    if(busy_poll_us > 0)
+    {
+        double cpu_ms = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) * 1e3
+                        + (ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec) / 1e3
+                        + (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) * 1e3
+                        + (ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec) / 1e3;
+        LOG_INFO("busy poll stats: %.1f ms cpu in %.1f ms, %.1f ms spinning in %lu empty polls, "
+                 "%lu events caught spinning (%.0f ns spin each), %lu sleeps",
+                 cpu_ms, loop_ns / 1e6, busy_stats.spin_ns / 1e6, busy_stats.empty_polls,
+                 busy_stats.spin_hits,
+                 busy_stats.spin_hits ? (double)busy_stats.spin_ns / busy_stats.spin_hits : 0.0,
+                 busy_stats.sleeps);
+    }
+    int node;
+    for(node = 0; node < arena_nodes(); node++)
+    {
+        struct arena_usage u;
+        if(arena_usage(node, &u) == 0 && u.arenas > 0)
+        {
+            LOG_INFO("arena stats: node %d, %u arenas, %zu KB mapped, %zu KB huge pages, %zu KB in use",
+                     node, u.arenas, u.mapped / 1024, u.huge / 1024, u.in_use / 1024);
+        }
+    }
+    if(reserve_fd >= 0)
+    {
+        close(reserve_fd);
+    }
+    free(accepted);
+    free(timer_batch);
+    free(timer_ids);
+    timer_ctx_free(timers);
+    free(saved_argv);
+    arena_dealloc(arena, users, max_fds * sizeof(struct client_data));
+    users = NULL;
+    log_exit();
+
+    return 0;
+
+}
+
+/* 测试双向链表 */
+/*void test()
+{
+    struct timer_ctx *ctx = timer_ctx_new();
+    time_t cur = time( NULL );
+
+    timer_add(ctx, cur + TIMESLOT, NULL, NULL);
+    timer_id timer2 = timer_add(ctx, cur + 2 * TIMESLOT, NULL, NULL);
+    timer_add(ctx, cur + 3 * TIMESLOT, NULL, NULL);
 
-    print_list();
+    timer_print(ctx, stdout);
 
 
-    del_timer(timer2);
-     print_list();
+    timer_del(ctx, timer2);
+    timer_print(ctx, stdout);
+    timer_ctx_free(ctx);
 }*/
\ No newline at end of file
@@ -0,0 +1,634 @@
+/*
+ * Description: 无锁跳表实现的定时器队列（Fraser/Harris的做法）。节点按(超时时间,
+ *              序号)升序排列，序号保证键唯一。每层的next指针最低位是删除标记：
+ *              删除时从最高层到第0层依次给节点的next打标记，之后的查找遇到带标记
+ *              的节点就用CAS把它从前驱后面摘掉。节点状态（插入中、等待、已执行、
+ *              已取消）和代数放在同一个原子变量中，删除和到期处理通过CAS状态决定
+ *              谁负责摘除节点，消费者不会执行已取消的定时器。
+ *              节点存放在按块分配、不会释放的节点数组中（直到队列释放），用下标
+ *              和代数组成句柄；摘除的节点先放入线程自己的待回收链表，全局epoch
+ *              前进两次之后，不可能再有线程持有它的指针，这时才放回空闲栈复用
+ * Author:      Denny
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "skiplist_timer.h"
+
+#define SKIPLIST_MAX_LEVEL      12                  /* 最大层数，每层的节点数是下一层的1/4 */
+#define SKIPLIST_CHUNK_SHIFT    10
+#define SKIPLIST_CHUNK          (1u << SKIPLIST_CHUNK_SHIFT)   /* 每块的节点数 */
+#define SKIPLIST_MAX_CHUNKS     65536
+#define EBR_MAX_THREADS         SKIPLIST_MAX_THREADS
+#define EBR_RETIRE_BATCH        64                  /* 每回收这么多节点尝试推进一次epoch */
+
+#define MARK    ((uintptr_t)1)
+
+/* 节点状态，和代数一起放在state中：代数 << 2 | 状态 */
+enum{
+    NODE_INSERTING,                     /* 正在插入，还没有在所有层上链接好 */
+    NODE_PENDING,                       /* 等待到期 */
+    NODE_FIRED,                         /* 已由消费者取出 */
+    NODE_CANCELLED                      /* 已删除 */
+};
+
+struct sl_node{
+    _Atomic uint64_t state;
+    time_t expire;
+    uint64_t seq;
+    timer_cb cb;
+    void *arg;
+    uint32_t idx;                       /* 节点在节点数组中的下标 */
+    int level;
+    _Atomic uint32_t free_next;         /* 在空闲栈中时，下一个节点的下标加1 */
+    _Atomic uintptr_t next[SKIPLIST_MAX_LEVEL];
+} __attribute__((aligned(64)));
+
+struct skiplist{
+    struct sl_node head;                /* 哨兵节点，键比所有节点都小 */
+    _Atomic uint32_t nalloc;            /* 已经分配过的节点下标数 */
+    _Atomic uint64_t free_head;         /* 空闲栈：高32位为防ABA的标签，低32位为下标加1 */
+    _Atomic(struct sl_node *) chunks[SKIPLIST_MAX_CHUNKS];
+};
+
+/*
+ * 每个线程在全局表中占一项，在临界区中时epoch为进入时的全局epoch，否则为0。
+ * seq是在这一项上添加的定时器的序号，线程退出后下一个使用这一项的线程继续递增，
+ * 不会产生相同的键
+ */
+struct ebr_slot{
+    _Atomic uint64_t epoch;
+    _Atomic int used;
+    uint64_t seq;
+} __attribute__((aligned(64)));
+
+static struct ebr_slot ebr_slots[EBR_MAX_THREADS];
+static _Atomic int ebr_nslots = 0;      /* 用过的最大项数 */
+static _Atomic uint64_t ebr_epoch = 1;
+
+/* 摘除后等待回收的节点，按回收时的全局epoch分成3组 */
+struct retired{
+    struct skiplist *sl;
+    struct sl_node *node;
+};
+
+struct limbo{
+    uint64_t epoch;
+    struct retired *items;
+    unsigned n;
+    unsigned cap;
+};
+
+struct ebr_thread{
+    int slot;
+    int depth;                          /* 临界区嵌套的层数 */
+    unsigned retired;                   /* 上次推进epoch以来回收的节点数 */
+    uint32_t rand;
+    struct limbo limbo[3];
+};
+
+static __thread struct ebr_thread self = { .slot = -1 };
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+
+static void free_node(struct skiplist *sl, struct sl_node *n);
+
+/* 所有在临界区中的线程都已看到当前epoch时，把它加1 */
+static void ebr_try_advance(void)
+{
+    uint64_t e = atomic_load(&ebr_epoch);
+    int i, n = atomic_load(&ebr_nslots);
+    for(i = 0; i < n; i++)
+    {
+        uint64_t t = atomic_load(&ebr_slots[i].epoch);
+        if(t != 0 && t != e)
+        {
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&ebr_epoch, &e, e + 1);
+}
+
+/* 把回收时的epoch不晚于全局epoch减2的节点放回空闲栈 */
+static void ebr_flush(uint64_t global)
+{
+    int i;
+    for(i = 0; i < 3; i++)
+    {
+        struct limbo *l = &self.limbo[i];
+        if(l->n > 0 && l->epoch + 2 <= global)
+        {
+            unsigned k;
+            for(k = 0; k < l->n; k++)
+            {
+                free_node(l->items[k].sl, l->items[k].node);
+            }
+            l->n = 0;
+        }
+    }
+}
+
+/* 等到本线程回收的所有节点都可以复用，不能在临界区中调用 */
+void skiplist_quiesce(void)
+{
+    for(;;)
+    {
+        ebr_flush(atomic_load(&ebr_epoch));
+        if(self.limbo[0].n == 0 && self.limbo[1].n == 0 && self.limbo[2].n == 0)
+        {
+            return;
+        }
+        ebr_try_advance();
+        sched_yield();
+    }
+}
+
+/* 线程退出时回收剩下的节点并让出全局表中的一项 */
+static void ebr_thread_exit(void *arg)
+{
+    int i;
+    (void)arg;
+    skiplist_quiesce();
+    for(i = 0; i < 3; i++)
+    {
+        free(self.limbo[i].items);
+        self.limbo[i].items = NULL;
+        self.limbo[i].cap = 0;
+    }
+    atomic_store(&ebr_slots[self.slot].used, 0);
+    self.slot = -1;
+}
+
+static void ebr_init(void)
+{
+    pthread_key_create(&ebr_key, ebr_thread_exit);
+}
+
+/* 在全局表中占一项，表已占满（同时使用队列的线程数达到上限）时返回-1 */
+static int ebr_register(void)
+{
+    int i;
+    pthread_once(&ebr_once, ebr_init);
+    for(i = 0; i < EBR_MAX_THREADS; i++)
+    {
+        int expected = 0;
+        if(atomic_compare_exchange_strong(&ebr_slots[i].used, &expected, 1))
+        {
+            int n = atomic_load(&ebr_nslots);
+            while(n < i + 1 && !atomic_compare_exchange_weak(&ebr_nslots, &n, i + 1))
+            {
+            }
+            self.slot = i;
+            self.rand = (uint32_t)(uintptr_t)&self ^ (uint32_t)(i * 2654435761u) ^ 0x9e3779b9u;
+            pthread_setspecific(ebr_key, &self);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* 进入临界区，本线程无法在全局表中占到一项时返回-1 */
+static int ebr_enter(void)
+{
+    if(self.depth > 0)
+    {
+        self.depth++;
+        return 0;
+    }
+    if(self.slot < 0 && ebr_register() < 0)
+    {
+        return -1;
+    }
+    self.depth = 1;
+    uint64_t e = atomic_load(&ebr_epoch);
+    atomic_store(&ebr_slots[self.slot].epoch, e);
+    ebr_flush(e);
+    return 0;
+}
+
+static void ebr_exit(void)
+{
+    if(--self.depth > 0)
+    {
+        return;
+    }
+    atomic_store_explicit(&ebr_slots[self.slot].epoch, 0, memory_order_release);
+}
+
+/* 节点已从所有层上摘除，等到没有线程可能持有它时再复用 */
+static void ebr_retire(struct skiplist *sl, struct sl_node *n)
+{
+    uint64_t e = atomic_load(&ebr_epoch);
+    struct limbo *l = &self.limbo[e % 3];
+    if(l->epoch != e)
+    {
+        /* 这一组是3个epoch之前的，已经可以复用 */
+        ebr_flush(e);
+        l->epoch = e;
+    }
+    if(l->n == l->cap)
+    {
+        unsigned cap = l->cap ? l->cap * 2 : 64;
+        struct retired *items = (struct retired *)realloc(l->items, cap * sizeof(struct retired));
+        if(!items)
+        {
+            /* 内存不足时宁可泄漏这个节点，也不能提前复用 */
+            return;
+        }
+        l->items = items;
+        l->cap = cap;
+    }
+    l->items[l->n].sl = sl;
+    l->items[l->n].node = n;
+    l->n++;
+    if(++self.retired >= EBR_RETIRE_BATCH)
+    {
+        self.retired = 0;
+        ebr_try_advance();
+    }
+}
+
+static struct sl_node *ptr_of(uintptr_t p)
+{
+    return (struct sl_node *)(p & ~MARK);
+}
+
+static bool marked(uintptr_t p)
+{
+    return (p & MARK) != 0;
+}
+
+static uint64_t make_state(uint32_t gen, int st)
+{
+    return ((uint64_t)gen << 2) | (uint64_t)st;
+}
+
+static uint32_t state_gen(uint64_t state)
+{
+    return (uint32_t)(state >> 2);
+}
+
+static int state_of(uint64_t state)
+{
+    return (int)(state & 3);
+}
+
+/* 节点n的键是否小于(expire, seq) */
+static bool key_before(const struct sl_node *n, time_t expire, uint64_t seq)
+{
+    return n->expire < expire || (n->expire == expire && n->seq < seq);
+}
+
+static struct sl_node *node_at(struct skiplist *sl, uint32_t idx)
+{
+    struct sl_node *chunk = atomic_load_explicit(&sl->chunks[idx >> SKIPLIST_CHUNK_SHIFT], memory_order_acquire);
+    return chunk ? &chunk[idx & (SKIPLIST_CHUNK - 1)] : NULL;
+}
+
+/* 优先从空闲栈中取节点，空闲栈为空时使用新的下标，所在的块不存在时分配 */
+static struct sl_node *alloc_node(struct skiplist *sl)
+{
+    uint64_t head = atomic_load(&sl->free_head);
+    while((uint32_t)head != 0)
+    {
+        struct sl_node *n = node_at(sl, (uint32_t)head - 1);
+        uint64_t next = (((head >> 32) + 1) << 32) | atomic_load_explicit(&n->free_next, memory_order_relaxed);
+        if(atomic_compare_exchange_weak(&sl->free_head, &head, next))
+        {
+            return n;
+        }
+    }
+
+    uint32_t idx = atomic_fetch_add(&sl->nalloc, 1);
+    if(idx >= (uint32_t)SKIPLIST_MAX_CHUNKS * SKIPLIST_CHUNK - 1)
+    {
+        return NULL;
+    }
+    uint32_t c = idx >> SKIPLIST_CHUNK_SHIFT;
+    struct sl_node *chunk = atomic_load_explicit(&sl->chunks[c], memory_order_acquire);
+    if(!chunk)
+    {
+        struct sl_node *fresh = (struct sl_node *)aligned_alloc(64, SKIPLIST_CHUNK * sizeof(struct sl_node));
+        if(!fresh)
+        {
+            return NULL;
+        }
+        uint32_t i;
+        memset(fresh, 0, SKIPLIST_CHUNK * sizeof(struct sl_node));
+        for(i = 0; i < SKIPLIST_CHUNK; i++)
+        {
+            fresh[i].idx = (c << SKIPLIST_CHUNK_SHIFT) + i;
+            atomic_init(&fresh[i].state, make_state(1, NODE_INSERTING));
+        }
+        struct sl_node *expected = NULL;
+        if(atomic_compare_exchange_strong(&sl->chunks[c], &expected, fresh))
+        {
+            chunk = fresh;
+        }
+        else
+        {
+            free(fresh);
+            chunk = expected;
+        }
+    }
+    return &chunk[idx & (SKIPLIST_CHUNK - 1)];
+}
+
+/* 代数加1使旧句柄失效，再放回空闲栈 */
+static void free_node(struct skiplist *sl, struct sl_node *n)
+{
+    uint64_t st = atomic_load(&n->state);
+    atomic_store(&n->state, make_state(state_gen(st) + 1, NODE_INSERTING));
+    uint64_t head = atomic_load(&sl->free_head);
+    uint64_t next;
+    do
+    {
+        atomic_store_explicit(&n->free_next, (uint32_t)head, memory_order_relaxed);
+        next = (((head >> 32) + 1) << 32) | (n->idx + 1);
+    } while(!atomic_compare_exchange_weak(&sl->free_head, &head, next));
+}
+
+/*
+ * 查找(expire, seq)在每一层上的前驱和后继，途中把带删除标记的节点摘掉，
+ * 摘除失败说明前驱也变了，从头开始。preds和succs可以为NULL，只做清理
+ */
+static void find(struct skiplist *sl, time_t expire, uint64_t seq,
+                 struct sl_node **preds, struct sl_node **succs)
+{
+    int level;
+    struct sl_node *pred, *curr;
+retry:
+    pred = &sl->head;
+    for(level = SKIPLIST_MAX_LEVEL - 1; level >= 0; level--)
+    {
+        curr = ptr_of(atomic_load_explicit(&pred->next[level], memory_order_acquire));
+        while(curr)
+        {
+            uintptr_t succ = atomic_load_explicit(&curr->next[level], memory_order_acquire);
+            if(marked(succ))
+            {
+                uintptr_t expected = (uintptr_t)curr;
+                if(!atomic_compare_exchange_strong(&pred->next[level], &expected, succ & ~MARK))
+                {
+                    goto retry;
+                }
+                curr = ptr_of(succ);
+                continue;
+            }
+            if(!key_before(curr, expire, seq))
+            {
+                break;
+            }
+            pred = curr;
+            curr = ptr_of(succ);
+        }
+        if(preds)
+        {
+            preds[level] = pred;
+        }
+        if(succs)
+        {
+            succs[level] = curr;
+        }
+    }
+}
+
+/* 节点的层数，每多一层的概率为1/4 */
+static int random_level(void)
+{
+    int level = 1;
+    uint32_t x = self.rand;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    self.rand = x;
+    while(level < SKIPLIST_MAX_LEVEL && (x & 3) == 0)
+    {
+        level++;
+        x >>= 2;
+    }
+    return level;
+}
+
+/*
+ * 由CAS状态成功的线程调用：从最高层到第0层依次打上删除标记，再查找一次
+ * 把它从所有层上摘掉，然后交给epoch回收
+ */
+static void unlink_node(struct skiplist *sl, struct sl_node *n)
+{
+    int level;
+    for(level = n->level - 1; level >= 0; level--)
+    {
+        uintptr_t succ = atomic_load(&n->next[level]);
+        while(!marked(succ) && !atomic_compare_exchange_weak(&n->next[level], &succ, succ | MARK))
+        {
+        }
+    }
+    find(sl, n->expire, n->seq, NULL, NULL);
+    ebr_retire(sl, n);
+}
+
+struct skiplist *skiplist_new(void)
+{
+    struct skiplist *sl = (struct skiplist *)aligned_alloc(64, sizeof(struct skiplist));
+    if(!sl)
+    {
+        return NULL;
+    }
+    memset(sl, 0, sizeof(*sl));
+    sl->head.level = SKIPLIST_MAX_LEVEL;
+    return sl;
+}
+
+/* 释放队列，尚未到期的定时器直接丢弃。其他线程不能再使用它 */
+void skiplist_free(struct skiplist *sl)
+{
+    uint32_t c;
+    if(!sl)
+    {
+        return;
+    }
+    skiplist_quiesce();
+    for(c = 0; c < SKIPLIST_MAX_CHUNKS; c++)
+    {
+        free(atomic_load(&sl->chunks[c]));
+    }
+    free(sl);
+}
+
+/*
+ * 添加定时器，返回其句柄，内存不足或者同时使用队列的线程数已达上限时返回
+ * TIMER_INVALID。先在第0层链接，再逐层向上链接，全部链接好之后才变为等待状态，
+ * 在这之前不会被删除或执行
+ */
+timer_id skiplist_add(struct skiplist *sl, time_t expire, timer_cb cb, void *arg)
+{
+    struct sl_node *preds[SKIPLIST_MAX_LEVEL];
+    struct sl_node *succs[SKIPLIST_MAX_LEVEL];
+    int level;
+
+    if(ebr_enter() < 0)
+    {
+        return TIMER_INVALID;
+    }
+    struct sl_node *n = alloc_node(sl);
+    if(!n)
+    {
+        ebr_exit();
+        return TIMER_INVALID;
+    }
+    n->expire = expire;
+    n->seq = ebr_slots[self.slot].seq++ | ((uint64_t)self.slot << 56);
+    n->cb = cb;
+    n->arg = arg;
+    n->level = random_level();
+
+    for(;;)
+    {
+        find(sl, expire, n->seq, preds, succs);
+        for(level = 0; level < n->level; level++)
+        {
+            atomic_store_explicit(&n->next[level], (uintptr_t)succs[level], memory_order_relaxed);
+        }
+        uintptr_t expected = (uintptr_t)succs[0];
+        if(atomic_compare_exchange_strong(&preds[0]->next[0], &expected, (uintptr_t)n))
+        {
+            break;
+        }
+    }
+    for(level = 1; level < n->level; level++)
+    {
+        for(;;)
+        {
+            uintptr_t expected = (uintptr_t)succs[level];
+            if(atomic_compare_exchange_strong(&preds[level]->next[level], &expected, (uintptr_t)n))
+            {
+                break;
+            }
+            /* 前驱变了或者被删除了，重新查找这一层的位置 */
+            find(sl, expire, n->seq, preds, succs);
+            atomic_store_explicit(&n->next[level], (uintptr_t)succs[level], memory_order_relaxed);
+        }
+    }
+
+    uint64_t st = atomic_load(&n->state);
+    atomic_store_explicit(&n->state, make_state(state_gen(st), NODE_PENDING), memory_order_release);
+    timer_id id = ((timer_id)state_gen(st) << 32) | (n->idx + 1);
+    ebr_exit();
+    return id;
+}
+
+/* 删除定时器，定时器已经到期或已被删除、或者线程数已达上限时返回-1 */
+int skiplist_del(struct skiplist *sl, timer_id id)
+{
+    uint32_t idx = (uint32_t)id - 1;
+    if(id == TIMER_INVALID || idx >= atomic_load(&sl->nalloc))
+    {
+        return -1;
+    }
+    struct sl_node *n = node_at(sl, idx);
+    if(!n)
+    {
+        return -1;
+    }
+    uint64_t expected = make_state((uint32_t)(id >> 32), NODE_PENDING);
+    if(ebr_enter() < 0)
+    {
+        return -1;
+    }
+    if(!atomic_compare_exchange_strong(&n->state, &expected, make_state((uint32_t)(id >> 32), NODE_CANCELLED)))
+    {
+        ebr_exit();
+        return -1;
+    }
+    unlink_node(sl, n);
+    ebr_exit();
+    return 0;
+}
+
+/*
+ * 消费者调用：从头部依次取出超时时间不晚于now的定时器并执行，回调函数在临界区
+ * 之外执行，可以添加和删除定时器。正在插入的定时器跳过，留到下一次处理，不会
+ * 挡住后面已经到期的定时器。返回执行的定时器数
+ */
+int skiplist_poll(struct skiplist *sl, time_t now)
+{
+    int fired = 0;
+    for(;;)
+    {
+        timer_cb cb = NULL;
+        void *arg = NULL;
+        bool found = false;
+
+        if(ebr_enter() < 0)
+        {
+            break;
+        }
+        struct sl_node *n = ptr_of(atomic_load_explicit(&sl->head.next[0], memory_order_acquire));
+        while(n && n->expire <= now)
+        {
+            uint64_t st = atomic_load(&n->state);
+            if(state_of(st) == NODE_PENDING)
+            {
+                if(atomic_compare_exchange_strong(&n->state, &st, make_state(state_gen(st), NODE_FIRED)))
+                {
+                    cb = n->cb;
+                    arg = n->arg;
+                    unlink_node(sl, n);
+                    found = true;
+                    break;
+                }
+                /* 同时被删除了，重新看它的状态 */
+                continue;
+            }
+            /* 正在插入的节点，或者已删除、已执行但尚未摘除的节点 */
+            n = ptr_of(atomic_load_explicit(&n->next[0], memory_order_acquire));
+        }
+        ebr_exit();
+
+        if(!found)
+        {
+            break;
+        }
+        if(cb)
+        {
+            cb(arg);
+        }
+        fired++;
+    }
+    return fired;
+}
+
+/*
+ * 最早的等待中的定时器的超时时间，没有定时器时返回-1。与skiplist_poll一样跳过
+ * 正在插入的定时器，报告的时间总是poll能够处理的
+ */
+int skiplist_earliest(struct skiplist *sl, time_t *when)
+{
+    int ret = -1;
+    if(ebr_enter() < 0)
+    {
+        return -1;
+    }
+    struct sl_node *n = ptr_of(atomic_load_explicit(&sl->head.next[0], memory_order_acquire));
+    while(n)
+    {
+        if(state_of(atomic_load(&n->state)) == NODE_PENDING)
+        {
+            *when = n->expire;
+            ret = 0;
+            break;
+        }
+        n = ptr_of(atomic_load_explicit(&n->next[0], memory_order_acquire));
+    }
+    ebr_exit();
+    return ret;
+}
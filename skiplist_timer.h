@@ -0,0 +1,30 @@
+#ifndef __SKIPLIST_TIMER_H__
+#define __SKIPLIST_TIMER_H__
+
+#include <time.h>
+
+#include "list_timer.h"
+
+/*
+ * 无锁跳表实现的定时器队列：任意多个线程可以同时添加和删除定时器，期望时间
+ * O(log n)，不需要全局锁；只允许一个线程（消费者）调用skiplist_poll处理到期的
+ * 定时器和skiplist_earliest。句柄的格式与list_timer.h相同，定时器到期或删除之后
+ * 旧句柄的操作安全地失败。
+ * 节点的回收使用基于epoch的延迟回收，使用过队列的线程退出时会等待自己回收的
+ * 节点可以复用；释放队列之前，其他使用过它的线程必须已经退出或者调用过
+ * skiplist_quiesce。同时使用队列的线程最多SKIPLIST_MAX_THREADS个（所有队列
+ * 共用），超过时skiplist_add返回TIMER_INVALID，直到有使用过的线程退出
+ */
+#define SKIPLIST_MAX_THREADS    256
+
+struct skiplist;
+
+struct skiplist *skiplist_new(void);
+void skiplist_free(struct skiplist *sl);
+timer_id skiplist_add(struct skiplist *sl, time_t expire, timer_cb cb, void *arg);
+int skiplist_del(struct skiplist *sl, timer_id id);
+int skiplist_poll(struct skiplist *sl, time_t now);
+int skiplist_earliest(struct skiplist *sl, time_t *when);
+void skiplist_quiesce(void);
+
+#endif
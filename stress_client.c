@@ -7,6 +7,8 @@
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+#include <errno.h>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -18,6 +20,17 @@
 
 static const char* request = "GET http://localhost/index.html HTTP/1.1\r\nConnection: keep-alive\r\n\r\nxxxxxxxxxxxx";
 
+/* 压测模式：不再逐个等待，而是持续发送并统计吞吐量 */
+static bool bench = false;
+static unsigned long long bench_bytes = 0;
+static unsigned long long bench_requests = 0;
+/* 压测模式下按原来的一写一读方式进行，统计往返次数（需要服务器开启回显） */
+static bool pingpong = false;
+static unsigned long long bench_roundtrips = 0;
+/* 压测模式下每个连接当前请求已经写出的字节数，以描述符为下标 */
+static int *flood_off = NULL;
+static int flood_max = 0;
+
 /* 设置socket描述符为非阻塞 */
 int setnonblocking( int fd )
 {
@@ -33,6 +46,11 @@ void addfd(int epoll_fd, int fd)
     struct epoll_event event;
     event.data.fd = fd;
     event.events = EPOLLOUT | EPOLLET | EPOLLERR;
+    /* 压测模式下每次只写有限的请求数，使用水平触发以便下次继续写 */
+    if(bench && !pingpong)
+    {
+        event.events = EPOLLOUT | EPOLLERR;
+    }
     epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
     setnonblocking(fd);
 }
@@ -41,7 +59,10 @@ void addfd(int epoll_fd, int fd)
 bool write_nbytes(int sockfd, const char* buffer, int len )
 {
     int bytes_write = 0;
-    printf( "write out %d bytes to socket %d\n", len, sockfd);
+    if(!bench)
+    {
+        printf( "write out %d bytes to socket %d\n", len, sockfd);
+    }
     while( 1 ) 
     {   
         bytes_write = send( sockfd, buffer, len, 0 );
@@ -77,7 +98,10 @@ bool read_once( int sockfd, char* buffer, int len )
     {
         return false;
     }
-	printf( "read in %d bytes from socket %d with content:\n %s\n", bytes_read, sockfd, buffer );
+    if(!bench)
+    {
+	    printf( "read in %d bytes from socket %d with content:\n %s\n", bytes_read, sockfd, buffer );
+    }
 
     return true;
 }
@@ -96,9 +120,15 @@ int start_conn(int epoll_fd, int num, const char* ip, int port )
     /* 创建num个socket */
     for (i = 0; i < num; ++i )
     {
-        sleep( 1 );
+        if(!bench)
+        {
+            sleep( 1 );
+        }
         int sockfd = socket(PF_INET, SOCK_STREAM, 0 );
-        printf( "create 1 sock\n" );
+        if(!bench)
+        {
+            printf( "create 1 sock\n" );
+        }
         if( sockfd < 0 )
         {
             continue;
@@ -107,7 +137,10 @@ int start_conn(int epoll_fd, int num, const char* ip, int port )
         if (connect(sockfd, ( struct sockaddr* )&address, sizeof( address ) ) == 0)
         {          
             count++;
-            printf("build connection %d\n", count);
+            if(!bench)
+            {
+                printf("build connection %d\n", count);
+            }
             addfd(epoll_fd, sockfd);
         }
     }
@@ -117,10 +150,51 @@ int start_conn(int epoll_fd, int num, const char* ip, int port )
 /* 从epoll事件集中删除事件，同时关闭socket描述符 */
 void close_conn( int epoll_fd, int sockfd )
 {
+    if(sockfd < flood_max)
+    {
+        flood_off[sockfd] = 0;
+    }
     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sockfd, 0 );
     close( sockfd );
 }
 
+/*
+ * 压测模式下每次最多写出FLOOD_BATCH个请求，统计写出的字节数和请求数。只写出了
+ * 一部分时记下偏移，下次先写完剩余部分，保证服务器看到的请求是完整的
+ */
+#define FLOOD_BATCH 16
+static void flood_conn(int epoll_fd, int sockfd)
+{
+    int len = strlen(request);
+    int i;
+    if(sockfd >= flood_max)
+    {
+        close_conn(epoll_fd, sockfd);
+        return;
+    }
+    for(i = 0; i < FLOOD_BATCH; i++)
+    {
+        int off = flood_off[sockfd];
+        int n = send(sockfd, request + off, len - off, 0);
+        if(n < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                close_conn(epoll_fd, sockfd);
+            }
+            return;
+        }
+        bench_bytes += n;
+        if(off + n < len)
+        {
+            flood_off[sockfd] = off + n;
+            return;
+        }
+        flood_off[sockfd] = 0;
+        bench_requests++;
+    }
+}
+
 static void handle_event(int epoll_fd, struct epoll_event *events, int nums, char *buffer)
 {
     int i;
@@ -128,6 +202,18 @@ static void handle_event(int epoll_fd, struct epoll_event *events, int nums, cha
     for (i = 0; i < nums; i++ )
     {   
         sockfd = events[i].data.fd;
+        if(bench && !pingpong)
+        {
+            if(events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close_conn( epoll_fd, sockfd );
+            }
+            else if(events[i].events & EPOLLOUT)
+            {
+                flood_conn(epoll_fd, sockfd);
+            }
+            continue;
+        }
         /* 处理可读描述符，接收数据 */
         if ( events[i].events & EPOLLIN )
         {   
@@ -136,6 +222,10 @@ static void handle_event(int epoll_fd, struct epoll_event *events, int nums, cha
             {
                 close_conn( epoll_fd, sockfd );
             }
+            else
+            {
+                bench_roundtrips++;
+            }
             struct epoll_event event;
             event.events = EPOLLOUT | EPOLLET | EPOLLERR;  //修改描述符为可写和边缘触发
             event.data.fd = sockfd;
@@ -161,17 +251,49 @@ static void handle_event(int epoll_fd, struct epoll_event *events, int nums, cha
     }
 }
 
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int main( int argc, char* argv[] )
 {
     int nConnection = 0;
+    int duration = 0;
+    int opt;
     //assert( argc == 4 );
-    if (argc != 4)
+    while((opt = getopt(argc, argv, "d:p")) != -1)
     {
-        printf("usage: client <IP_Address> <port> connection<num> \n");
+        if(opt == 'd')
+        {
+            duration = atoi(optarg);
+            bench = duration > 0;
+        }
+        else if(opt == 'p')
+        {
+            pingpong = true;
+        }
+        else
+        {
+            argc = 0;
+        }
+    }
+    if (argc - optind != 3)
+    {
+        printf("usage: client [-d bench_seconds [-p]] <IP_Address> <port> connection<num> \n");
         exit(1);
     }
+    argv += optind - 1;
     /* 创建epoll描述符 */
     int epoll_fd = epoll_create(100);
+    /* 连接的描述符从最小的空闲描述符开始分配，不会超过连接数加上已打开的少数描述符 */
+    if(bench && !pingpong)
+    {
+        flood_max = atoi(argv[3]) + 1024;
+        flood_off = (int *)calloc(flood_max, sizeof(int));
+    }
 
     nConnection = start_conn(epoll_fd, atoi(argv[3]), argv[1], atoi(argv[2]));
     if (nConnection <= 0)
@@ -185,6 +307,29 @@ int main( int argc, char* argv[] )
     struct epoll_event events[10000];
     char buffer[2048];
 
+    if(bench)
+    {
+        double start = now_sec();
+        double elapsed = 0;
+        while(elapsed < duration)
+        {
+            int fds = epoll_wait(epoll_fd, events, 10000, 100);
+            handle_event(epoll_fd, events, fds, buffer);
+            elapsed = now_sec() - start;
+        }
+        if(pingpong)
+        {
+            printf("%d connections, %d s: %.0f round trips/s\n", nConnection, duration,
+                   bench_roundtrips / elapsed);
+        }
+        else
+        {
+            printf("%d connections, %d s: %.2f MB/s, %.0f requests/s\n", nConnection, duration,
+                   bench_bytes / elapsed / 1e6, bench_requests / elapsed);
+        }
+        return 0;
+    }
+
     while (1)
     {
         sleep(5);
@@ -194,4 +339,3 @@ int main( int argc, char* argv[] )
         handle_event(epoll_fd, events, fds, buffer);
     }
 }
-
@@ -0,0 +1,210 @@
+/*
+ * Description: 无锁跳表定时器队列的多线程测试：多个生产者同时添加和删除定时器，
+ *              一个消费者按虚拟时间推进并处理到期的定时器。检查每个没有删除的
+ *              定时器恰好执行一次，删除成功的和旧句柄的定时器从不执行，对已经
+ *              执行或已经删除的句柄再次删除返回-1；线程数超过上限时添加失败而
+ *              不是一直等待。失败时输出所在的行号并返回1，make test 运行
+ * Author:      Denny
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "skiplist_timer.h"
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if(!(cond))                                                         \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while(0)
+
+#define PRODUCERS   8
+#define OPS         20000                   /* 每个生产者添加的定时器数 */
+#define HANDLES     64                      /* 每个生产者同时持有的定时器数 */
+
+/* 每个添加过的定时器一条记录 */
+struct record{
+    timer_id id;
+    _Atomic int fired;
+    bool cancelled;                         /* skiplist_del返回了0 */
+};
+
+struct producer{
+    pthread_t tid;
+    unsigned seed;
+    struct record *records;
+};
+
+static struct skiplist *sl;
+static _Atomic time_t vnow;
+static atomic_int stop;
+
+static void on_expire(void *arg)
+{
+    struct record *r = (struct record *)arg;
+    atomic_fetch_add(&r->fired, 1);
+}
+
+static void *produce(void *arg)
+{
+    struct producer *p = (struct producer *)arg;
+    int handles[HANDLES];
+    int i;
+
+    for(i = 0; i < HANDLES; i++)
+    {
+        handles[i] = -1;
+    }
+    for(i = 0; i < OPS; i++)
+    {
+        int k = rand_r(&p->seed) % HANDLES;
+        if(handles[k] >= 0)
+        {
+            struct record *old = &p->records[handles[k]];
+            if(skiplist_del(sl, old->id) == 0)
+            {
+                old->cancelled = true;
+            }
+            /* 删除成功之后，或者已经执行过，再删除都失败 */
+            CHECK(skiplist_del(sl, old->id) == -1);
+        }
+        struct record *r = &p->records[i];
+        time_t expire = atomic_load_explicit(&vnow, memory_order_relaxed) + 1 + rand_r(&p->seed) % 50;
+        r->id = skiplist_add(sl, expire, on_expire, r);
+        CHECK(r->id != TIMER_INVALID);
+        handles[k] = i;
+    }
+    return NULL;
+}
+
+static void *consume(void *arg)
+{
+    (void)arg;
+    while(!atomic_load(&stop))
+    {
+        time_t now = atomic_load(&vnow) + 1;
+        atomic_store(&vnow, now);
+        skiplist_poll(sl, now);
+    }
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    struct producer p[PRODUCERS];
+    pthread_t cons;
+    int i, j;
+
+    sl = skiplist_new();
+    CHECK(sl != NULL);
+    atomic_store(&stop, 0);
+    pthread_create(&cons, NULL, consume, NULL);
+    for(i = 0; i < PRODUCERS; i++)
+    {
+        p[i].seed = 12345 + i;
+        p[i].records = (struct record *)calloc(OPS, sizeof(struct record));
+        CHECK(p[i].records != NULL);
+        pthread_create(&p[i].tid, NULL, produce, &p[i]);
+    }
+    for(i = 0; i < PRODUCERS; i++)
+    {
+        pthread_join(p[i].tid, NULL);
+    }
+    atomic_store(&stop, 1);
+    pthread_join(cons, NULL);
+
+    /* 剩下的定时器全部到期 */
+    skiplist_poll(sl, atomic_load(&vnow) + 100);
+    time_t when;
+    CHECK(skiplist_earliest(sl, &when) == -1);
+
+    for(i = 0; i < PRODUCERS; i++)
+    {
+        for(j = 0; j < OPS; j++)
+        {
+            struct record *r = &p[i].records[j];
+            CHECK(atomic_load(&r->fired) == (r->cancelled ? 0 : 1));
+            CHECK(skiplist_del(sl, r->id) == -1);
+        }
+        free(p[i].records);
+    }
+    skiplist_free(sl);
+}
+
+/* 超过线程数上限的线程添加失败，不会一直等待 */
+static pthread_barrier_t added;
+static pthread_barrier_t done;
+static atomic_int failed;
+
+static void *hold_slot(void *arg)
+{
+    (void)arg;
+    timer_id id = skiplist_add(sl, 1000, NULL, NULL);
+    if(id == TIMER_INVALID)
+    {
+        atomic_fetch_add(&failed, 1);
+    }
+    pthread_barrier_wait(&added);
+    pthread_barrier_wait(&done);
+    if(id != TIMER_INVALID)
+    {
+        skiplist_del(sl, id);
+    }
+    return NULL;
+}
+
+static void *add_once(void *arg)
+{
+    *(timer_id *)arg = skiplist_add(sl, 1, NULL, NULL);
+    return NULL;
+}
+
+static void test_thread_limit(void)
+{
+    enum { NTHREADS = SKIPLIST_MAX_THREADS + 1 };
+    static pthread_t tids[NTHREADS];
+    int i;
+
+    sl = skiplist_new();
+    CHECK(sl != NULL);
+    atomic_store(&failed, 0);
+    pthread_barrier_init(&added, NULL, NTHREADS + 1);
+    pthread_barrier_init(&done, NULL, NTHREADS + 1);
+    for(i = 0; i < NTHREADS; i++)
+    {
+        CHECK(pthread_create(&tids[i], NULL, hold_slot, NULL) == 0);
+    }
+    pthread_barrier_wait(&added);
+    CHECK(atomic_load(&failed) >= 1);
+    pthread_barrier_wait(&done);
+    for(i = 0; i < NTHREADS; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_barrier_destroy(&added);
+    pthread_barrier_destroy(&done);
+
+    /* 线程退出后让出的项可以给新的线程使用 */
+    pthread_t tid;
+    timer_id id = TIMER_INVALID;
+    CHECK(pthread_create(&tid, NULL, add_once, &id) == 0);
+    pthread_join(tid, NULL);
+    CHECK(id != TIMER_INVALID);
+    CHECK(skiplist_poll(sl, 1000) == 1);
+    skiplist_free(sl);
+}
+
+int main()
+{
+    test_concurrent();
+    test_thread_limit();
+    printf("test_skiplist: ok\n");
+    return 0;
+}
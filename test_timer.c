@@ -0,0 +1,253 @@
+/*
+ * Description: libtimer的测试：带代数的句柄在槽位被复用之后不能再操作新的定时器，
+ *              带slack的周期定时器每个周期都按slack折合，链表、堆和惰性删除的堆
+ *              三种排序方式下行为一致；惰性删除的墓碑不会执行并且会被压缩回收。
+ *              失败时输出所在的行号并返回1，make test 运行
+ * Author:      Denny
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "list_timer.h"
+#include "timer_slack.h"
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if(!(cond))                                                         \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while(0)
+
+static const unsigned flags_list[] = { 0, TIMER_CTX_HEAP, TIMER_CTX_HEAP | TIMER_CTX_LAZY };
+
+static int fired[64];
+
+static void on_fire(void *arg)
+{
+    fired[(long)arg]++;
+}
+
+/* 槽位被复用之后，旧句柄的查询、推迟和删除都失败，新定时器不受影响 */
+static void test_stale_handle(unsigned flags)
+{
+    struct timer_ctx *ctx = timer_ctx_new_flags(flags);
+    time_t expire;
+    void *arg;
+
+    timer_id old = timer_add(ctx, 10, on_fire, (void *)1);
+    CHECK(old != TIMER_INVALID);
+    CHECK(timer_del(ctx, old) == 0);
+    CHECK(timer_del(ctx, old) == -1);
+    timer_tick(ctx, 0);
+
+    /* 空闲槽位只有刚释放的这一个，新定时器一定复用它 */
+    timer_id id = timer_add(ctx, 20, on_fire, (void *)2);
+    CHECK(id != TIMER_INVALID);
+    CHECK((uint32_t)id == (uint32_t)old);
+    CHECK(id != old);
+
+    CHECK(timer_get(ctx, old, &expire, &arg) == -1);
+    CHECK(timer_adjust(ctx, old, 5) == -1);
+    CHECK(timer_del(ctx, old) == -1);
+    CHECK(timer_get(ctx, id, &expire, &arg) == 0);
+    CHECK(expire == 20 && arg == (void *)2);
+
+    /* 到期之后的句柄同样失效 */
+    fired[1] = fired[2] = 0;
+    timer_tick(ctx, 20);
+    CHECK(fired[1] == 0 && fired[2] == 1);
+    CHECK(timer_count(ctx) == 0);
+    CHECK(timer_del(ctx, id) == -1);
+    CHECK(timer_adjust(ctx, id, 30) == -1);
+
+    /* 不属于任何槽位的句柄 */
+    CHECK(timer_del(ctx, TIMER_INVALID) == -1);
+    CHECK(timer_del(ctx, ((timer_id)1 << 32) | 100000) == -1);
+    timer_ctx_free(ctx);
+}
+
+/* 反复添加删除，每个旧句柄都要失效，同一槽位的新句柄各不相同 */
+static void test_recycle_many(unsigned flags)
+{
+    struct timer_ctx *ctx = timer_ctx_new_flags(flags);
+    timer_id ids[32];
+    timer_id prev[32];
+    int round, i;
+
+    for(i = 0; i < 32; i++)
+    {
+        prev[i] = TIMER_INVALID;
+    }
+    for(round = 0; round < 100; round++)
+    {
+        for(i = 0; i < 32; i++)
+        {
+            ids[i] = timer_add(ctx, 100 + i, on_fire, (void *)0);
+            CHECK(ids[i] != TIMER_INVALID);
+        }
+        for(i = 0; i < 32; i++)
+        {
+            CHECK(timer_del(ctx, prev[i]) == -1);
+            CHECK(timer_del(ctx, ids[i]) == 0);
+            prev[i] = ids[i];
+        }
+        timer_tick(ctx, 0);
+    }
+    CHECK(timer_count(ctx) == 0);
+    timer_ctx_free(ctx);
+}
+
+static time_t clock_now;
+static time_t fire_times[64];
+static int nfire;
+
+static void on_fire_time(void *arg)
+{
+    (void)arg;
+    if(nfire < 64)
+    {
+        fire_times[nfire] = clock_now;
+    }
+    nfire++;
+}
+
+/* 带slack的周期定时器每个周期都按slack折合，并且折合不会累积到之后的周期上 */
+static void test_periodic_slack(unsigned flags)
+{
+    static const enum timer_policy policies[] = { TIMER_RELATIVE, TIMER_SKIP, TIMER_CATCHUP };
+    unsigned p;
+    int i;
+
+    for(p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+    {
+        struct timer_ctx *ctx = timer_ctx_new_flags(flags);
+        timer_id id = timer_add_periodic_slack(ctx, 3, 5, 4, policies[p], on_fire_time, NULL);
+        CHECK(id != TIMER_INVALID);
+        nfire = 0;
+        for(clock_now = 0; clock_now <= 200; clock_now++)
+        {
+            timer_tick(ctx, clock_now);
+        }
+        CHECK(nfire >= 200 / (5 + 4) && nfire <= 64);
+        time_t due = 3;
+        for(i = 0; i < nfire; i++)
+        {
+            CHECK(fire_times[i] == timer_coalesce(due, 4));
+            /* 每个滴答都调用了timer_tick，三种策略都不会错过到期时间 */
+            due = policies[p] == TIMER_RELATIVE ? fire_times[i] + 5 : due + 5;
+        }
+        CHECK(timer_del(ctx, id) == 0);
+        timer_ctx_free(ctx);
+    }
+}
+
+#define LAZY_TIMERS 1000
+
+static int hits[LAZY_TIMERS];
+
+static void on_hit(void *arg)
+{
+    hits[(long)arg]++;
+}
+
+/*
+ * 惰性模式：删除之后句柄立即失效，墓碑到了堆顶也不会执行；墓碑足够多时
+ * 删除会压缩堆，timer_dead随之下降，timer_compact回收剩下的所有墓碑
+ */
+static void test_lazy_delete(void)
+{
+    struct timer_ctx *ctx = timer_ctx_new_flags(TIMER_CTX_HEAP | TIMER_CTX_LAZY);
+    timer_id ids[LAZY_TIMERS];
+    bool deleted[LAZY_TIMERS] = { false };
+    time_t expire;
+    void *arg;
+    long i;
+
+    for(i = 0; i < LAZY_TIMERS; i++)
+    {
+        hits[i] = 0;
+        ids[i] = timer_add(ctx, 1000 + i, on_hit, (void *)i);
+        CHECK(ids[i] != TIMER_INVALID);
+    }
+
+    /* 删除最早到期的一部分，墓碑还不够多，留在堆中 */
+    for(i = 0; i < 20; i += 2)
+    {
+        CHECK(timer_del(ctx, ids[i]) == 0);
+        deleted[i] = true;
+        CHECK(timer_del(ctx, ids[i]) == -1);
+        CHECK(timer_get(ctx, ids[i], &expire, &arg) == -1);
+        CHECK(timer_adjust(ctx, ids[i], 5000) == -1);
+    }
+    CHECK(timer_dead(ctx) == 10);
+    CHECK(timer_count(ctx) == LAZY_TIMERS - 10);
+
+    /* 墓碑到了堆顶时被回收，不会执行 */
+    CHECK(timer_tick(ctx, 1019) == 10);
+    for(i = 0; i < 20; i++)
+    {
+        CHECK(hits[i] == (deleted[i] ? 0 : 1));
+    }
+    CHECK(timer_dead(ctx) == 0);
+
+    /* 继续删除，墓碑超过有效定时器的1/4时压缩，timer_dead下降 */
+    unsigned peak = 0;
+    bool compacted = false;
+    for(i = 20; i < 420; i++)
+    {
+        CHECK(timer_del(ctx, ids[i]) == 0);
+        deleted[i] = true;
+        unsigned dead = timer_dead(ctx);
+        if(dead < peak)
+        {
+            compacted = true;
+        }
+        peak = dead;
+        CHECK(dead * 4 <= timer_count(ctx) + 4 || dead < 64);
+    }
+    CHECK(compacted);
+    for(i = 20; i < 420; i++)
+    {
+        CHECK(timer_del(ctx, ids[i]) == -1);
+    }
+
+    /* 主动压缩回收剩下的墓碑 */
+    unsigned dead = timer_dead(ctx);
+    CHECK(timer_compact(ctx) == dead);
+    CHECK(timer_dead(ctx) == 0);
+    CHECK(timer_count(ctx) == LAZY_TIMERS - 420);
+
+    /* 之后删除的墓碑同样不会执行，其余的定时器各执行一次 */
+    for(i = 500; i < 600; i++)
+    {
+        CHECK(timer_del(ctx, ids[i]) == 0);
+        deleted[i] = true;
+    }
+    timer_tick(ctx, 1000 + LAZY_TIMERS);
+    for(i = 0; i < LAZY_TIMERS; i++)
+    {
+        CHECK(hits[i] == (deleted[i] ? 0 : 1));
+    }
+    CHECK(timer_count(ctx) == 0);
+    CHECK(timer_dead(ctx) == 0);
+    timer_ctx_free(ctx);
+}
+
+int main()
+{
+    unsigned i;
+    for(i = 0; i < sizeof(flags_list) / sizeof(flags_list[0]); i++)
+    {
+        test_stale_handle(flags_list[i]);
+        test_recycle_many(flags_list[i]);
+        test_periodic_slack(flags_list[i]);
+    }
+    test_lazy_delete();
+    printf("test_timer: ok\n");
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Description: 时间轮的测试：槽数加倍或减半之后的迁移要经过多次add_timer和tick()
+ *              才能完成，迁移进行到一半时旧槽数组和新槽数组同时使用。这期间添加、
+ *              删除和到期的每个定时器都要恰好执行一次，并且在它到期的那个滴答执行。
+ *              失败时输出所在的行号并返回1，make test 运行
+ * Author:      Denny
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "wheel_timer.h"
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if(!(cond))                                                         \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while(0)
+
+#define TIMERS  4000
+
+static struct client_data users[TIMERS];
+static struct wheel_timer *timers[TIMERS];
+static long expect[TIMERS];             /* 应该在第几个滴答执行 */
+static int hits[TIMERS];
+static bool deleted[TIMERS];
+
+static void on_expire(struct client_data *user)
+{
+    long i = user - users;
+    CHECK(i >= 0 && i < TIMERS);
+    CHECK(wh.now == expect[i]);
+    hits[i]++;
+    timers[i] = NULL;
+}
+
+static void add(long i, int timeout)
+{
+    struct wheel_timer *timer = add_timer(timeout);
+    CHECK(timer != NULL);
+    timer->cb_func = on_expire;
+    timer->user_data = &users[i];
+    timers[i] = timer;
+    expect[i] = timer->expire;
+    CHECK(expect[i] == wh.now + (timeout < SI ? 1 : timeout / SI));
+}
+
+/* 转动一个滴答，返回转动时正在迁移的旧槽数组的槽数，没有迁移时返回0 */
+static unsigned step(void)
+{
+    unsigned old_nslots = wh.old_slots != NULL ? wh.old_nslots : 0;
+    tick();
+    return old_nslots;
+}
+
+int main()
+{
+    long i, added = 0;
+    unsigned resizes;
+    int ticks_migrating = 0;
+
+    init_wheel();
+
+    /* 定时器超过槽数的WHEEL_MAX_LOAD倍时加倍，加倍之后边转动边继续添加 */
+    while(wh.resizes == 0)
+    {
+        add(added, (int)(added % 300 + 1) * SI);
+        added++;
+    }
+    CHECK(wh.old_slots != NULL);
+    while(wh.old_slots != NULL)
+    {
+        add(added, (int)(added % 300 + 1) * SI);
+        added++;
+        /* 正在迁移时删除一部分，可能在旧数组也可能在新数组中 */
+        if(added % 7 == 0)
+        {
+            long k = added / 2;
+            if(timers[k] != NULL && !deleted[k])
+            {
+                del_timer(timers[k]);
+                timers[k] = NULL;
+                deleted[k] = true;
+            }
+        }
+        if(step() > 0)
+        {
+            ticks_migrating++;
+        }
+    }
+    CHECK(ticks_migrating > 0);
+
+    /* 再多添加一些，让槽数继续加倍 */
+    resizes = wh.resizes;
+    while(added < TIMERS && wh.resizes == resizes)
+    {
+        add(added, (int)(added % 500 + 1) * SI);
+        added++;
+    }
+    CHECK(wh.resizes > resizes);
+    CHECK(wh.nslots > N * 2);
+
+    /* 定时器逐渐到期，数量少于槽数的一半时减半，减半的迁移同样边转动边进行 */
+    resizes = wh.resizes;
+    int shrink_ticks = 0;
+    while(wh.count > 0)
+    {
+        unsigned nslots = wh.nslots;
+        if(step() > nslots)
+        {
+            shrink_ticks++;
+        }
+    }
+    CHECK(wh.resizes > resizes);
+    CHECK(shrink_ticks > 0);
+
+    for(i = 0; i < added; i++)
+    {
+        CHECK(hits[i] == (deleted[i] ? 0 : 1));
+    }
+    CHECK(wh.count == 0);
+
+    printf("test_wheel: ok, %ld timers, %u resizes\n", added, wh.resizes);
+    return 0;
+}
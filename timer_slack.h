@@ -0,0 +1,27 @@
+#ifndef __TIMER_SLACK_H__
+#define __TIMER_SLACK_H__
+
+/*
+ * 定时器的松弛量（slack），与Linux的timer slack（apply_slack）相同：允许定时器
+ * 最多推迟slack到期，找出expire和expire + slack从高到低第一个不同的位，把
+ * expire + slack在这一位以下的位全部清零作为实际的超时值，结果落在
+ * [expire, expire + slack]中，但不一定是其中低位0最多的那个，例如
+ * timer_coalesce(4, 3)为6。这样超时值相近的定时器会落到同一个时间点上一起到期，
+ * 减少唤醒次数；超时值稍有变化时折合的结果往往不变，调整定时器也就什么都
+ * 不用做。slack为0时不折合
+ */
+static inline long timer_coalesce(long expire, long slack)
+{
+    if(slack <= 0 || expire < 0)
+    {
+        return expire;
+    }
+
+    unsigned long limit = (unsigned long)expire + (unsigned long)slack;
+    unsigned long diff = (unsigned long)expire ^ limit;
+    /* 清掉最高的不同位以下的所有位，结果仍不小于expire */
+    int bit = (int)(sizeof(long) * 8) - 1 - __builtin_clzl(diff);
+    return (long)(limit & ~((1UL << bit) - 1));
+}
+
+#endif
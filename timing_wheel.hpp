@@ -0,0 +1,509 @@
+#ifndef __TIMING_WHEEL_HPP__
+#define __TIMING_WHEEL_HPP__
+
+/*
+ * Description: 头文件实现的时间轮模板。槽数Slots和槽间隔Granularity是编译期常量，
+ *              槽数必须是2的幂，槽下标用掩码计算；回调类型Callback是模板参数，
+ *              每个定时器保存一个回调对象（函数对象或lambda），到期时直接调用，
+ *              编译器可以内联，不经过函数指针、虚函数或std::function。
+ *              节点数组的分配器Allocator可以换成arena_allocator（见arena.hpp），
+ *              让节点放在本线程NUMA节点的大页上
+ * Author:      Denny
+ *
+ * */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <std::size_t Slots, std::uint64_t Granularity, typename Callback,
+          typename Allocator = std::allocator<Callback>>
+class timing_wheel
+{
+    static_assert(Slots > 0 && (Slots & (Slots - 1)) == 0, "Slots must be a power of two");
+    static_assert(Slots <= 0xffffffffu, "too many slots");
+    static_assert(Granularity > 0, "Granularity must be positive");
+
+public:
+    static constexpr std::size_t slots = Slots;               /* 时间轮上槽的数目 */
+    static constexpr std::uint64_t granularity = Granularity; /* 槽间隔 */
+
+    /*
+     * 定时器句柄，只能移动不能复制。句柄析构时如果定时器还没有到期就取消它，
+     * 不需要取消的定时器调用release()放弃句柄。定时器到期之后句柄自动失效，
+     * 对失效句柄的操作什么也不做
+     */
+    class handle
+    {
+    public:
+        handle() noexcept = default;
+        handle(handle &&other) noexcept : wheel_(other.wheel_), id_(other.id_)
+        {
+            other.wheel_ = nullptr;
+        }
+        handle &operator=(handle &&other) noexcept
+        {
+            if(this != &other)
+            {
+                cancel();
+                wheel_ = other.wheel_;
+                id_ = other.id_;
+                other.wheel_ = nullptr;
+            }
+            return *this;
+        }
+        handle(const handle &) = delete;
+        handle &operator=(const handle &) = delete;
+        ~handle()
+        {
+            cancel();
+        }
+
+        /* 定时器是否还在等待到期 */
+        bool active() const noexcept
+        {
+            return wheel_ && wheel_->valid(id_);
+        }
+
+        /* 取消定时器，返回false表示定时器已经到期或已被取消 */
+        bool cancel() noexcept
+        {
+            bool ret = wheel_ && wheel_->cancel_id(id_);
+            wheel_ = nullptr;
+            return ret;
+        }
+
+        /* 重新设置超时值，返回false表示定时器已经到期或已被取消 */
+        bool reschedule(std::uint64_t timeout) noexcept
+        {
+            return wheel_ && wheel_->reschedule_id(id_, timeout);
+        }
+
+        /* 放弃句柄，定时器照常到期 */
+        void release() noexcept
+        {
+            wheel_ = nullptr;
+        }
+
+    private:
+        friend class timing_wheel;
+        handle(timing_wheel *wheel, std::uint64_t id) noexcept : wheel_(wheel), id_(id) {}
+
+        timing_wheel *wheel_ = nullptr;
+        std::uint64_t id_ = 0;          /* 高32位为节点的代数，低32位为节点下标 */
+    };
+
+    timing_wheel() : timing_wheel(0)
+    {
+    }
+
+    /* reserve为预计的定时器数目，提前分配节点避免运行中扩容 */
+    explicit timing_wheel(std::size_t reserve, const Allocator &alloc = Allocator())
+        : nodes_(node_allocator(alloc))
+    {
+        heads_.fill(nil);
+        nodes_.reserve(reserve);
+    }
+
+    /* 句柄中保存了时间轮的地址，时间轮不能复制和移动 */
+    timing_wheel(const timing_wheel &) = delete;
+    timing_wheel &operator=(const timing_wheel &) = delete;
+
+    /*
+     * 添加一个timeout之后到期的定时器。与C版本相同，超时值小于槽间隔时向上折合为
+     * 1个滴答，否则向下折合为timeout / Granularity个滴答
+     */
+    [[nodiscard]] handle add(std::uint64_t timeout, Callback cb)
+    {
+        std::uint32_t i = alloc();
+        node &n = nodes_[i];
+        n.cb.emplace(std::move(cb));
+        n.expire = now_ + ticks(timeout);
+        link(i);
+        return handle(this, make_id(i));
+    }
+
+    /*
+     * 时间轮向前滚动一个槽的间隔，执行当前槽上到期的定时任务，返回执行的任务数。
+     * 到期的定时器先从槽上摘下来再逐个执行，回调中可以添加定时器，也可以取消
+     * 同一批中尚未执行的定时器
+     */
+    std::size_t tick()
+    {
+        std::uint32_t i = heads_[now_ & mask];
+        while(i != nil)
+        {
+            node &n = nodes_[i];
+            std::uint32_t next = n.next;
+            if(n.expire <= now_)
+            {
+                unlink(i);
+                n.expiring = true;
+                push_front(&expiring_, i);
+            }
+            i = next;
+        }
+
+        std::size_t fired = 0;
+        while(expiring_ != nil)
+        {
+            i = expiring_;
+            unlink(i);
+            Callback cb(std::move(*nodes_[i].cb));
+            release(i);
+            cb();
+            fired++;
+        }
+        now_++;
+        return fired;
+    }
+
+    /* 时间轮已经转动的滴答数 */
+    std::uint64_t now() const noexcept
+    {
+        return now_;
+    }
+
+    /* 尚未到期的定时器数目 */
+    std::size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    bool empty() const noexcept
+    {
+        return size_ == 0;
+    }
+
+private:
+    static constexpr std::uint32_t nil = 0xffffffffu;
+    static constexpr std::uint64_t mask = Slots - 1;
+
+    struct node
+    {
+        std::uint64_t expire = 0;       /* 到期时的滴答数 */
+        std::uint32_t prev = nil;
+        std::uint32_t next = nil;       /* 空闲节点用它串成空闲链表 */
+        std::uint32_t gen = 0;          /* 节点的代数，节点每释放一次加1 */
+        bool expiring = false;          /* 已从槽上摘下，等待执行 */
+        std::optional<Callback> cb;     /* 节点空闲时为空 */
+    };
+
+    static constexpr std::uint64_t ticks(std::uint64_t timeout) noexcept
+    {
+        return timeout < Granularity ? 1 : timeout / Granularity;
+    }
+
+    std::uint64_t make_id(std::uint32_t i) const noexcept
+    {
+        return (static_cast<std::uint64_t>(nodes_[i].gen) << 32) | i;
+    }
+
+    /* 句柄对应的节点下标，句柄已失效时返回nil */
+    std::uint32_t id_index(std::uint64_t id) const noexcept
+    {
+        std::uint32_t i = static_cast<std::uint32_t>(id);
+        if(i >= nodes_.size() || !nodes_[i].cb || nodes_[i].gen != static_cast<std::uint32_t>(id >> 32))
+        {
+            return nil;
+        }
+        return i;
+    }
+
+    bool valid(std::uint64_t id) const noexcept
+    {
+        return id_index(id) != nil;
+    }
+
+    bool cancel_id(std::uint64_t id) noexcept
+    {
+        std::uint32_t i = id_index(id);
+        if(i == nil)
+        {
+            return false;
+        }
+        unlink(i);
+        release(i);
+        return true;
+    }
+
+    bool reschedule_id(std::uint64_t id, std::uint64_t timeout) noexcept
+    {
+        std::uint32_t i = id_index(id);
+        if(i == nil)
+        {
+            return false;
+        }
+        unlink(i);
+        nodes_[i].expiring = false;
+        nodes_[i].expire = now_ + ticks(timeout);
+        link(i);
+        return true;
+    }
+
+    std::uint32_t alloc()
+    {
+        std::uint32_t i = free_;
+        if(i != nil)
+        {
+            free_ = nodes_[i].next;
+        }
+        else
+        {
+            i = static_cast<std::uint32_t>(nodes_.size());
+            nodes_.emplace_back();
+        }
+        nodes_[i].expiring = false;
+        size_++;
+        return i;
+    }
+
+    void release(std::uint32_t i) noexcept
+    {
+        node &n = nodes_[i];
+        n.cb.reset();
+        n.gen++;
+        n.next = free_;
+        free_ = i;
+        size_--;
+    }
+
+    /* 节点所在链表的头指针：等待执行的链表或者所在的槽 */
+    std::uint32_t *list_of(std::uint32_t i) noexcept
+    {
+        return nodes_[i].expiring ? &expiring_ : &heads_[nodes_[i].expire & mask];
+    }
+
+    void push_front(std::uint32_t *head, std::uint32_t i) noexcept
+    {
+        node &n = nodes_[i];
+        n.prev = nil;
+        n.next = *head;
+        if(*head != nil)
+        {
+            nodes_[*head].prev = i;
+        }
+        *head = i;
+    }
+
+    /* 槽上的链表无序，新定时器插入到链表头部 */
+    void link(std::uint32_t i) noexcept
+    {
+        push_front(list_of(i), i);
+    }
+
+    void unlink(std::uint32_t i) noexcept
+    {
+        node &n = nodes_[i];
+        if(n.prev == nil)
+        {
+            *list_of(i) = n.next;
+        }
+        else
+        {
+            nodes_[n.prev].next = n.next;
+        }
+        if(n.next != nil)
+        {
+            nodes_[n.next].prev = n.prev;
+        }
+        n.prev = n.next = nil;
+    }
+
+    using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<node>;
+
+    std::array<std::uint32_t, Slots> heads_;    /* 每个槽上定时器链表的头节点 */
+    std::vector<node, node_allocator> nodes_;   /* 所有定时器节点，链表通过下标连接 */
+    std::uint32_t free_ = nil;                  /* 空闲节点链表 */
+    std::uint32_t expiring_ = nil;              /* 本次滴答到期、等待执行的定时器 */
+    std::uint64_t now_ = 0;
+    std::size_t size_ = 0;
+};
+
+/*
+ * 侵入式时间轮的链表节点，嵌入到使用者自己的对象中（例如协程帧中的awaiter），
+ * 时间轮本身不分配任何内存。节点在链表上时不能移动或复制
+ */
+struct wheel_hook
+{
+    wheel_hook *prev = nullptr;
+    wheel_hook *next = nullptr;
+    std::uint64_t expire = 0;           /* 到期时的滴答数 */
+    bool linked = false;                /* 在某个槽上，或者已到期等待执行 */
+    bool expiring = false;              /* 已从槽上摘下，等待执行 */
+};
+
+/*
+ * 侵入式时间轮：定时器节点Hook由使用者提供（须继承wheel_hook），到期时调用
+ * Fire(Hook &)。槽数、槽间隔和到期动作同样是编译期确定的
+ */
+template <std::size_t Slots, std::uint64_t Granularity, typename Hook, typename Fire>
+class intrusive_timing_wheel
+{
+    static_assert(Slots > 0 && (Slots & (Slots - 1)) == 0, "Slots must be a power of two");
+    static_assert(Granularity > 0, "Granularity must be positive");
+    static_assert(std::is_base_of<wheel_hook, Hook>::value, "Hook must derive from wheel_hook");
+
+public:
+    static constexpr std::size_t slots = Slots;
+    static constexpr std::uint64_t granularity = Granularity;
+
+    explicit intrusive_timing_wheel(Fire fire = Fire()) : fire_(std::move(fire))
+    {
+        heads_.fill(nullptr);
+    }
+
+    intrusive_timing_wheel(const intrusive_timing_wheel &) = delete;
+    intrusive_timing_wheel &operator=(const intrusive_timing_wheel &) = delete;
+
+    /* 添加定时器，节点已经在时间轮上时重新设置它的超时值 */
+    void add(Hook &hook, std::uint64_t timeout) noexcept
+    {
+        wheel_hook *h = &hook;
+        if(h->linked)
+        {
+            unlink(h);
+        }
+        else
+        {
+            size_++;
+        }
+        h->expiring = false;
+        h->expire = now_ + (timeout < Granularity ? 1 : timeout / Granularity);
+        h->linked = true;
+        push_front(&heads_[h->expire & mask], h);
+    }
+
+    /* 取消定时器，返回false表示定时器已经到期或者没有添加过 */
+    bool cancel(Hook &hook) noexcept
+    {
+        wheel_hook *h = &hook;
+        if(!h->linked)
+        {
+            return false;
+        }
+        unlink(h);
+        h->linked = false;
+        size_--;
+        return true;
+    }
+
+    /*
+     * 时间轮向前滚动一个槽的间隔，执行到期的定时任务，返回执行的任务数。
+     * 节点在执行之前已经从时间轮上摘下，到期动作中可以重新添加它，也可以
+     * 销毁它所在的对象
+     */
+    std::size_t tick()
+    {
+        wheel_hook *h = heads_[now_ & mask];
+        while(h)
+        {
+            wheel_hook *next = h->next;
+            if(h->expire <= now_)
+            {
+                unlink(h);
+                h->expiring = true;
+                push_front(&expiring_, h);
+            }
+            h = next;
+        }
+
+        std::size_t fired = 0;
+        while(expiring_)
+        {
+            h = expiring_;
+            unlink(h);
+            h->linked = false;
+            size_--;
+            fire_(static_cast<Hook &>(*h));
+            fired++;
+        }
+        now_++;
+        return fired;
+    }
+
+    std::uint64_t now() const noexcept
+    {
+        return now_;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    bool empty() const noexcept
+    {
+        return size_ == 0;
+    }
+
+    /*
+     * 从当前槽开始，到下一个非空槽之间的滴答数（当前槽非空时为0），没有定时器时
+     * 返回std::nullopt。槽上的定时器可能属于之后的轮次，所以这是下一次需要滴答的
+     * 最早时间，不一定有定时器到期
+     */
+    std::optional<std::uint64_t> next_busy() const noexcept
+    {
+        if(size_ == 0)
+        {
+            return std::nullopt;
+        }
+        for(std::uint64_t k = 0; k < Slots; k++)
+        {
+            if(heads_[(now_ + k) & mask])
+            {
+                return k;
+            }
+        }
+        return std::nullopt;
+    }
+
+private:
+    static constexpr std::uint64_t mask = Slots - 1;
+
+    wheel_hook **list_of(wheel_hook *h) noexcept
+    {
+        return h->expiring ? &expiring_ : &heads_[h->expire & mask];
+    }
+
+    static void push_front(wheel_hook **head, wheel_hook *h) noexcept
+    {
+        h->prev = nullptr;
+        h->next = *head;
+        if(*head)
+        {
+            (*head)->prev = h;
+        }
+        *head = h;
+    }
+
+    void unlink(wheel_hook *h) noexcept
+    {
+        if(h->prev)
+        {
+            h->prev->next = h->next;
+        }
+        else
+        {
+            *list_of(h) = h->next;
+        }
+        if(h->next)
+        {
+            h->next->prev = h->prev;
+        }
+        h->prev = h->next = nullptr;
+    }
+
+    std::array<wheel_hook *, Slots> heads_;
+    wheel_hook *expiring_ = nullptr;
+    std::uint64_t now_ = 0;
+    std::size_t size_ = 0;
+    Fire fire_;
+};
+
+#endif
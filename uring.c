@@ -0,0 +1,445 @@
+/*
+ * Description: io_uring的最小封装：建立提交/完成队列的共享内存映射、批量提交、
+ *              注册供多次触发recv使用的缓冲区环，以及服务器用到的几种sqe的填写
+ * Author:      Denny
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* 建立io_uring实例，完成队列是提交队列的4倍，减少完成事件溢出，失败返回-errno */
+int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    r->fd = sys_uring_setup(entries, &p);
+    if(r->fd < 0)
+    {
+        return -errno;
+    }
+    r->features = p.features;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(r->cq_size > r->sq_size)
+        {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ptr == MAP_FAILED)
+    {
+        goto err;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else
+    {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_ptr == MAP_FAILED)
+        {
+            r->cq_ptr = NULL;
+            goto err;
+        }
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+    {
+        r->sqes = NULL;
+        goto err;
+    }
+
+    char *sq = (char *)r->sq_ptr;
+    char *cq = (char *)r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* sq数组与sqe一一对应，之后只需要移动tail */
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    unsigned i;
+    for(i = 0; i < p.sq_entries; i++)
+    {
+        array[i] = i;
+    }
+    r->sqe_tail = *r->sq_tail;
+    return 0;
+
+err:
+    {
+        int err = -errno;
+        uring_exit(r);
+        return err;
+    }
+}
+
+void uring_exit(struct uring *r)
+{
+    if(r->sqes)
+    {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if(r->cq_ptr && r->cq_ptr != r->sq_ptr)
+    {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    if(r->sq_ptr && r->sq_ptr != MAP_FAILED)
+    {
+        munmap(r->sq_ptr, r->sq_size);
+    }
+    if(r->fd >= 0)
+    {
+        close(r->fd);
+    }
+    free(r->backlog);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static unsigned sq_space(struct uring *r)
+{
+    return r->sq_entries - (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/* 从第i个开始的一条链接链（带IOSQE_IO_LINK的sqe连同其后的一个）的长度 */
+static unsigned chain_len(struct io_uring_sqe *sqes, unsigned i, unsigned n)
+{
+    unsigned len = 1;
+    while(i + len - 1 < n - 1 && (sqes[i + len - 1].flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK)))
+    {
+        len++;
+    }
+    return len;
+}
+
+/* 把积压的sqe按顺序搬进提交队列，一条链接链放不下时整条留在积压数组中 */
+static void flush_backlog(struct uring *r)
+{
+    unsigned i = 0;
+    while(i < r->backlog_len)
+    {
+        unsigned len = chain_len(r->backlog, i, r->backlog_len);
+        if(sq_space(r) < len)
+        {
+            break;
+        }
+        unsigned k;
+        for(k = 0; k < len; k++)
+        {
+            r->sqes[r->sqe_tail & r->sq_mask] = r->backlog[i + k];
+            r->sqe_tail++;
+        }
+        i += len;
+    }
+    if(i > 0)
+    {
+        memmove(r->backlog, r->backlog + i, (r->backlog_len - i) * sizeof(struct io_uring_sqe));
+        r->backlog_len -= i;
+    }
+}
+
+/*
+ * 预定接下来的n个sqe，它们会放在同一处：都在提交队列中，或者都在积压数组中，
+ * 链接的请求不会被拆到两次提交里。提交队列空间不够时先提交一次
+ */
+void uring_reserve(struct uring *r, unsigned n)
+{
+    r->reserved = 0;
+    flush_backlog(r);
+    if(r->backlog_len > 0 || sq_space(r) < n)
+    {
+        uring_submit(r);
+    }
+    r->reserved = n;
+    r->reserve_backlog = r->backlog_len > 0 || sq_space(r) < n;
+}
+
+/*
+ * 获取一个空闲的sqe。提交队列已满时先把已填写的sqe提交给内核，仍然没有空位时
+ * 返回积压数组中的一项，只有内存不足时返回NULL
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+    if(r->reserved == 0)
+    {
+        uring_reserve(r, 1);
+    }
+    r->reserved--;
+    if(r->reserve_backlog)
+    {
+        if(r->backlog_len == r->backlog_cap)
+        {
+            unsigned cap = r->backlog_cap ? r->backlog_cap * 2 : r->sq_entries;
+            sqe = (struct io_uring_sqe *)realloc(r->backlog, cap * sizeof(struct io_uring_sqe));
+            if(!sqe)
+            {
+                r->reserved = 0;
+                return NULL;
+            }
+            r->backlog = sqe;
+            r->backlog_cap = cap;
+        }
+        sqe = &r->backlog[r->backlog_len++];
+    }
+    else
+    {
+        sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+        r->sqe_tail++;
+    }
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* 提交所有已填写的sqe，并等待至少wait_nr个完成事件 */
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr)
+{
+    /* 还有预定的sqe没有取走时不能搬动积压数组，否则链接链会被拆开 */
+    if(r->backlog_len > 0 && r->reserved == 0)
+    {
+        flush_backlog(r);
+    }
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+    int ret;
+    do
+    {
+        /* 内核尚未取走的sqe都需要提交，包括上次被打断而没有提交的 */
+        unsigned to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if(to_submit == 0 && wait_nr == 0)
+        {
+            return 0;
+        }
+        r->enter_calls++;
+        ret = sys_uring_enter(r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while(ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+int uring_submit(struct uring *r)
+{
+    return uring_submit_and_wait(r, 0);
+}
+
+/* 取下一个完成事件，没有则返回NULL */
+struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    if(head == tail)
+    {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+    r->cqe_count++;
+}
+
+/* 分配entries个大小为buf_size的缓冲区，并以bgid注册到内核 */
+int uring_buf_ring_init(struct uring *r, struct uring_buf_ring *b, unsigned short bgid,
+                        unsigned entries, unsigned buf_size)
+{
+    size_t ring_size = entries * sizeof(struct io_uring_buf);
+
+    memset(b, 0, sizeof(*b));
+    b->br = (struct io_uring_buf_ring *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                                             MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(b->br == MAP_FAILED)
+    {
+        b->br = NULL;
+        return -errno;
+    }
+    b->bufs = (char *)malloc((size_t)entries * buf_size);
+    if(!b->bufs)
+    {
+        munmap(b->br, ring_size);
+        b->br = NULL;
+        return -ENOMEM;
+    }
+    b->entries = entries;
+    b->buf_size = buf_size;
+    b->bgid = bgid;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)b->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if(sys_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int err = -errno;
+        free(b->bufs);
+        munmap(b->br, ring_size);
+        memset(b, 0, sizeof(*b));
+        return err;
+    }
+
+    unsigned short i;
+    for(i = 0; i < entries; i++)
+    {
+        uring_buf_recycle(b, i);
+    }
+    return 0;
+}
+
+void uring_buf_ring_exit(struct uring *r, struct uring_buf_ring *b)
+{
+    if(!b->br)
+    {
+        return;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->bgid;
+    sys_uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(b->br, b->entries * sizeof(struct io_uring_buf));
+    free(b->bufs);
+    memset(b, 0, sizeof(*b));
+}
+
+char *uring_buf_get(struct uring_buf_ring *b, unsigned short bid)
+{
+    return b->bufs + (size_t)bid * b->buf_size;
+}
+
+/* 把用完的缓冲区还给内核 */
+void uring_buf_recycle(struct uring_buf_ring *b, unsigned short bid)
+{
+    unsigned short tail = b->br->tail;
+    struct io_uring_buf *buf = &b->br->bufs[tail & (b->entries - 1)];
+    buf->addr = (unsigned long)uring_buf_get(b, bid);
+    buf->len = b->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&b->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+/* 多次触发的accept：一个sqe持续产生新连接，直到完成事件中不再带有IORING_CQE_F_MORE */
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = data;
+}
+
+/* 从缓冲区组bgid中挑选缓冲区的recv，multishot不为0时持续接收 */
+void uring_prep_recv_select(struct io_uring_sqe *sqe, int fd, unsigned short bgid,
+                            int multishot, unsigned long long data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = data;
+}
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len,
+                     unsigned long long data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = data;
+}
+
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                        unsigned flags, unsigned long long data)
+{
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+    sqe->timeout_flags = flags;
+    sqe->user_data = data;
+}
+
+/* 与前一个带IOSQE_IO_LINK的sqe关联的超时，超时后前一个请求以-ECANCELED结束 */
+void uring_prep_link_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                             unsigned long long data)
+{
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+    sqe->user_data = data;
+}
+
+/* 单次的poll请求，mask为POLLIN/POLLOUT等事件 */
+void uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned mask, unsigned long long data)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data = data;
+}
+
+/* 取消user_data为target的请求 */
+void uring_prep_cancel(struct io_uring_sqe *sqe, unsigned long long target, unsigned long long data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = data;
+}
+
+/* 取消ring中所有未完成的请求，完成事件的res为取消的请求数（需要5.19以上的内核） */
+void uring_prep_cancel_all(struct io_uring_sqe *sqe, unsigned long long data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = data;
+}
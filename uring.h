@@ -0,0 +1,94 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+/* 较老的内核头文件中没有多次触发的超时 */
+#ifndef IORING_TIMEOUT_MULTISHOT
+#define IORING_TIMEOUT_MULTISHOT    (1U << 6)
+#endif
+/* 较老的内核头文件中没有取消全部请求的选项 */
+#ifndef IORING_ASYNC_CANCEL_ANY
+#define IORING_ASYNC_CANCEL_ALL     (1U << 0)
+#define IORING_ASYNC_CANCEL_ANY     (1U << 2)
+#endif
+
+/* 直接基于系统调用和共享内存的io_uring，不依赖liburing */
+struct uring{
+    int fd;
+    unsigned features;
+
+    /* 提交队列 */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;                  /* 本地已填写的sqe位置 */
+
+    /*
+     * 提交队列已满、内核又暂时不接受提交（如完成队列积压时返回-EBUSY）时，新的sqe
+     * 先放在积压数组中，之后提交时按顺序搬进提交队列。reserved是uring_reserve
+     * 预定的、还没有取走的sqe数，它们和之前的sqe放在同一处
+     */
+    struct io_uring_sqe *backlog;
+    unsigned backlog_len;
+    unsigned backlog_cap;
+    unsigned reserved;
+    int reserve_backlog;
+
+    /* 完成队列 */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+
+    unsigned long enter_calls;          /* io_uring_enter系统调用次数 */
+    unsigned long cqe_count;            /* 处理过的完成事件数 */
+};
+
+/* 注册到内核的缓冲区环，多次触发的recv从中挑选缓冲区 */
+struct uring_buf_ring{
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned entries;
+    unsigned buf_size;
+    unsigned short bgid;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+void uring_reserve(struct uring *r, unsigned n);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit(struct uring *r);
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+int uring_buf_ring_init(struct uring *r, struct uring_buf_ring *b, unsigned short bgid,
+                        unsigned entries, unsigned buf_size);
+void uring_buf_ring_exit(struct uring *r, struct uring_buf_ring *b);
+char *uring_buf_get(struct uring_buf_ring *b, unsigned short bid);
+void uring_buf_recycle(struct uring_buf_ring *b, unsigned short bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long data);
+void uring_prep_recv_select(struct io_uring_sqe *sqe, int fd, unsigned short bgid,
+                            int multishot, unsigned long long data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len,
+                     unsigned long long data);
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                        unsigned flags, unsigned long long data);
+void uring_prep_link_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                             unsigned long long data);
+void uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned mask, unsigned long long data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, unsigned long long target, unsigned long long data);
+void uring_prep_cancel_all(struct io_uring_sqe *sqe, unsigned long long data);
+
+#endif
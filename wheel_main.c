@@ -0,0 +1,20 @@
+/*
+ * Description: 时间轮定时器的示例程序
+ * Author:      Denny
+ * 
+ * */
+
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "wheel_timer.h"
+#include "log.h"
+
+int main(int argc, char *argv[])
+{
+    log_init(STDOUT_FILENO);
+    init_wheel();
+
+    log_exit();
+    return 0;
+}
@@ -16,19 +16,191 @@
 #include <arpa/inet.h>
 
 #include "wheel_timer.h"
+#include "timer_slack.h"
+#include "arena.h"
+#include "log.h"
+
+struct wheel wh;
+
+#define WHEEL_MAX_LOAD      8       /* 平均每个槽的定时器超过这么多时槽数加倍 */
+#define WHEEL_MAX_CHAIN     64      /* tick()遍历的链表超过这么长、平均每槽多于2个定时器时槽数加倍 */
+#define WHEEL_REHASH_STEP   4       /* 每次add_timer迁移的定时器数，迁移要先于下一次加倍完成 */
+#define WHEEL_REHASH_TICK   64      /* 每次tick()迁移的定时器数 */
 
 void init_wheel()
 {
-    int i;
-    wh.cur_slot = 0;
-    for(i = 0; i < N; i++)
+    init_wheel_arena(NULL);
+}
+
+/* 定时器节点和槽数组从arena分配，a为NULL时使用malloc */
+void init_wheel_arena(struct arena *a)
+{
+    arena_dealloc(wh.arena, wh.slots, wh.nslots * sizeof(struct wheel_timer *));
+    arena_dealloc(wh.arena, wh.old_slots, wh.old_nslots * sizeof(struct wheel_timer *));
+    wh.arena = a;
+    wh.slots = (struct wheel_timer **)arena_calloc(a, N * sizeof(struct wheel_timer *));
+    wh.nslots = N;
+    wh.mask = N - 1;
+    wh.old_slots = NULL;
+    wh.old_nslots = 0;
+    wh.migrate = 0;
+    wh.count = 0;
+    wh.longest = 0;
+    wh.resizes = 0;
+    wh.now = 0;
+    wh.running = NULL;
+}
+
+/* 把定时器插入当前槽数组中它的超时值对应的槽 */
+static void link_timer(struct wheel_timer *timer)
+{
+    int ts = (int)(timer->expire & wh.mask);
+    timer->time_slot = ts;
+    timer->prev = NULL;
+    timer->next = NULL;
+
+    /*
+     * 如果第ts个槽上尚无任何定时器，则把定时器插入其中
+     * 并将该定时器设置为该槽的头结点
+     */
+    if( wh.slots[ts] == NULL )
+    {
+        LOG_DEBUG("add timer, expire is %ld, ts is %d, now is %ld", timer->expire, ts, wh.now);
+        wh.slots[ts] = timer;
+    }
+    /* 在第ts个槽中插入定时器 */
+    else
+    {
+        timer->next = wh.slots[ts];
+        wh.slots[ts]->prev = timer;
+        wh.slots[ts] = timer;
+    }
+}
+
+/*
+ * 把定时器从它所在的槽中取出，它可能还在正在迁移的旧槽数组中。槽数减半之后，
+ * 旧数组中的定时器的槽号可能超出当前数组的范围，这时它一定是旧数组中的头结点
+ */
+static void unlink_timer(struct wheel_timer *timer)
+{
+    unsigned ts = (unsigned)timer->time_slot;
+
+    /* 没有前一个节点的定时器是所在槽的头结点，需要重置该槽的头结点 */
+    if(timer->prev != NULL)
+    {
+        timer->prev->next = timer->next;
+    }
+    else if(ts < wh.nslots && timer == wh.slots[ts])
+    {
+        wh.slots[ts] = timer->next;
+    }
+    else
+    {
+        wh.old_slots[ts] = timer->next;
+    }
+    /* 如果不是最后一个节点 */
+    if(timer->next != NULL)
+    {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+/* 把旧槽数组第i个槽上的定时器全部迁移到当前槽数组 */
+static unsigned migrate_slot(unsigned i)
+{
+    unsigned moved = 0;
+    struct wheel_timer *timer;
+    while((timer = wh.old_slots[i]) != NULL)
+    {
+        unlink_timer(timer);
+        link_timer(timer);
+        moved++;
+    }
+    return moved;
+}
+
+/* 从旧槽数组中迁移大约step个定时器，空槽也算一次，全部迁移完后释放旧槽数组 */
+static void rehash(unsigned step)
+{
+    if(wh.old_slots == NULL)
+    {
+        return;
+    }
+    while(step > 0 && wh.migrate < wh.old_nslots)
+    {
+        struct wheel_timer *timer = wh.old_slots[wh.migrate];
+        if(timer == NULL)
+        {
+            wh.migrate++;
+            step--;
+            continue;
+        }
+        unlink_timer(timer);
+        link_timer(timer);
+        step--;
+    }
+    if(wh.migrate == wh.old_nslots)
+    {
+        arena_dealloc(wh.arena, wh.old_slots, wh.old_nslots * sizeof(struct wheel_timer *));
+        wh.old_slots = NULL;
+        wh.old_nslots = 0;
+        LOG_DEBUG("wheel rehash done, %u slots, %u timers", wh.nslots, wh.count);
+    }
+}
+
+/* 换成nslots个槽的数组，定时器留在旧数组中，之后逐步迁移 */
+static void resize(unsigned nslots)
+{
+    struct wheel_timer **slots = (struct wheel_timer **)arena_calloc(wh.arena, nslots * sizeof(struct wheel_timer *));
+    if(slots == NULL)
+    {
+        return;
+    }
+    LOG_DEBUG("wheel resize %u -> %u slots, %u timers, longest chain %u", wh.nslots, nslots, wh.count, wh.longest);
+    wh.old_slots = wh.slots;
+    wh.old_nslots = wh.nslots;
+    wh.migrate = 0;
+    wh.slots = slots;
+    wh.nslots = nslots;
+    wh.mask = nslots - 1;
+    wh.longest = 0;
+    wh.resizes++;
+}
+
+/*
+ * 根据负载因子和最长的链表决定是否改变槽数，上一次迁移没有完成时不改变。
+ * 回调函数执行期间也不改变，tick()正在遍历的链表不能被换到旧槽数组中
+ */
+static void check_resize()
+{
+    if(wh.old_slots != NULL || wh.running != NULL)
+    {
+        return;
+    }
+    if(wh.count > wh.nslots * WHEEL_MAX_LOAD
+       || (wh.longest > WHEEL_MAX_CHAIN && wh.count > wh.nslots * 2))
+    {
+        resize(wh.nslots * 2);
+    }
+    else if(wh.nslots > N && wh.count < wh.nslots / 2)
     {
-        wh.slots[i] = NULL;
+        resize(wh.nslots / 2);
     }
 }
 
 /* 根据定时值timeout创建一个定时器，并把它插入合适的槽中 */
 struct wheel_timer* add_timer(int timeout)
+{
+    return add_timer_slack(timeout, 0);
+}
+
+/*
+ * 创建允许推迟slack到期的定时器，到期的滴答数按slack折合，超时值相近的
+ * 定时器落到同一个滴答上，在同一次tick中一起执行。内存不足时返回NULL
+ */
+struct wheel_timer* add_timer_slack(int timeout, int slack)
 {
     if(timeout < 0)
     {
@@ -52,70 +224,71 @@ struct wheel_timer* add_timer(int timeout)
         ticks = timeout / SI;
     }
 
-    /* 待插入的定时器在时间轮转动多少圈之后被触发 */
-    int rotation = ticks / N;
-    /* 定时器应该被插入到哪个槽中 */
-    int ts = (wh.cur_slot + (ticks % N)) % N;
-    
-    /* 创建新的定时器，它在时间轮转动rotation圈之后被触发，且位于第ts个槽上 */
-    struct wheel_timer *timer = (struct wheel_timer *)malloc(sizeof(struct wheel_timer));
-    timer->rotation = rotation;
-    timer->time_slot = ts;
-
-    /*
-     * 如果第ts个槽上尚无任何定时器，则把新建的定时器插入其中
-     * 并将该定时器设置为该槽的头结点
-     */
-    if( wh.slots[ts] == NULL )
+    /* 创建新的定时器，它在时间轮转动到第now + ticks个滴答时被触发 */
+    struct wheel_timer *timer = (struct wheel_timer *)arena_alloc(wh.arena, sizeof(struct wheel_timer));
+    if(timer == NULL)
     {
-        printf("add timer, rotaion is %d, ts is %d, cur_slot is %d \n", rotation, ts, wh.cur_slot);
-        wh.slots[ts] = timer;
+        return NULL;
     }
-    /* 在第ts个槽中插入定时器 */
-    else
+    timer->expire = wh.now + ticks;
+    /* 折合的是绝对的滴答数，这样不同时刻添加的定时器也能对齐到相同的时间点 */
+    if(slack >= SI)
     {
-        timer->next = wh.slots[ts];
-        wh.slots[ts]->prev = timer;
-        wh.slots[ts] = timer;
+        timer->expire = timer_coalesce(timer->expire, slack / SI);
     }
+    timer->interval = 0;
+    timer->slack = slack;
+    timer->cancelled = 0;
+
+    rehash(WHEEL_REHASH_STEP);
+    link_timer(timer);
+    wh.count++;
+    check_resize();
+
+    return timer;
+}
 
+/*
+ * 创建每隔interval到期一次的周期定时器，第一次到期与add_timer(interval)相同。
+ * 到期后定时器节点直接挂到interval之后的槽上，不会释放和重新分配，直到调用
+ * del_timer删除它，回调函数中也可以删除。时间轮的时间由tick()的调用次数决定，
+ * 调用方补上错过的tick()时，错过的周期也会依次执行，不会漂移
+ */
+struct wheel_timer* add_periodic_timer(int interval)
+{
+    return add_periodic_timer_slack(interval, 0);
+}
+
+/* 允许推迟slack到期的周期定时器，每次重新挂入时都按slack折合到期的滴答数 */
+struct wheel_timer* add_periodic_timer_slack(int interval, int slack)
+{
+    if(interval <= 0)
+    {
+        return NULL;
+    }
+    struct wheel_timer *timer = add_timer_slack(interval, slack);
+    if(timer != NULL)
+    {
+        timer->interval = interval;
+    }
     return timer;
 }
 
+/* 删除定时器，正在执行回调函数的定时器在回调返回后由tick()释放 */
 void del_timer(struct wheel_timer *timer)
 {
     if(timer == NULL)
     {
         return;
     }
-    int ts = timer->time_slot;
-
-    /* slots[ts]是目标定时器所在槽的头结点，
-     * 如果目标定时器是该头结点，则需要重置
-     * 第ts个槽的头结点
-     * */
-    if(timer == wh.slots[ts])
+    if(timer == wh.running)
     {
-        wh.slots[ts] = wh.slots[ts]->next;
-        /* 不是只有一个节点 */
-        if(wh.slots[ts] != NULL)
-        {
-            wh.slots[ts]->prev = NULL;
-        }
-        free(timer);
-        timer = NULL;
-    }
-    /* 不是头结点的情况 */
-    else{
-        timer->prev->next = timer->next;
-        /* 如果不是最后一个节点 */
-        if(timer->next != NULL)
-        {
-            timer->next->prev = timer->prev;
-        }
-        free(timer);
-        timer = NULL;
+        timer->cancelled = 1;
+        return;
     }
+    unlink_timer(timer);
+    arena_dealloc(wh.arena, timer, sizeof(struct wheel_timer));
+    wh.count--;
 }
 
 /*
@@ -123,54 +296,58 @@ void del_timer(struct wheel_timer *timer)
  */
 void tick()
 {
-    struct wheel_timer *tmp = wh.slots[wh.cur_slot];   /* 时间轮当前槽的头结点 */
-    printf("The current slot is %d \n", wh.cur_slot);
+    unsigned walked = 0;
+
+    /* 正在迁移时先把旧槽数组中这个滴答对应的槽整个迁过来，再顺带迁移一部分 */
+    if(wh.old_slots != NULL)
+    {
+        migrate_slot((unsigned)(wh.now & (wh.old_nslots - 1)));
+        rehash(WHEEL_REHASH_TICK);
+    }
+
+    struct wheel_timer *tmp = wh.slots[wh.now & wh.mask];   /* 时间轮当前槽的头结点 */
+    LOG_DEBUG("The current slot is %ld", wh.now & wh.mask);
     while(tmp != NULL)
     {
-        printf("tick the timer once \n");
-        /* 如果定时器的ratation值大于0， 则它在这一轮不起作用 */
-        if(tmp->rotation > 0)
+        LOG_DEBUG("tick the timer once");
+        walked++;
+        /* 如果定时器还没到期，则它在这一轮不起作用 */
+        if(tmp->expire > wh.now)
         {
-            tmp->rotation--;
             tmp = tmp->next;   /* 指向该槽的下一个节点 */
         }
         /* 否则，说明定时器已经到期，于是执行定时任务，然后删除该定时器 */
         else{
+            wh.running = tmp;
             tmp->cb_func(tmp->user_data);
-            /* 如果是头结点 */
-            if(tmp == wh.slots[wh.cur_slot])
+            wh.running = NULL;
+
+            /* 回调函数可能删除了后面的定时器，回调返回之后再取下一个节点 */
+            struct wheel_timer *next = tmp->next;
+            unlink_timer(tmp);
+            if(tmp->interval > 0 && !tmp->cancelled)
             {
-                printf("delete header in cur_slot\n");
-                wh.slots[wh.cur_slot] = tmp->next;
-                free(tmp);
-                /* 该节点存在 */
-                if(wh.slots[wh.cur_slot] != NULL)
+                /* 周期定时器挂到interval个滴答之后的槽上，落在当前槽上时放在链表头，这一轮不会再被访问 */
+                int ticks = tmp->interval < SI ? 1 : tmp->interval / SI;
+                tmp->expire = wh.now + ticks;
+                if(tmp->slack >= SI)
                 {
-                    wh.slots[wh.cur_slot]->prev = NULL;
+                    tmp->expire = timer_coalesce(tmp->expire, tmp->slack / SI);
                 }
-                tmp = wh.slots[wh.cur_slot];      /* tmp指向头结点 */
+                link_timer(tmp);
             }
-            /* 不是头结点的情况 */
             else
             {
-                tmp->prev->next = tmp->next;
-                /* 下一个节点不为空 */
-                if(tmp->next != NULL)
-                {
-                    tmp->next->prev = tmp->prev;
-                }
-                struct wheel_timer *timer = tmp;
-                free(tmp);
-                tmp = timer;
+                arena_dealloc(wh.arena, tmp, sizeof(struct wheel_timer));
+                wh.count--;
             }
-        }        
+            tmp = next;     /* tmp指向下一个节点 */
+        }
+    }
+    if(walked > wh.longest)
+    {
+        wh.longest = walked;
     }
-    wh.cur_slot = (++wh.cur_slot) % N;   /* 更新时间轮的当前槽，以反映时间轮的转动 */
+    wh.now++;   /* 时间轮转动一个滴答，当前槽随之改变 */
+    check_resize();
 }
-
-int main(int argc, char *argv[])
-{
-    init_wheel();
-
-    return 0;
-}
\ No newline at end of file
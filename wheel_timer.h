@@ -5,7 +5,7 @@
 
 #define BUFFER_SIZE 64
 
-#define N   60        /* 时间轮上槽的数目 */
+#define N   64        /* 时间轮初始的槽数，也是最少的槽数，槽数总是2的幂 */
 #define SI  1        /* 每1秒时间轮转动一次，即槽间隔为1秒 */
 
 /* 用户数据结构：客户端socket地址、socket文件描述符、读缓存、定时器 */
@@ -19,8 +19,11 @@ struct client_data{
 
 /* 定时器结构体 */
 struct wheel_timer{
-    int rotation;                     /* 记录定时器在时间轮转多少圈之后生效 */
+    long expire;                      /* 定时器在时间轮转动到第几个滴答时到期 */
     int time_slot;                    /* 记录定时器属于时间轮的哪个槽(对应的链表) */
+    int interval;                     /* 周期定时器的间隔，0表示一次性定时器 */
+    int slack;                        /* 允许推迟到期的时间，周期定时器每次重新挂入时都按它折合 */
+    int cancelled;                    /* 在自己的回调函数中被删除，回调返回后再释放 */
     void (*cb_func) (struct client_data *);    /* 任务的回调函数 */
     struct client_data *user_data;             /* 回调函数处理的客户数据，由定时器的执行者传递给回调函数 */
     struct wheel_timer *prev;                   /* 指向前一个定时器 */
@@ -28,17 +31,38 @@ struct wheel_timer{
 };
 
 
-/* 时间轮 */
+/*
+ * 时间轮，定时器放在第(expire & mask)个槽上。定时器的平均数或者tick()遍历的
+ * 链表过长时槽数加倍，定时器很少时槽数减半。换槽数组时旧数组中的定时器在
+ * 之后的add_timer和tick()中逐步迁移，迁移完成之前两个数组同时使用
+ */
 struct wheel{
-    struct wheel_timer *slots[N];    /* 时间轮上的槽，其中每个元素指向一个定时器链表，链表无序 */
-    int cur_slot;                   /* 时间轮的当前槽 */
+    struct wheel_timer **slots;     /* 时间轮上的槽，其中每个元素指向一个定时器链表，链表无序 */
+    unsigned nslots;                /* 槽数 */
+    unsigned mask;                  /* nslots - 1 */
+    struct wheel_timer **old_slots; /* 正在迁移的旧槽数组，没有迁移时为NULL */
+    unsigned old_nslots;
+    unsigned migrate;               /* 旧槽数组中下一个要迁移的槽 */
+    unsigned count;                 /* 定时器总数 */
+    unsigned longest;               /* 上次换槽数组以来tick()遍历过的最长链表 */
+    unsigned resizes;               /* 换槽数组的次数 */
+    long now;                       /* 时间轮已经转动的滴答数，当前槽是第(now & mask)个 */
+    struct wheel_timer *running;    /* 正在执行回调函数的定时器 */
+    struct arena *arena;            /* 定时器和槽数组从这里分配，NULL时使用malloc */
 };
 
 
-struct wheel wh;
+extern struct wheel wh;
 
 
+struct arena;
+
+void init_wheel();
+void init_wheel_arena(struct arena *a);
 struct wheel_timer* add_timer(int timeout);
+struct wheel_timer* add_timer_slack(int timeout, int slack);
+struct wheel_timer* add_periodic_timer(int interval);
+struct wheel_timer* add_periodic_timer_slack(int interval, int slack);
 void del_timer(struct wheel_timer *timer);
 void tick();
 